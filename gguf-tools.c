@@ -2,10 +2,18 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <string.h>
+#include <strings.h>
 #include <assert.h>
 #include <errno.h>
 #include <math.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/utsname.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <dirent.h>
 
 #include "gguflib.h"
 #include "sds.h"
@@ -15,7 +23,25 @@
 struct {
     int verbose;        // --verbose option
     int diffable;       // --diffable option
-} Opt = {0};
+    int threads;        // --threads option
+    int io;             // --io option: GGUF_STREAM_* backend.
+    int stats;          // --stats option
+    int hugepages;      // --hugepages option
+    int csv;            // --csv option
+    const char *rows;   // --rows option
+    const char *cols;   // --cols option
+    uint64_t budget;    // --budget option, 0 = library default.
+    const char *to;     // --to option
+    const char *only;   // --only option
+} Opt = {0, 0, 1, GGUF_STREAM_MMAP, 0, 0, 0, NULL, NULL, 0, NULL, NULL};
+
+/* Number of weights dequantized at a time by subcommands processing
+ * tensors in chunks. A multiple of all the quantization block sizes. */
+#define DEQUANT_CHUNK 8192
+
+/* Number of weights per chunk when streaming tensors data with
+ * gguf_stream_open(). A multiple of DEQUANT_CHUNK. */
+#define STREAM_CHUNK (1<<20)
 
 /* ========================== Utility functions  ============================ */
 
@@ -142,19 +168,25 @@ int strmatch(const char *pattern, int patternLen,
 
 /* ========================== 'show' subcommand ============================= */
 
+/* Show the keys and tensors of a model, that may be split in many
+ * shards: the keys are the ones of the first shard, and the offsets of
+ * the tensors of a sharded model are prefixed by the shard number. */
 void gguf_tools_show(const char *filename) {
-    gguf_ctx *ctx = gguf_open(filename);
-    if (ctx == NULL) {
+    gguf_shards *model = gguf_shards_open(filename,GGUF_RDONLY);
+    if (model == NULL) {
         perror(filename);
         exit(1);
     }
+    gguf_ctx *ctx = gguf_shards_get_ctx(model,0);
 
     /* Show general information about the neural network. */
-    printf("%s (ver %d): %llu key-value pairs, %llu tensors\n",
+    printf("%s (ver %d): %llu key-value pairs, %llu tensors",
         filename,
         (int)ctx->header->version,
         (unsigned long long)ctx->header->metadata_kv_count,
-        (unsigned long long)ctx->header->tensor_count);
+        (unsigned long long)model->tensor_count);
+    if (model->count > 1) printf(", %u shards", model->count);
+    printf("\n");
 
     /* Show all the key-value pairs. */
     gguf_key key;
@@ -167,12 +199,19 @@ void gguf_tools_show(const char *filename) {
     /* Show all the tensors. */
     gguf_tensor tensor;
     uint64_t params = 0;
-    while (gguf_get_tensor(ctx,&tensor)) {
+    for (uint64_t t = 0; t < model->tensor_count; t++) {
+        uint32_t shard;
+        if (gguf_shards_get_tensor(model,t,&tensor,&shard) == 0) {
+            perror("Reading the tensors info");
+            exit(1);
+        }
         printf("%s tensor %.*s",
             gguf_get_tensor_type_name(tensor.type),
             (int)tensor.namelen,
             tensor.name);
-        if (!Opt.diffable)
+        if (!Opt.diffable && model->count > 1)
+            printf(" @%u:%" PRIu64, shard+1, tensor.offset);
+        else if (!Opt.diffable)
             printf(" @%" PRIu64, tensor.offset);
         printf(", %" PRIu64 " weights, dims ", tensor.num_weights);
         for (uint32_t j = 0; j < tensor.ndim; j++) {
@@ -181,196 +220,408 @@ void gguf_tools_show(const char *filename) {
         printf("]");
         if (!Opt.diffable)
             printf(", %" PRIu64 " bytes", tensor.bsize);
+        else
+            printf(", hash %016" PRIx64,
+                gguf_tensor_hash(model->ctx[shard],&tensor,Opt.threads));
         printf("\n");
 
         params += tensor.num_weights;
     }
     printf("gguf-tools.info.parameters: %.02fB\n",
         (double)params/1000000000);
-    return;
+    gguf_shards_close(model);
 }
 
-/* ======================= 'split-mixtral' subcommand ======================= */
+/* ===================== 'extract-experts' subcommand ===================== */
 
-/* Read a Mixtral MoE model and creates a new non-MoE GGUF file based
- * on the weights of the experts with IDs in the array of 'experts_id'.
- * The array must contain 32 integers, one for each layer. */
-void gguf_tools_split_mixtral(int *experts_id, const char *mixtral_filename, const char *output_filename) {
-    gguf_ctx *mixtral = gguf_open(mixtral_filename);
-    if (mixtral == NULL) {
-        perror(mixtral_filename);
-        exit(1);
+/* Experts selected for every layer: ids[layer], with the last ID used
+ * for all the following layers as well. */
+struct expert_selection {
+    int *ids;
+    int count;
+};
+
+static int expert_for_layer(struct expert_selection *sel, uint64_t layer) {
+    if (sel->count == 0) return 0;
+    if (layer >= (uint64_t)sel->count) layer = sel->count-1;
+    return sel->ids[layer];
+}
+
+/* A tensor of an output file: a source tensor, or the slice of the
+ * source 3-D tensor holding the weights of the selected expert. */
+struct extract_tensor {
+    sds name;               // Tensor name in the output file.
+    gguf_tensor src;        // Source data: offset, bsize and weights.
+};
+
+/* An output file of the extraction, with its growable tensors list. */
+struct extract_output {
+    const char *filename;
+    struct expert_selection sel;
+    gguf_ctx *src;          // Source model.
+    gguf_ctx *ctx;          // Output file.
+    struct extract_tensor *tensors;
+    uint64_t numtensors;
+    uint64_t alloc;
+    int err;                // errno of the data copy, or 0.
+};
+
+/* Kinds of MoE model tensors, see expert_tensor_kind(). */
+#define EXPERT_SHARED 0     // Not expert specific: copied as it is.
+#define EXPERT_ROUTER 1     // Experts gating: dropped.
+#define EXPERT_SINGLE 2     // One expert: blk.<layer>.ffn_up.<expert>.weight
+#define EXPERT_MERGED 3     // All the experts, 3-D: blk.<layer>.ffn_up_exps.weight
+
+/* Classify the tensor 'tn'. For expert tensors, *layer is set, and
+ * *outname to the tensor name in the extracted model (without the
+ * expert ID or the _exps suffix). For EXPERT_SINGLE, *expert is set
+ * to the tensor expert ID. */
+static int expert_tensor_kind(const char *tn, uint32_t ndim, uint64_t *layer, int *expert, sds *outname) {
+    if (strncmp(tn,"blk.",4) != 0 || !isdigit(tn[4])) return EXPERT_SHARED;
+    char *end;
+    *layer = strtoull(tn+4,&end,10);
+    if (*end != '.') return EXPERT_SHARED;
+
+    const char *ffn = strstr(end,".ffn_");
+    if (ffn == NULL) return EXPERT_SHARED;
+    if (strstr(ffn,".ffn_gate_inp") || strstr(ffn,"exp_probs_b"))
+        return EXPERT_ROUTER;
+
+    const char *exps = strstr(ffn,"_exps.");
+    if (exps && ndim == 3) {
+        *outname = sdscat(sdsnewlen(tn,exps-tn),exps+5);
+        return EXPERT_MERGED;
     }
 
-    gguf_ctx *output = gguf_create(output_filename, GGUF_NONE);
-    if (output == NULL) {
-        perror(output_filename);
+    const char *dot = strchr(ffn+1,'.');
+    if (dot && isdigit(dot[1])) {
+        long id = strtol(dot+1,&end,10);
+        if (*end == '.') {
+            *expert = id;
+            *outname = sdscat(sdsnewlen(tn,dot-tn),end);
+            return EXPERT_SINGLE;
+        }
+    }
+    return EXPERT_SHARED;
+}
+
+/* Append a tensor to the output tensors list. */
+static void extract_add_tensor(struct extract_output *out, sds name, gguf_tensor *src) {
+    if (out->numtensors == out->alloc) {
+        out->alloc = out->alloc ? out->alloc*2 : 256;
+        out->tensors = realloc(out->tensors,sizeof(*out->tensors)*out->alloc);
+        if (out->tensors == NULL) {
+            perror("Allocating tensors list");
+            exit(1);
+        }
+    }
+    out->tensors[out->numtensors].name = name;
+    out->tensors[out->numtensors].src = *src;
+    out->numtensors++;
+}
+
+/* Job of gguf_tools_extract_experts(): write the data of one output.
+ * The data is copied from file to file by the kernel when possible. */
+static void extract_job(void *privdata, uint64_t jobid) {
+    struct extract_output *out = (struct extract_output*)privdata + jobid;
+    for (uint64_t j = 0; j < out->numtensors; j++) {
+        if (gguf_append_tensor_from(out->ctx,out->src,&out->tensors[j].src) == 0) {
+            out->err = errno;
+            return;
+        }
+    }
+    if (gguf_flush(out->ctx) == 0) out->err = errno;
+}
+
+/* Read a MoE model and create, in a single pass, a non-MoE GGUF file for
+ * every one of the 'numout' outputs, with the weights of the experts
+ * selected for every layer. Both per-expert tensors and tensors holding
+ * all the experts (3-D, *_exps) are supported: in the latter case the
+ * slice of the selected expert is copied. Experts gating tensors and
+ * keys are dropped, all the rest is copied as it is. */
+void gguf_tools_extract_experts(const char *input_filename, struct extract_output *outputs, int numout) {
+    gguf_ctx *input = gguf_open_flags(input_filename,GGUF_RDONLY);
+    if (input == NULL || gguf_build_index(input) == 0) {
+        perror(input_filename);
         exit(1);
     }
 
-    /* To start, copy all the key value items, excluding the one
-     * related to the experts. */
+    /* Validate the selected IDs, if the number of experts is known,
+     * before creating any file. */
+    int64_t expert_count = -1;
     gguf_key key;
-    while (gguf_get_key(mixtral,&key)) {
+    while (gguf_get_key(input,&key)) {
+        const char *suffix = ".expert_count";
+        size_t slen = strlen(suffix);
+        if (key.namelen >= slen &&
+            !memcmp(key.name+key.namelen-slen,suffix,slen) &&
+            key.type == GGUF_VALUE_TYPE_UINT32)
+        {
+            expert_count = key.val->uint32;
+        }
+        gguf_do_with_value(input,key.type,key.val,NULL,0,0,NULL);
+    }
+    gguf_rewind(input);
+    for (int o = 0; o < numout; o++) {
+        for (int j = 0; j < outputs[o].sel.count; j++) {
+            int id = outputs[o].sel.ids[j];
+            if (expert_count >= 0 && id >= expert_count) {
+                fprintf(stderr,"Invalid expert ID %d for %s: the model has "
+                               "%" PRId64 " experts\n",
+                               id, outputs[o].filename, expert_count);
+                exit(1);
+            }
+        }
+    }
+
+    for (int o = 0; o < numout; o++) {
+        outputs[o].ctx = gguf_create(outputs[o].filename,GGUF_BUFFERED);
+        if (outputs[o].ctx == NULL) {
+            perror(outputs[o].filename);
+            exit(1);
+        }
+        /* The general.alignment key is copied: use the same alignment. */
+        outputs[o].ctx->alignment = input->alignment;
+        outputs[o].src = input;
+    }
+
+    /* To start, copy all the key value items, excluding the ones
+     * related to the experts. */
+    while (gguf_get_key(input,&key)) {
         char keybuf[1024];
         snprintf(keybuf,sizeof(keybuf),"%.*s",(int)key.namelen, key.name);
 
-        int skip = strstr(keybuf,"llama.expert_") != NULL;
+        int skip = strstr(keybuf,".expert_") != NULL;
 
-        if (!skip)
-            printf("Copying %s\n", keybuf);
-        uint64_t value_start_offset = mixtral->off;
-        void *value = mixtral->data+mixtral->off;
+        if (!skip) printf("Copying %s\n", keybuf);
+        uint64_t value_start_offset = input->off;
+        void *value = input->data+input->off;
         // Just consume the value without doing anything with it.
-        gguf_do_with_value(mixtral,key.type,key.val,NULL,0,0,NULL);
-        uint64_t value_len = mixtral->off - value_start_offset;
-
-        // Now append the value to the output model.
-        if (!skip)
-            gguf_append_kv(output,key.name,key.namelen,key.type,value,value_len);
-    }
-
-    /* Now it's time to copy the tensors. We need to copy all the shared
-     * tensors (between the different experts), but only a set of
-     * expert-specific tensors corresponding to the expert ID the user
-     * wants to extract. */
-    struct tensor_to_copy {
-        sds dest_name;          // Tensor name in the output file.
-        gguf_tensor orig_info;  // Original tensor info.
-        uint64_t dest_offset;   // Destination offset in output file.
-        uint64_t size;          // Tensor total bytes.
-    };
-
-    uint32_t num_tensors = 0;
-    uint32_t max_tensors = 2048;
-
-    struct tensor_to_copy *tensors =
-        malloc(sizeof(struct tensor_to_copy)*max_tensors);
-    if (tensors == NULL) {
-        perror("Allocating tensors info array");
-        exit(1);
-    }
-
-    /* Scan Mixtral tensors looking for the ones we need to copy
-     * in the output model. */
-    gguf_tensor tensor_info;
-    while (gguf_get_tensor(mixtral,&tensor_info)) {
-        assert(num_tensors < max_tensors);
-
-        char tn[1024]; // Tensor name as null terminated string.
-        snprintf(tn,sizeof(tn),"%.*s",(int)tensor_info.namelen, tensor_info.name);
-
-        /* The tensor is a feed-forward tensor? We want to copy only
-         * the ones of our expert ID. */
-        if (strstr(tn,".ffn_") != NULL && strstr(tn,".ffn_norm") == NULL) {
-            /* Extract which block this FFN belongs. */
-            int block;
-            assert(memcmp(tn,"blk.",4) == 0); // Must start with blk.<block>
-            char *p = strchr(tn+4,'.');
-            assert(p != NULL);
-            *p = 0;
-            block = atoi(tn+4);
-            *p = '.';
-            assert(block >= 0 && block < 32);
-
-            /* Now that we have the block, we can select the corresponding
-             * expert ID we want to use for this block. */
-            int expert_id = experts_id[block];
-
-            char match[32];
-            snprintf(match,sizeof(match),".%d.weight",expert_id);
-            char *match_ptr = strstr(tn,match);
-            if (match_ptr == NULL) {
-                printf("Skipping tensor %s\n", tn);
-                continue; // Skip this tensor.
-            }
-
-            /* We need to remove the .<id>. from the name. */
-            size_t taillen = strlen(match_ptr);
-            memmove(match_ptr,match_ptr+2,taillen+1);
-        }
-
-        /* Create the entry for this tensor. Later we will scan all our
-         * entries and append data to our output tensor. */
-        tensors[num_tensors].dest_name = sdsnew(tn);
-        if (tensors[num_tensors].dest_name == NULL) {
-            perror("Allocating test tensor name");
-            exit(1);
+        gguf_do_with_value(input,key.type,key.val,NULL,0,0,NULL);
+        uint64_t value_len = input->off - value_start_offset;
+
+        // Now append the value to the output models.
+        for (int o = 0; !skip && o < numout; o++) {
+            if (gguf_append_kv(outputs[o].ctx,key.name,key.namelen,key.type,
+                               value,value_len) == 0)
+            {
+                perror(outputs[o].filename);
+                exit(1);
+            }
+        }
+    }
+
+    /* Select the tensors of every output, scanning the source tensors
+     * a single time. */
+    for (uint64_t j = 0; j < input->header->tensor_count; j++) {
+        gguf_tensor *t = input->tensors+j;
+        sds tn = sdsnewlen(t->name,t->namelen);
+        sds outname = NULL;
+        uint64_t layer = 0;
+        int expert = 0;
+        int kind = expert_tensor_kind(tn,t->ndim,&layer,&expert,&outname);
+
+        for (int o = 0; o < numout; o++) {
+            struct extract_output *out = outputs+o;
+            int id = expert_for_layer(&out->sel,layer);
+            if (kind == EXPERT_SHARED) {
+                extract_add_tensor(out,sdsdup(tn),t);
+            } else if (kind == EXPERT_SINGLE && expert == id) {
+                extract_add_tensor(out,sdsdup(outname),t);
+            } else if (kind == EXPERT_MERGED) {
+                if ((uint64_t)id >= t->dim[2]) {
+                    fprintf(stderr,"Expert ID %d out of range for %s\n",id,tn);
+                    exit(1);
+                }
+                /* The experts are the outermost dimension: the slice
+                 * of every expert is contiguous. */
+                gguf_tensor slice = *t;
+                slice.ndim = 2;
+                slice.dim[2] = 0;
+                slice.num_weights = t->dim[0]*t->dim[1];
+                slice.bsize = t->bsize/t->dim[2];
+                slice.offset += slice.bsize*id;
+                slice.weights_data += slice.bsize*id;
+                extract_add_tensor(out,sdsdup(outname),&slice);
+            }
         }
-        tensors[num_tensors].orig_info = tensor_info;
-        tensors[num_tensors].size = tensor_info.bsize;
-        num_tensors++;
+        sdsfree(tn);
+        sdsfree(outname);
     }
 
     /* Now we need to set the offset for our destination tensors. As
      * we calculate the offsets, we can emit the tensors information
      * section as well. */
-    uint64_t tensor_off = 0; // Tensor offsets are relative to data section,
-                             // so we start at offset 0.
-    for (uint32_t j = 0; j < num_tensors; j++) {
-        /* Align offset. */
-        tensor_off += gguf_get_alignment_padding(mixtral->alignment,tensor_off);
-        tensors[j].dest_offset = tensor_off;
-        if (gguf_append_tensor_info(output,tensors[j].dest_name,strlen(tensors[j].dest_name),tensors[j].orig_info.ndim,tensors[j].orig_info.dim,tensors[j].orig_info.type,tensor_off) == 0)
-        {
-            perror("Failed to append tensor info");
-            exit(1);
+    for (int o = 0; o < numout; o++) {
+        struct extract_output *out = outputs+o;
+        uint64_t tensor_off = 0; // Tensor offsets are relative to data
+                                 // section, so we start at offset 0.
+        for (uint64_t j = 0; j < out->numtensors; j++) {
+            struct extract_tensor *et = out->tensors+j;
+            tensor_off += gguf_get_alignment_padding(out->ctx->alignment,tensor_off);
+            if (gguf_append_tensor_info(out->ctx,et->name,sdslen(et->name),
+                    et->src.ndim,et->src.dim,et->src.type,tensor_off) == 0)
+            {
+                perror("Failed to append tensor info");
+                exit(1);
+            }
+            tensor_off += et->src.bsize;
         }
-        tensor_off += tensors[j].orig_info.bsize;
+        uint64_t size = out->ctx->size;
+        size += gguf_get_alignment_padding(out->ctx->alignment,size);
+        printf("Writing %s: %" PRIu64 " tensors, %" PRIu64 " bytes\n",
+            out->filename, out->numtensors, size+tensor_off);
     }
-    printf("Output file: after writing tensors info, file size is: %" PRIu64 "\n", output->size);
 
-    /* Finally, append the tensors weights. */
-    for (uint32_t j = 0; j < num_tensors; j++) {
-        printf("Writing tensor %s (weights from %.*s)\n", tensors[j].dest_name,
-            (int)tensors[j].orig_info.namelen, tensors[j].orig_info.name);
-        if (gguf_append_tensor_data(output,tensors[j].orig_info.weights_data,
-            tensors[j].orig_info.bsize) == 0)
-        {
-            perror("Failed to append tensor data");
+    /* Finally, append the tensors weights: the outputs are written in
+     * parallel. */
+    gguf_parallel(Opt.threads,numout,extract_job,outputs);
+    for (int o = 0; o < numout; o++) {
+        struct extract_output *out = outputs+o;
+        if (out->err) {
+            errno = out->err;
+            perror(out->filename);
             exit(1);
         }
+        gguf_close(out->ctx);
+        for (uint64_t j = 0; j < out->numtensors; j++)
+            sdsfree(out->tensors[j].name);
+        free(out->tensors);
     }
+    gguf_close(input);
+}
+
+/* Parse a list of comma separated expert IDs into 'sel'. The IDs array
+ * is allocated with malloc(). Return 0 on syntax error. */
+static int parse_expert_selection(const char *spec, struct expert_selection *sel) {
+    sel->count = 0;
+    sel->ids = malloc(sizeof(int)*(strlen(spec)/2+1));
+    if (sel->ids == NULL) return 0;
+    while (1) {
+        char *end;
+        if (!isdigit(*spec)) return 0;
+        sel->ids[sel->count++] = strtol(spec,&end,10);
+        if (*end == 0) return 1;
+        if (*end != ',') return 0;
+        spec = end+1;
+    }
+}
+
+/* ======================= 'split-mixtral' subcommand ======================= */
+
+/* Read a Mixtral MoE model and creates a new non-MoE GGUF file based
+ * on the weights of the experts with IDs in the array of 'experts_id',
+ * one for each layer (the last one is used for the remaining layers).
+ * This is just a front-end to the 'extract-experts' engine. */
+void gguf_tools_split_mixtral(int *experts_id, int count, const char *mixtral_filename, const char *output_filename) {
+    struct extract_output out = {0};
+    out.filename = output_filename;
+    out.sel.ids = experts_id;
+    out.sel.count = count;
+    gguf_tools_extract_experts(mixtral_filename,&out,1);
     exit(0);
 }
 
 /* ====================== 'inspect-weights' subcommand ====================== */
 
+/* Parse a range like "5000:5010" (rows 5000 to 5009), "5000" (just one
+ * row), ":10" or "5000:" into [*first,*last), where 'max' is the number
+ * of rows (or columns). Exit with an error if the range is not valid. */
+static void parse_range(const char *opt, const char *str, uint64_t max, uint64_t *first, uint64_t *last) {
+    const char *colon = strchr(str,':');
+    char *end;
+    *first = 0;
+    *last = max;
+    if (str[0] != ':') {
+        *first = strtoull(str,&end,10);
+        if (end == str || (*end != ':' && *end != 0)) goto invalid;
+        if (colon == NULL) *last = *first+1;
+    }
+    if (colon && colon[1]) {
+        *last = strtoull(colon+1,&end,10);
+        if (end == colon+1 || *end != 0) goto invalid;
+    }
+    if (str[0] == '-' || (colon && colon[1] == '-') ||
+        *first >= *last || *last > max) goto invalid;
+    return;
+
+invalid:
+    fprintf(stderr,"Invalid %s range '%s': the tensor has %" PRIu64
+                   " %s\n", opt, str, max, opt);
+    exit(1);
+}
+
+/* Show the weights of the rows [r0,r1) and columns [c0,c1) of the tensor,
+ * one row after the other. The higher dimensions are flattened, so for a
+ * tensor with dimensions (cols, n, m) there are n*m rows. Only the blocks
+ * covering the selected weights of every row are decoded: since rows
+ * start at blocks boundaries, at most a block before the first column is
+ * decoded and discarded. */
+static void inspect_slice(gguf_tensor *t, uint64_t r0, uint64_t r1, uint64_t c0, uint64_t c1, uint64_t count) {
+    static float weights[DEQUANT_CHUNK];
+    struct gguf_tensor_type_features *tf =
+        gguf_get_tensor_type_features(t->type);
+    uint64_t ipb = tf ? tf->items_per_block : 1;
+    uint64_t printed = 0;
+
+    for (uint64_t r = r0; r < r1; r++) {
+        uint64_t start = r*t->dim[0] + c0;
+        uint64_t end = r*t->dim[0] + c1;
+        uint64_t pos = start - start % ipb; // Start of the first block.
+
+        printf("[%" PRIu64 "]:\n", r);
+        uint64_t col = 0;
+        while (pos < end) {
+            uint64_t chunk = end - pos;
+            if (chunk > DEQUANT_CHUNK) chunk = DEQUANT_CHUNK;
+            if (gguf_dequant_range(t,pos,chunk,weights) == 0) {
+                fprintf(stderr,"Unsupported tensor type: %s\n",
+                    gguf_get_tensor_type_name(t->type));
+                exit(1);
+            }
+            for (uint64_t j = pos < start ? start-pos : 0; j < chunk; j++) {
+                printed++;
+                int last = pos+j+1 == end || printed == count;
+                printf("%s%f%s", col % 4 == 0 ? "    " : "", weights[j],
+                       last ? "" : ", ");
+                if (last || col % 4 == 3) printf("\n");
+                col++;
+                if (printed == count) return;
+            }
+            pos += chunk;
+        }
+    }
+}
+
 void gguf_tools_inspect_weights(const char *filename, const char *tname, uint64_t count) {
-    gguf_ctx *ctx = gguf_open(filename);
-    if (ctx == NULL) {
+    gguf_shards *model = gguf_shards_open(filename,GGUF_RDONLY);
+    if (model == NULL) {
         perror(filename);
         exit(1);
     }
 
-    /* Skip all the key-value pairs. */
-    gguf_skip_key_values_section(ctx);
-
-    /* Look for the tensor with the specified name. */
-    size_t tnamelen = strlen(tname);
+    /* Look for the tensor with the specified name, in every shard. */
     gguf_tensor tensor;
-    while (gguf_get_tensor(ctx,&tensor)) {
-        if (tensor.namelen != tnamelen ||
-            memcmp(tensor.name,tname,tnamelen)) continue;
-        break; // Matching tensor found!
-    }
-
-    if (tensor.name == NULL) {
+    if (gguf_shards_find_tensor(model,tname,strlen(tname),&tensor,NULL) == 0) {
         fprintf(stderr, "A tensor with the specified name was not found\n");
         exit(1);
     }
 
-    float *weights = gguf_tensor_to_float(&tensor);
-    if (weights == NULL) {
-        if (errno == EINVAL) {
-            fprintf(stderr,"Unsupported tensor type: %s\n",
-                gguf_get_tensor_type_name(tensor.type));
-        } else {
-            fprintf(stderr,"Out of memory\n");
-        }
-        exit(1);
+    /* With --rows or --cols just show the selected slice. */
+    if (Opt.rows || Opt.cols) {
+        uint64_t numrows = tensor.num_weights / tensor.dim[0];
+        uint64_t r0 = 0, r1 = numrows, c0 = 0, c1 = tensor.dim[0];
+        if (Opt.rows) parse_range("rows",Opt.rows,numrows,&r0,&r1);
+        if (Opt.cols) parse_range("cols",Opt.cols,tensor.dim[0],&c0,&c1);
+        inspect_slice(&tensor,r0,r1,c0,c1,count);
+        gguf_shards_close(model);
+        return;
     }
 
+    /* Weights are dequantized one chunk at a time, as we print them,
+     * so that only the part of the tensor we show is decoded. */
+    static float weights[DEQUANT_CHUNK];
+
     uint64_t strides[GGUF_TENSOR_MAX_DIM] = {0};
     strides[tensor.ndim-1] = 1;
     for (int j = tensor.ndim - 2; j >= 0; j--) {
@@ -381,6 +632,15 @@ void gguf_tools_inspect_weights(const char *filename, const char *tname, uint64_
     uint64_t j = 0;
     int broke = 1;
     while (j < tensor.num_weights) {
+        if (j % DEQUANT_CHUNK == 0) {
+            uint64_t chunk = tensor.num_weights - j;
+            if (chunk > DEQUANT_CHUNK) chunk = DEQUANT_CHUNK;
+            if (gguf_dequant_range(&tensor,j,chunk,weights) == 0) {
+                fprintf(stderr,"Unsupported tensor type: %s\n",
+                    gguf_get_tensor_type_name(tensor.type));
+                exit(1);
+            }
+        }
         int last = j + 1 == tensor.num_weights;
         for (int k = 0; k < (int) tensor.ndim - 1; k++) {
             if (j % strides[k] == 0) {
@@ -390,7 +650,7 @@ void gguf_tools_inspect_weights(const char *filename, const char *tname, uint64_
         if (broke) {
             printf("%*s", tensor.ndim * ident, "");
         }
-        printf("%f%s", weights[j], last ? "" : ", ");
+        printf("%f%s", weights[j % DEQUANT_CHUNK], last ? "" : ", ");
         broke = 0;
         j++;
         for (int k = (int) tensor.ndim - 2; k >= 0; k--) {
@@ -409,168 +669,2208 @@ void gguf_tools_inspect_weights(const char *filename, const char *tname, uint64_
         if (j == count) break;
     }
     if (!broke) printf("\n");
-    free(weights);
-    return;
+    gguf_shards_close(model);
 }
 
 /* ========================== 'compare' subcommand ========================== */
 
-/* Given two tensors of the same length, return the average difference
- * of their weights, in percentage.
+/* Statistics about the difference of two tensors, computed by
+ * tensors_diff_stats(). */
+struct tensor_diff_stats {
+    double avg_diff;    // Average weights difference in percentage.
+    double rmse;        // Root mean squared error.
+    double max_err;     // Maximum absolute difference of two weights.
+    double cosine;      // Cosine similarity of the two tensors.
+};
+
+/* Partial sums of a chunk of weights. */
+struct diff_sums {
+    double mag;         // Sum of the absolute values of both tensors.
+    double diff;        // Sum of the absolute differences.
+    double sqerr;       // Sum of the squared differences.
+    double maxerr;      // Max absolute difference.
+    double dot;         // Dot product of the two tensors.
+    double norm1, norm2;// Sum of the squared weights of each tensor.
+};
+
+/* Compute the sums of 'count' weights, up to DEQUANT_CHUNK, starting at
+ * the weight 'first' of both tensors. Return 0 if one of the tensors
+ * can't be dequantized. */
+int diff_sums_chunk(gguf_tensor *t1, gguf_tensor *t2, uint64_t first, uint64_t count, struct diff_sums *s) {
+    float weights1[DEQUANT_CHUNK], weights2[DEQUANT_CHUNK];
+    if (gguf_dequant_range(t1,first,count,weights1) == 0 ||
+        gguf_dequant_range(t2,first,count,weights2) == 0) return 0;
+
+    /* All the statistics are accumulated in the same loop, while the
+     * chunk is still in the L1/L2 cache. */
+    memset(s,0,sizeof(*s));
+    for (uint64_t j = 0; j < count; j++) {
+        double w1 = weights1[j], w2 = weights2[j];
+        double err = fabs(w1-w2);
+        s->mag += fabs(w1) + fabs(w2);
+        s->diff += err;
+        s->sqerr += err*err;
+        if (err > s->maxerr) s->maxerr = err;
+        s->dot += w1*w2;
+        s->norm1 += w1*w1;
+        s->norm2 += w2*w2;
+    }
+    return 1;
+}
+
+/* Given two tensors of the same length, compute the statistics about
+ * their difference described in struct tensor_diff_stats.
  *
- * The difference is calculated like that: the average of the absolute values
- * of all the weights in the two vectors is calculated. Then, for each set
- * of corresponding weights, we calculate the difference, and the percentage
- * according to the average value (100%). The function returns the average
- * of the percentage of difference between all the pairs.
+ * The average difference is calculated like that: the average of the
+ * absolute values of all the weights in the two vectors is calculated.
+ * Then, for each set of corresponding weights, we calculate the difference,
+ * and the percentage according to the average value (100%). The
+ * average of the percentage of difference between all the pairs is
+ * reported.
+ *
+ * The tensors are never dequantized as a whole: the data of both tensors
+ * is streamed in chunks, using the --io backend, and all the sums are
+ * computed in a single pass, so the memory used does not depend on the
+ * tensors size.
  *
  * Returns 1 on success, 0 if one or both the provided tensors can't be
- * dequantized. */
-int tensors_avg_diff(gguf_tensor *t1, gguf_tensor *t2, double *diff) {
-    float *weights1 = gguf_tensor_to_float(t1);
-    float *weights2 = gguf_tensor_to_float(t2);
-    if (weights1 == NULL || weights2 == NULL) {
-        free(weights1);
-        free(weights2);
+ * dequantized. On I/O errors the program exits. */
+int tensors_diff_stats(gguf_ctx *ctx1, gguf_tensor *t1, gguf_ctx *ctx2, gguf_tensor *t2, struct tensor_diff_stats *stats) {
+    if (!gguf_can_dequantize(t1->type) || !gguf_can_dequantize(t2->type))
         return 0;
+
+    gguf_stream *s1 = gguf_stream_open(ctx1,t1,1,STREAM_CHUNK,Opt.io);
+    gguf_stream *s2 = gguf_stream_open(ctx2,t2,1,STREAM_CHUNK,Opt.io);
+    if (s1 == NULL || s2 == NULL) {
+        perror("Opening the tensors stream");
+        exit(1);
     }
 
-    /* Compute the average magnitude of the weights. */
-    double tot_mag = 0;
-    for (uint64_t j = 0; j < t1->num_weights; j++) {
-        tot_mag += fabs(weights1[j]);
-        tot_mag += fabs(weights2[j]);
+    /* Both streams return chunks of the same number of weights. The
+     * sums are added one DEQUANT_CHUNK at a time, always in the
+     * same order. */
+    struct diff_sums tot = {0};
+    gguf_tensor c1, c2;
+    int r1, r2;
+    while ((r1 = gguf_stream_next(s1,&c1,NULL,NULL)) == 1 &&
+           (r2 = gguf_stream_next(s2,&c2,NULL,NULL)) == 1)
+    {
+        for (uint64_t j = 0; j < c1.num_weights; j += DEQUANT_CHUNK) {
+            uint64_t count = c1.num_weights - j;
+            if (count > DEQUANT_CHUNK) count = DEQUANT_CHUNK;
+            struct diff_sums s;
+            if (diff_sums_chunk(&c1,&c2,j,count,&s) == 0) {
+                fprintf(stderr,"Dequantization of a chunk failed\n");
+                exit(1);
+            }
+            tot.mag += s.mag;
+            tot.diff += s.diff;
+            tot.sqerr += s.sqerr;
+            if (s.maxerr > tot.maxerr) tot.maxerr = s.maxerr;
+            tot.dot += s.dot;
+            tot.norm1 += s.norm1;
+            tot.norm2 += s.norm2;
+        }
+    }
+    if (r1 == -1 || r2 == -1) {
+        perror("Reading the tensors data");
+        exit(1);
     }
-    double avg_mag = tot_mag/(t1->num_weights*2);
+    gguf_stream_close(s1);
+    gguf_stream_close(s2);
+
+    /* Compute the average magnitude of the weights. */
+    double avg_mag = tot.mag/(t1->num_weights*2);
 
     /* Compute the average % difference of the weights. */
-    double tot_diff = 0;
-    for (uint64_t j = 0; j < t1->num_weights; j++)
-        tot_diff += fabs(weights1[j]-weights2[j]);
-    double avg_diff = tot_diff / t1->num_weights;
+    double avg_diff = tot.diff / t1->num_weights;
 
     /* Multiply by 75 to normalize the difference of a
      * random variable between -N and +N to 0 - 100% */
-    *diff = avg_diff / avg_mag * 75;
+    stats->avg_diff = avg_diff / avg_mag * 75;
+    stats->rmse = sqrt(tot.sqerr / t1->num_weights);
+    stats->max_err = tot.maxerr;
 
-    free(weights1);
-    free(weights2);
+    /* Two all-zero tensors are identical, a single all-zero tensor is
+     * not similar to anything. */
+    if (tot.norm1 == 0 || tot.norm2 == 0)
+        stats->cosine = (tot.norm1 == tot.norm2) ? 1 : 0;
+    else
+        stats->cosine = tot.dot / (sqrt(tot.norm1)*sqrt(tot.norm2));
     return 1;
 }
 
+/* A pair of tensors with the same name in the two compared files. */
+struct compare_pair {
+    gguf_tensor t1, t2;
+    gguf_ctx *c1, *c2;  // Shards holding the two tensors.
+    int status;         // COMPARE_* state / result, see below.
+    struct tensor_diff_stats stats; // Result of tensors_diff_stats().
+};
+
+#define COMPARE_PENDING 0       // Not yet processed.
+#define COMPARE_OK 1            // Done, 'stats' is set.
+#define COMPARE_SIZE_MISMATCH 2 // The tensors have a different length.
+#define COMPARE_NO_DEQUANT 3    // Dequantization function missing.
+#define COMPARE_IDENTICAL 4     // Same type, shape and data.
+
+/* State shared by the compare workers. Pairs are processed in the order
+ * of the 'sched' array (largest tensors first, so that a big tensor
+ * does not end up running alone at the end), but printed in file order:
+ * whoever completes the pair at 'next_to_print' prints all the pairs
+ * already completed from there on.
+ *
+ * With the mmap backend every job also asks the kernel to read ahead
+ * the pair that will be fetched 'Opt.threads' jobs later. */
+struct compare_state {
+    struct compare_pair *pairs;
+    struct compare_pair **sched;
+    uint64_t numpairs;
+    uint64_t next_to_print;
+    pthread_mutex_t lock;
+};
+
+void compare_print_pair(struct compare_pair *p) {
+    printf("[%.*s]: ", (int)p->t1.namelen, p->t1.name);
+    if (p->status == COMPARE_SIZE_MISMATCH) {
+        printf("size mismatch\n");
+    } else if (p->status == COMPARE_IDENTICAL) {
+        printf("identical\n");
+    } else if (p->status == COMPARE_OK) {
+        printf("avg weights difference: %f%%, rmse: %g, max err: %g, "
+               "cosine: %f\n", p->stats.avg_diff, p->stats.rmse,
+               p->stats.max_err, p->stats.cosine);
+    } else {
+        printf("dequantization function missing...\n");
+    }
+}
+
+/* Return true if the two tensors have the same type, shape and data.
+ * If both files have the tensors hashes (computed by the 'index'
+ * subcommand and stored in the sidecar), the data is not read at all,
+ * otherwise it is compared byte by byte, that is faster than hashing
+ * both tensors. Either way nothing is dequantized. */
+int tensors_identical(gguf_ctx *ctx1, gguf_tensor *t1, gguf_ctx *ctx2, gguf_tensor *t2) {
+    if (t1->type != t2->type || t1->ndim != t2->ndim ||
+        t1->bsize != t2->bsize) return 0;
+    for (uint32_t j = 0; j < t1->ndim; j++)
+        if (t1->dim[j] != t2->dim[j]) return 0;
+
+    uint64_t h1, h2;
+    if (gguf_cached_tensor_hash(ctx1,t1,&h1) &&
+        gguf_cached_tensor_hash(ctx2,t2,&h2)) return h1 == h2;
+    return memcmp(t1->weights_data,t2->weights_data,t1->bsize) == 0;
+}
+
+/* Tell the kernel the data of the pair will be needed soon. */
+void compare_prefetch_pair(struct compare_state *st, uint64_t jobid) {
+    if (Opt.io != GGUF_STREAM_MMAP || jobid >= st->numpairs) return;
+    struct compare_pair *p = st->sched[jobid];
+    gguf_advise_tensor(p->c1,&p->t1,GGUF_ADVICE_WILLNEED);
+    gguf_advise_tensor(p->c2,&p->t2,GGUF_ADVICE_WILLNEED);
+}
+
+void compare_job(void *privdata, uint64_t jobid) {
+    struct compare_state *st = privdata;
+    struct compare_pair *p = st->sched[jobid];
+    int status;
+
+    compare_prefetch_pair(st,jobid+Opt.threads);
+
+    /* Every tensor pair is handled by a single thread: parallelism comes
+     * from processing different pairs at the same time. The streams
+     * release the pages of processed chunks (mmap backend) or don't use
+     * the mapping at all, so the memory usage does not grow with the
+     * size of the compared files. */
+    if (p->t1.num_weights != p->t2.num_weights) {
+        status = COMPARE_SIZE_MISMATCH;
+    } else if (tensors_identical(p->c1,&p->t1,p->c2,&p->t2)) {
+        status = COMPARE_IDENTICAL;
+    } else if (tensors_diff_stats(p->c1,&p->t1,p->c2,&p->t2,&p->stats)) {
+        status = COMPARE_OK;
+    } else {
+        status = COMPARE_NO_DEQUANT;
+    }
+
+    pthread_mutex_lock(&st->lock);
+    p->status = status;
+    while (st->next_to_print < st->numpairs &&
+           st->pairs[st->next_to_print].status != COMPARE_PENDING)
+    {
+        compare_print_pair(st->pairs+st->next_to_print);
+        st->next_to_print++;
+    }
+    fflush(stdout);
+    pthread_mutex_unlock(&st->lock);
+}
+
+/* qsort() comparator for the compare schedule: bigger tensors first,
+ * then file order. */
+int compare_sched_cmp(const void *a, const void *b) {
+    const struct compare_pair *pa = *(struct compare_pair**)a;
+    const struct compare_pair *pb = *(struct compare_pair**)b;
+    if (pa->t1.num_weights != pb->t1.num_weights)
+        return pa->t1.num_weights > pb->t1.num_weights ? -1 : 1;
+    return pa < pb ? -1 : (pa > pb);
+}
+
+/* Compare the tensors with the same name of two models, any of them
+ * may be split in many shards. */
 void gguf_tools_compare(const char *file1, const char *file2) {
-    gguf_ctx *ctx1 = gguf_open(file1);
-    if (ctx1 == NULL) {
+    gguf_shards *m1 = gguf_shards_open(file1,GGUF_RDONLY);
+    if (m1 == NULL) {
         perror(file1);
         exit(1);
     }
 
-    gguf_ctx *ctx2 = gguf_open(file2);
-    if (ctx2 == NULL) {
+    gguf_shards *m2 = gguf_shards_open(file2,GGUF_RDONLY);
+    if (m2 == NULL) {
         perror(file2);
         exit(1);
     }
 
-    /* Skip all the key-value pairs. */
-    gguf_skip_key_values_section(ctx1);
+    /* The tensors of the first model are in the order we'll use for the
+     * output, the index of the second is used to lookup tensors by name
+     * in O(1). */
+    if (gguf_shards_build_index(m2) == 0) {
+        perror(file2);
+        exit(1);
+    }
 
-    /* For each tensor of the first net... */
-    gguf_tensor tensor1, tensor2;
-    while (gguf_get_tensor(ctx1,&tensor1)) {
-        gguf_skip_key_values_section(ctx2);
-        while (gguf_get_tensor(ctx2,&tensor2)) {
-            /* Search for a tensor with the same name. */
-            if (tensor2.namelen == tensor1.namelen &&
-                memcmp(tensor2.name,tensor1.name,tensor1.namelen) == 0)
-            {
-                printf("[%.*s]: ", (int)tensor1.namelen, tensor1.name);
-                fflush(stdout);
-                if (tensor1.num_weights != tensor2.num_weights) {
-                    printf("size mismatch\n");
-                } else {
-                    double diff;
-                    if (tensors_avg_diff(&tensor1, &tensor2, &diff)) {
-                        printf("avg weights difference: %f%%\n", diff);
-                    } else {
-                        printf("dequantization function missing...\n");
-                    }
-                }
-            }
+    /* Collect the pairs of tensors with the same name. */
+    uint64_t count = m1->tensor_count;
+    struct compare_state st = {0};
+    st.pairs = calloc(count ? count : 1, sizeof(*st.pairs));
+    st.sched = malloc(sizeof(*st.sched)*(count ? count : 1));
+    if (st.pairs == NULL || st.sched == NULL) {
+        perror("Allocating the compare state");
+        exit(1);
+    }
+    for (uint64_t j = 0; j < count; j++) {
+        struct compare_pair *p = st.pairs+st.numpairs;
+        uint32_t s1, s2;
+        if (gguf_shards_get_tensor(m1,j,&p->t1,&s1) == 0) {
+            perror(file1);
+            exit(1);
         }
-        gguf_rewind(ctx2);
+        if (gguf_shards_find_tensor(m2,p->t1.name,p->t1.namelen,&p->t2,&s2) == 0)
+            continue;
+        p->c1 = m1->ctx[s1];
+        p->c2 = m2->ctx[s2];
+        st.sched[st.numpairs] = p;
+        st.numpairs++;
     }
+    qsort(st.sched,st.numpairs,sizeof(*st.sched),compare_sched_cmp);
+
+    /* Every tensor is read once, sequentially. Start reading the pairs
+     * processed by the first jobs. */
+    for (uint32_t j = 0; j < m1->count; j++)
+        if (m1->ctx[j]) gguf_advise(m1->ctx[j],GGUF_ADVICE_SEQUENTIAL);
+    for (uint32_t j = 0; j < m2->count; j++)
+        if (m2->ctx[j]) gguf_advise(m2->ctx[j],GGUF_ADVICE_SEQUENTIAL);
+    for (int j = 0; j < Opt.threads; j++) compare_prefetch_pair(&st,j);
+
+    pthread_mutex_init(&st.lock,NULL);
+    gguf_parallel(Opt.threads,st.numpairs,compare_job,&st);
+    pthread_mutex_destroy(&st.lock);
+    free(st.pairs);
+    free(st.sched);
+    gguf_shards_close(m1);
+    gguf_shards_close(m2);
 }
 
-/* ======================= Main and CLI options parsing ===================== */
+/* ===================== 'split' and 'merge' subcommands ==================== */
 
-void gguf_tools_usage(const char *progname) {
-    printf("Usage: %s <subcommand> [arguments...] [options...]\n"
-"Subcommands:\n"
-"  show <filename> -- show GGUF model keys and tensors.\n"
-"  inspect-tensor <filename> <tensor-name> [count] -- show tensor weights.\n"
-"  compare <file1> <file2> -- avg weights diff for matching tensor names.\n"
-"  split-mixtral <ids...> mixtral.gguf out.gguf -- extract expert.\n"
-"Options:\n"
-"  --verbose       :With 'show', print full arrays (e.g. token lists)\n"
-"  --diffable      :Don't show tensor file offsets and sizes\n"
-"Example:\n"
-"  split-mixtral 65230776370407150546470161412165 mixtral.gguf out.gguf\n"
-           , progname);
-    exit(1);
+/* At most this number of outputs of gguf_tools_reshard() are written at
+ * the same time when --threads is not given: every one has its own file
+ * descriptor and staging buffer. */
+#define RESHARD_WRITERS 8
+
+/* An output file of gguf_tools_reshard(), with the range of the model
+ * tensors it holds. */
+struct reshard_output {
+    sds filename;
+    uint64_t first;         // Number of the first tensor in the model.
+    uint64_t count;         // Number of tensors.
+    uint64_t size;          // Bytes of tensors data, padding included.
+    int err;                // errno of the output, or 0.
+};
+
+/* A key-value pair of the first source shard, copied to the outputs. */
+struct reshard_key {
+    const char *name;
+    uint64_t namelen;
+    uint32_t type;
+    void *value;
+    uint64_t value_len;
+};
+
+struct reshard_state {
+    gguf_shards *model;
+    struct reshard_output *outputs;
+    uint64_t numout;
+    int split;                  // Write the split.* keys.
+    struct reshard_key *keys;   // Split keys of the source excluded.
+    uint64_t numkeys;
+};
+
+/* Return true if the key is one of the split.* keys of the shards. */
+static int is_split_key(const char *name, size_t namelen) {
+    return namelen > 6 && !memcmp(name,"split.",6);
 }
 
-int main(int argc, char **argv) {
-    if (argc < 3) gguf_tools_usage(argv[0]);
+/* Write the header of the output number 'o': the first output gets all
+ * the keys, the others just the alignment, that is needed to read them.
+ * Return 1 on success, 0 on error. */
+static int reshard_write_header(struct reshard_state *st, uint64_t o, gguf_ctx *ctx) {
+    struct reshard_output *out = st->outputs+o;
+    for (uint64_t j = 0; j < st->numkeys; j++) {
+        struct reshard_key *k = st->keys+j;
+        if (o != 0 && !(k->namelen == strlen("general.alignment") &&
+            !memcmp(k->name,"general.alignment",k->namelen))) continue;
+        if (gguf_append_kv(ctx,k->name,k->namelen,k->type,
+                           k->value,k->value_len) == 0) return 0;
+    }
+    if (st->split) {
+        uint16_t no = o, count = st->numout;
+        int32_t tensors = st->model->tensor_count;
+        if (gguf_append_kv(ctx,"split.no",8,
+                GGUF_VALUE_TYPE_UINT16,&no,sizeof(no)) == 0 ||
+            gguf_append_kv(ctx,"split.count",11,
+                GGUF_VALUE_TYPE_UINT16,&count,sizeof(count)) == 0 ||
+            gguf_append_kv(ctx,"split.tensors.count",19,
+                GGUF_VALUE_TYPE_INT32,&tensors,sizeof(tensors)) == 0)
+            return 0;
+    }
 
-    /* Parse options before getting into subcommands parsing. */
-    for (int j = 1; j < argc; j++) {
-        /* Every time we find a an option, we try to parse it
-         * and set the used argv[] entires to NULL. Later we remove
-         * the NULL entries. In this way '--options' can be anywhere,
-         * making the tool simpler to use. */
-        if (!strcmp(argv[j],"--verbose")) {
-            argv[j] = NULL;
-            argc--;
-            Opt.verbose = 1;
+    /* Emit the tensors info, computing the data offsets. */
+    uint64_t tensor_off = 0;
+    for (uint64_t j = out->first; j < out->first+out->count; j++) {
+        gguf_tensor t;
+        if (gguf_shards_get_tensor(st->model,j,&t,NULL) == 0) return 0;
+        tensor_off += gguf_get_alignment_padding(ctx->alignment,tensor_off);
+        if (gguf_append_tensor_info(ctx,t.name,t.namelen,
+                t.ndim,t.dim,t.type,tensor_off) == 0) return 0;
+        tensor_off += t.bsize;
+    }
+    uint64_t size = ctx->size;
+    size += gguf_get_alignment_padding(ctx->alignment,size);
+    printf("Writing %s: %" PRIu64 " tensors, %" PRIu64 " bytes\n",
+        out->filename, out->count, size+tensor_off);
+    return 1;
+}
+
+/* Job of gguf_tools_reshard(): create one output and write its header
+ * and tensors data. The data is copied from file to file by the kernel
+ * when possible. The output is closed before the job returns, so only
+ * the outputs being written by the workers are open. */
+static void reshard_job(void *privdata, uint64_t jobid) {
+    struct reshard_state *st = privdata;
+    struct reshard_output *out = st->outputs+jobid;
+    gguf_ctx *ctx = gguf_create(out->filename,GGUF_BUFFERED);
+    if (ctx == NULL) {
+        out->err = errno;
+        return;
+    }
+    ctx->alignment = st->model->ctx[0]->alignment;
+
+    int ok = reshard_write_header(st,jobid,ctx);
+    for (uint64_t j = out->first; ok && j < out->first+out->count; j++) {
+        gguf_tensor t;
+        uint32_t shard;
+        ok = gguf_shards_get_tensor(st->model,j,&t,&shard) &&
+             gguf_append_tensor_from(ctx,st->model->ctx[shard],&t);
+    }
+    if (ok) ok = gguf_flush(ctx);
+    if (!ok) out->err = errno;
+    gguf_close(ctx);
+}
+
+/* Write the model 'input', that may be split in many shards, to new
+ * files. If 'max_size' is 0 a single file named 'output' is created,
+ * otherwise shards named like GGUF_SHARD_FORMAT after the prefix
+ * 'output', each holding at most 'max_size' bytes of tensors data (but
+ * at least one tensor). Like the split files of llama.cpp, the first
+ * shard has all the key-value pairs, and every shard has the split.no,
+ * split.count and split.tensors.count keys.
+ *
+ * The outputs are written by --threads workers (RESHARD_WRITERS if not
+ * given), that take them from the jobs queue: every output is still
+ * written, header and data, by exactly one thread, and at most one
+ * output per worker is open at any time, however many shards there
+ * are. */
+void gguf_tools_reshard(const char *input, const char *output, uint64_t max_size) {
+    gguf_shards *model = gguf_shards_open(input,GGUF_RDONLY);
+    if (model == NULL || gguf_shards_build_index(model) == 0) {
+        perror(input);
+        exit(1);
+    }
+    gguf_ctx *first = model->ctx[0];
+
+    /* Assign the tensors to the outputs, in order. */
+    struct reshard_output *outputs = NULL;
+    uint64_t numout = 0;
+    for (uint64_t j = 0; j < model->tensor_count || numout == 0; j++) {
+        gguf_tensor t = {0};
+        if (j < model->tensor_count &&
+            gguf_shards_get_tensor(model,j,&t,NULL) == 0)
+        {
+            perror(input);
+            exit(1);
         }
-        if (!strcmp(argv[j],"--diffable")) {
-            argv[j] = NULL;
-            argc--;
-            Opt.diffable = 1;
+        struct reshard_output *out = numout ? outputs+numout-1 : NULL;
+        uint64_t padding = out ?
+            gguf_get_alignment_padding(first->alignment,out->size) : 0;
+        if (out == NULL || (max_size && out->count &&
+                            out->size+padding+t.bsize > max_size))
+        {
+            outputs = realloc(outputs,sizeof(*outputs)*(numout+1));
+            if (outputs == NULL) {
+                perror("Allocating the outputs");
+                exit(1);
+            }
+            out = outputs+numout++;
+            memset(out,0,sizeof(*out));
+            out->first = j;
+            padding = 0;
         }
+        if (j == model->tensor_count) break; // Model without tensors.
+        out->size += padding+t.bsize;
+        out->count++;
+    }
+    if (max_size && numout > UINT16_MAX) {
+        fprintf(stderr,"Too many shards (%" PRIu64 "): use a bigger size\n",
+            numout);
+        exit(1);
+    }
+    for (uint64_t o = 0; o < numout; o++) {
+        if (max_size)
+            outputs[o].filename = sdscatprintf(sdsempty(),GGUF_SHARD_FORMAT,
+                (int)strlen(output),output,(unsigned)o+1,(unsigned)numout);
+        else
+            outputs[o].filename = sdsnew(output);
+    }
+
+    /* Collect the keys to copy once: scanning them moves the offset of
+     * the source context, that the workers can't share. The split keys
+     * of the source are replaced by ours. */
+    struct reshard_state st = {model, outputs, numout, max_size != 0, NULL, 0};
+    st.keys = malloc(sizeof(*st.keys)*(first->header->metadata_kv_count+1));
+    if (st.keys == NULL) {
+        perror("Allocating the keys");
+        exit(1);
+    }
+    gguf_key key;
+    gguf_rewind(first);
+    while (gguf_get_key(first,&key)) {
+        void *value = first->data+first->off;
+        uint64_t value_start_offset = first->off;
+        gguf_do_with_value(first,key.type,key.val,NULL,0,0,NULL);
+        uint64_t value_len = first->off - value_start_offset;
+        if (is_split_key(key.name,key.namelen)) continue;
+        st.keys[st.numkeys++] = (struct reshard_key)
+            {key.name, key.namelen, key.type, value, value_len};
     }
 
-    /* Strip empty elements. */
-    for (int j = 1; j < argc; j++) {
-        if (argv[j] == NULL) {
-            memmove(argv+j, argv+j+1, sizeof(char*) * (argc-j));
+    gguf_parallel(Opt.threads > 1 ? Opt.threads : RESHARD_WRITERS,
+                  numout,reshard_job,&st);
+    for (uint64_t o = 0; o < numout; o++) {
+        struct reshard_output *out = outputs+o;
+        if (out->err) {
+            errno = out->err;
+            perror(out->filename);
+            exit(1);
         }
+        sdsfree(out->filename);
+    }
+    free(st.keys);
+    free(outputs);
+    gguf_shards_close(model);
+}
+
+/* Parse a size like 4096, 500M or 4G (powers of 1024). Return 0 if the
+ * size is not valid. */
+static uint64_t parse_size(const char *str) {
+    char *end;
+    errno = 0;
+    uint64_t size = strtoull(str,&end,10);
+    if (end == str || errno || str[0] == '-') return 0;
+    switch(toupper(*end)) {
+    case 'T': size *= 1024; /* fall through */
+    case 'G': size *= 1024; /* fall through */
+    case 'M': size *= 1024; /* fall through */
+    case 'K': size *= 1024; end++; break;
     }
+    return *end ? 0 : size;
+}
 
-    if (!strcmp(argv[1],"show") && argc == 3) {
-        gguf_tools_show(argv[2]);
-    } else if (!strcmp(argv[1],"compare") && argc == 4) {
-        gguf_tools_compare(argv[2],argv[3]);
-    } else if (!strcmp(argv[1],"inspect-tensor") && (argc == 4 || argc == 5)) {
-        gguf_tools_inspect_weights(argv[2],argv[3],
-                                   argc == 5 ? atoi(argv[4]) : 0);
-    } else if (!strcmp(argv[1],"split-mixtral") && argc == 5) {
-        int experts[32];
-        size_t elen = strlen(argv[2]);
-        for (size_t j = 0; j < 32; j++) {
-            if (j < elen) {
-                experts[j] = argv[2][j] - '0';
-                if (experts[j] < 0 || experts[j] > 7) {
-                    fprintf(stderr,"Invalid expert ID: %d\n", experts[j]);
-                    exit(1);
-                }
-            } else {
-                /* If there aren't 32 digits in the input, use the last
-                 * one repeated up to the last layer. */
-                experts[j] = j > 1 ? experts[j-1] : 0;
-            }
+/* ========================= 'quantize' subcommand ========================= */
+
+/* Return the tensor type with the given name (case insensitive, for
+ * instance "q4_k" or "F16"), or -1 if there is no such type. */
+int tensor_type_by_name(const char *name) {
+    for (uint32_t j = 0; j < GGUF_TYPE_COUNT; j++) {
+        const char *tn = gguf_get_tensor_type_name(j);
+        if (tn && !strcasecmp(tn,name)) return j;
+    }
+    return -1;
+}
+
+/* The llama.cpp general.file_type value for a model quantized to
+ * the specified type. */
+uint32_t file_type_for_tensor_type(uint32_t type) {
+    switch(type) {
+    case GGUF_TYPE_F32: return 0;
+    case GGUF_TYPE_F16: return 1;
+    case GGUF_TYPE_Q4_0: return 2;
+    case GGUF_TYPE_Q8_0: return 7;
+    case GGUF_TYPE_Q4_K: return 15; // Q4_K_M
+    case GGUF_TYPE_Q6_K: return 18;
+    case GGUF_TYPE_BF16: return 32;
+    default: return 0;
+    }
+}
+
+/* Per tensor type override: tensors matching 'pattern' are
+ * converted to 'type'. */
+struct quantize_rule {
+    const char *pattern;
+    int patternlen;
+    uint32_t type;
+};
+
+/* Select the output type of a tensor. The first matching rule wins.
+ * Without a matching rule, 1-D tensors (biases, norms) and the norm
+ * tensors are kept in F32, everything else uses 'default_type'.
+ *
+ * Quantized formats need a whole number of blocks per row: when the
+ * row length is not compatible with the type block size, Q8_0 or F16
+ * are used instead. */
+uint32_t quantize_tensor_type(gguf_tensor *t, uint32_t default_type, struct quantize_rule *rules, int numrules) {
+    uint32_t type = default_type;
+    int j;
+    for (j = 0; j < numrules; j++) {
+        if (strmatch(rules[j].pattern,rules[j].patternlen,
+                     t->name,t->namelen,0))
+        {
+            type = rules[j].type;
+            break;
+        }
+    }
+    if (j == numrules &&
+        (t->ndim == 1 || strmatch("*norm*",6,t->name,t->namelen,0)))
+    {
+        type = GGUF_TYPE_F32;
+    }
+
+    struct gguf_tensor_type_features *tf = gguf_get_tensor_type_features(type);
+    if (t->dim[0] % tf->items_per_block != 0)
+        type = (t->dim[0] % 32 == 0) ? GGUF_TYPE_Q8_0 : GGUF_TYPE_F16;
+    return type;
+}
+
+/* State of the quantization jobs: every job dequantizes DEQUANT_CHUNK
+ * weights of the source tensor and quantizes them into the output
+ * buffer, so the work is split among threads across blocks, and the
+ * floats never exist as a whole in memory. */
+struct quantize_state {
+    gguf_tensor *src;
+    uint32_t type;      // Destination type.
+    uint8_t *dst;       // Destination tensor data.
+    int error;          // Set if the conversion failed.
+};
+
+void quantize_job(void *privdata, uint64_t jobid) {
+    struct quantize_state *st = privdata;
+    float weights[DEQUANT_CHUNK];
+    struct gguf_tensor_type_features *tf =
+        gguf_get_tensor_type_features(st->type);
+    uint64_t first = jobid * DEQUANT_CHUNK;
+    uint64_t count = st->src->num_weights - first;
+    if (count > DEQUANT_CHUNK) count = DEQUANT_CHUNK;
+
+    uint8_t *dst = st->dst + first/tf->items_per_block*tf->bytes_per_block;
+    if (gguf_dequant_range(st->src,first,count,weights) == 0 ||
+        gguf_float_to_type(st->type,weights,dst,count) == 0)
+    {
+        st->error = 1;
+    }
+}
+
+/* Transform callback of the quantization pipeline: 'privdata' is the
+ * array of the destination types. The tensor is split among threads
+ * in DEQUANT_CHUNK weights jobs. */
+int quantize_transform(void *privdata, uint64_t idx, gguf_tensor *src, void *dst) {
+    uint32_t *types = privdata;
+    struct quantize_state st = {src, types[idx], dst, 0};
+    uint64_t numjobs = (src->num_weights+DEQUANT_CHUNK-1)/DEQUANT_CHUNK;
+    gguf_parallel(Opt.threads,numjobs,quantize_job,&st);
+    if (st.error) {
+        fprintf(stderr,"Failed to quantize %.*s\n",
+            (int)src->namelen, src->name);
+        errno = EINVAL;
+        return 0;
+    }
+    return 1;
+}
+
+void gguf_tools_quantize(const char *input_filename, const char *output_filename, const char *type_name, char **rules_argv, int numrules) {
+    int default_type = tensor_type_by_name(type_name);
+    if (default_type == -1 || !gguf_can_quantize(default_type)) {
+        fprintf(stderr,"Unsupported output type: %s\n", type_name);
+        exit(1);
+    }
+
+    /* Parse the pattern=type overrides. */
+    struct quantize_rule *rules = malloc(sizeof(*rules)*(numrules+1));
+    if (rules == NULL) {
+        perror("Allocating the quantization rules");
+        exit(1);
+    }
+    for (int j = 0; j < numrules; j++) {
+        char *eq = strrchr(rules_argv[j],'=');
+        int type = eq ? tensor_type_by_name(eq+1) : -1;
+        if (type == -1 || !gguf_can_quantize(type)) {
+            fprintf(stderr,"Invalid override '%s': use pattern=type, "
+                           "with type one of f32, f16, bf16, q8_0, q4_0, "
+                           "q4_k, q6_k\n", rules_argv[j]);
+            exit(1);
+        }
+        rules[j].pattern = rules_argv[j];
+        rules[j].patternlen = eq-rules_argv[j];
+        rules[j].type = type;
+    }
+
+    gguf_ctx *input = gguf_open_flags(input_filename,GGUF_RDONLY);
+    if (input == NULL || gguf_build_index(input) == 0) {
+        perror(input_filename);
+        exit(1);
+    }
+
+    gguf_ctx *output = gguf_create(output_filename,GGUF_BUFFERED);
+    if (output == NULL) {
+        perror(output_filename);
+        exit(1);
+    }
+
+    /* Copy all the key value items, updating the file type. */
+    gguf_key key;
+    while (gguf_get_key(input,&key)) {
+        uint64_t value_start_offset = input->off;
+        void *value = input->data+input->off;
+        gguf_do_with_value(input,key.type,key.val,NULL,0,0,NULL);
+        uint64_t value_len = input->off - value_start_offset;
+
+        uint32_t file_type = file_type_for_tensor_type(default_type);
+        if (key.namelen == 17 && !memcmp(key.name,"general.file_type",17) &&
+            key.type == GGUF_VALUE_TYPE_UINT32)
+        {
+            value = &file_type;
+        }
+        if (gguf_append_kv(output,key.name,key.namelen,key.type,value,
+                           value_len) == 0)
+        {
+            perror("Failed to append key-value pair");
+            exit(1);
+        }
+    }
+
+    /* Select the type of every tensor, and emit the tensors info
+     * section with the new offsets. */
+    uint64_t count = input->header->tensor_count;
+    uint32_t *types = malloc(sizeof(uint32_t)*(count ? count : 1));
+    uint64_t *offsets = malloc(sizeof(uint64_t)*(count ? count : 1));
+    if (types == NULL || offsets == NULL) {
+        perror("Allocating the tensors types");
+        exit(1);
+    }
+    uint64_t tensor_off = 0;
+    for (uint64_t j = 0; j < count; j++) {
+        gguf_tensor *t = input->tensors+j;
+        types[j] = quantize_tensor_type(t,default_type,rules,numrules);
+
+        /* Tensors we can't decode are copied as they are. */
+        if (!gguf_can_dequantize(t->type)) types[j] = t->type;
+
+        struct gguf_tensor_type_features *tf =
+            gguf_get_tensor_type_features(types[j]);
+        tensor_off += gguf_get_alignment_padding(input->alignment,tensor_off);
+        offsets[j] = tensor_off;
+        if (gguf_append_tensor_info(output,t->name,t->namelen,t->ndim,
+                t->dim,types[j],tensor_off) == 0)
+        {
+            perror("Failed to append tensor info");
+            exit(1);
+        }
+        tensor_off += t->num_weights/tf->items_per_block*tf->bytes_per_block;
+    }
+
+    /* Finally, convert and write the tensors data, in a pipeline
+     * that reads the next tensor and writes the previous one while the
+     * current one is converted. Tensors kept in their type are copied
+     * by the kernel. */
+    gguf_pipeline_tensor *pt = malloc(sizeof(*pt)*(count ? count : 1));
+    if (pt == NULL) {
+        perror("Allocating the tensors to convert");
+        exit(1);
+    }
+    for (uint64_t j = 0; j < count; j++) {
+        gguf_tensor *t = input->tensors+j;
+        struct gguf_tensor_type_features *tf =
+            gguf_get_tensor_type_features(types[j]);
+        pt[j].src = *t;
+        pt[j].dst_offset = offsets[j];
+        pt[j].dst_size = t->num_weights/tf->items_per_block*tf->bytes_per_block;
+        pt[j].copy = types[j] == t->type;
+        printf("%.*s: %s -> %s\n", (int)t->namelen, t->name,
+            gguf_get_tensor_type_name(t->type),
+            gguf_get_tensor_type_name(types[j]));
+    }
+    fflush(stdout);
+
+    gguf_advise(input,GGUF_ADVICE_SEQUENTIAL);
+    if (gguf_pipeline_run(output,input,pt,count,quantize_transform,types,
+            Opt.budget,Opt.io,Opt.hugepages ? GGUF_ARENA_HUGEPAGES : 0) == 0)
+    {
+        perror("Failed to write the tensors data");
+        exit(1);
+    }
+    free(pt);
+
+    if (gguf_flush(output) == 0) {
+        perror("Failed to write the output file");
+        exit(1);
+    }
+    gguf_close(output);
+    gguf_close(input);
+    free(types);
+    free(offsets);
+    free(rules);
+}
+
+/* ========================== 'convert' subcommand ========================== */
+
+/* State of the conversion jobs: like quantize_job(), every job converts
+ * DEQUANT_CHUNK weights, but the dequantization kernels write the F16 or
+ * BF16 output directly, without the float to type encoders step. */
+struct convert_state {
+    gguf_tensor *src;
+    uint32_t type;      // GGUF_TYPE_F32, F16 or BF16.
+    uint8_t *dst;
+    int error;
+};
+
+void convert_job(void *privdata, uint64_t jobid) {
+    struct convert_state *st = privdata;
+    uint64_t first = jobid * DEQUANT_CHUNK;
+    uint64_t count = st->src->num_weights - first;
+    if (count > DEQUANT_CHUNK) count = DEQUANT_CHUNK;
+    size_t wsize = st->type == GGUF_TYPE_F32 ? sizeof(float) : sizeof(uint16_t);
+    if (gguf_tensor_convert_range(st->src,st->type,first,count,
+                                  st->dst+first*wsize) == 0)
+    {
+        st->error = 1;
+    }
+}
+
+/* Transform callback of the conversion pipeline: 'privdata' is the
+ * array of the destination types. */
+int convert_transform(void *privdata, uint64_t idx, gguf_tensor *src, void *dst) {
+    uint32_t *types = privdata;
+    struct convert_state st = {src, types[idx], dst, 0};
+    uint64_t numjobs = (src->num_weights+DEQUANT_CHUNK-1)/DEQUANT_CHUNK;
+    gguf_parallel(Opt.threads,numjobs,convert_job,&st);
+    if (st.error) {
+        fprintf(stderr,"Failed to convert %.*s\n",
+            (int)src->namelen, src->name);
+        errno = EINVAL;
+        return 0;
+    }
+    return 1;
+}
+
+/* Write 'output_filename' with the tensors of 'input_filename' converted
+ * to 'type_name' (f32, f16 or bf16). With a 'pattern' only the matching
+ * tensors are converted, otherwise all the tensors with two or more
+ * dimensions: 1-D tensors (norms, biases) are usually expected in F32 by
+ * inference engines. Tensors not converted, or in formats that can't be
+ * decoded, are copied as they are, as well as all the key-value pairs. */
+void gguf_tools_convert(const char *input_filename, const char *output_filename, const char *type_name, const char *pattern) {
+    int type = tensor_type_by_name(type_name);
+    if (type != GGUF_TYPE_F32 && type != GGUF_TYPE_F16 &&
+        type != GGUF_TYPE_BF16)
+    {
+        fprintf(stderr,"Unsupported output type: %s, use f32, f16 or "
+                       "bf16\n", type_name);
+        exit(1);
+    }
+
+    gguf_ctx *input = gguf_open_flags(input_filename,GGUF_RDONLY);
+    if (input == NULL || gguf_build_index(input) == 0) {
+        perror(input_filename);
+        exit(1);
+    }
+
+    gguf_ctx *output = gguf_create(output_filename,GGUF_BUFFERED);
+    if (output == NULL) {
+        perror(output_filename);
+        exit(1);
+    }
+
+    gguf_key key;
+    while (gguf_get_key(input,&key)) {
+        uint64_t value_start_offset = input->off;
+        void *value = input->data+input->off;
+        gguf_do_with_value(input,key.type,key.val,NULL,0,0,NULL);
+        uint64_t value_len = input->off - value_start_offset;
+        if (gguf_append_kv(output,key.name,key.namelen,key.type,value,
+                           value_len) == 0)
+        {
+            perror("Failed to append key-value pair");
+            exit(1);
+        }
+    }
+
+    /* Select the tensors to convert, and emit the tensors info section
+     * with the new offsets. */
+    uint64_t count = input->header->tensor_count;
+    uint32_t *types = malloc(sizeof(uint32_t)*(count ? count : 1));
+    gguf_pipeline_tensor *pt = malloc(sizeof(*pt)*(count ? count : 1));
+    if (types == NULL || pt == NULL) {
+        perror("Allocating the tensors to convert");
+        exit(1);
+    }
+    uint64_t tensor_off = 0, converted = 0;
+    for (uint64_t j = 0; j < count; j++) {
+        gguf_tensor *t = input->tensors+j;
+        int match = pattern ?
+            strmatch(pattern,strlen(pattern),t->name,t->namelen,0) :
+            t->ndim > 1;
+        types[j] = match && gguf_can_dequantize(t->type) ? (uint32_t)type :
+                                                           t->type;
+
+        struct gguf_tensor_type_features *tf =
+            gguf_get_tensor_type_features(types[j]);
+        tensor_off += gguf_get_alignment_padding(input->alignment,tensor_off);
+        if (gguf_append_tensor_info(output,t->name,t->namelen,t->ndim,
+                t->dim,types[j],tensor_off) == 0)
+        {
+            perror("Failed to append tensor info");
+            exit(1);
+        }
+        pt[j].src = *t;
+        pt[j].dst_offset = tensor_off;
+        pt[j].dst_size = t->num_weights/tf->items_per_block*tf->bytes_per_block;
+        pt[j].copy = types[j] == t->type;
+        if (!pt[j].copy) converted++;
+        tensor_off += pt[j].dst_size;
+    }
+
+    gguf_advise(input,GGUF_ADVICE_SEQUENTIAL);
+    if (gguf_pipeline_run(output,input,pt,count,convert_transform,types,
+            Opt.budget,Opt.io,Opt.hugepages ? GGUF_ARENA_HUGEPAGES : 0) == 0)
+    {
+        perror("Failed to write the tensors data");
+        exit(1);
+    }
+    if (gguf_flush(output) == 0) {
+        perror("Failed to write the output file");
+        exit(1);
+    }
+    printf("%s: %" PRIu64 " tensors converted to %s, %" PRIu64 " copied\n",
+        output_filename, converted, gguf_get_tensor_type_name(type),
+        count-converted);
+    gguf_close(output);
+    gguf_close(input);
+    free(types);
+    free(pt);
+}
+
+/* =========================== 'index' subcommand =========================== */
+
+/* Write the sidecar index of the specified GGUF file, so that later
+ * read-only opens don't need to parse the header. The sidecar becomes
+ * stale (and is ignored) if the file is modified: run this again. */
+void gguf_tools_index(const char *filename) {
+    gguf_ctx *ctx = gguf_open_flags(filename,GGUF_RDONLY);
+    if (ctx == NULL) {
+        perror(filename);
+        exit(1);
+    }
+
+    /* The tensors hashes are stored as well, so that 'compare' and
+     * 'show --diffable' don't need to read the data. */
+    if (gguf_hash_tensors(ctx,Opt.threads) == 0) {
+        perror("Hashing the tensors");
+        exit(1);
+    }
+    sds sidecar = sdscatprintf(sdsempty(),"%s%s",filename,GGUF_SIDECAR_EXT);
+    if (gguf_write_sidecar(ctx,sidecar) == 0) {
+        perror(sidecar);
+        exit(1);
+    }
+    printf("%s: %" PRIu64 " tensors, %" PRIu64 " key-value pairs indexed\n",
+        sidecar, ctx->header->tensor_count, ctx->header->metadata_kv_count);
+    sdsfree(sidecar);
+    gguf_close(ctx);
+}
+
+/* ========================== 'edit-kv' subcommand ========================== */
+
+/* Encode the textual value 'str' as a GGUF value of the specified type
+ * into the sds string 'val'. String values starting with '@' are read
+ * from the file named after the '@' (handy for chat templates). Return
+ * 1 on success, 0 if the value is not valid for the type. */
+int edit_kv_encode(uint32_t type, const char *str, sds *val) {
+    char *end;
+    errno = 0;
+    if (type == GGUF_VALUE_TYPE_STRING) {
+        sds s = sdsempty();
+        if (str[0] == '@') {
+            FILE *fp = fopen(str+1,"r");
+            if (fp == NULL) {
+                perror(str+1);
+                exit(1);
+            }
+            char buf[4096];
+            size_t nread;
+            while ((nread = fread(buf,1,sizeof(buf),fp)) > 0)
+                s = sdscatlen(s,buf,nread);
+            fclose(fp);
+        } else {
+            s = sdscat(s,str);
+        }
+        uint64_t len = sdslen(s);
+        *val = sdscatlen(*val,&len,sizeof(len));
+        *val = sdscatlen(*val,s,len);
+        sdsfree(s);
+        return 1;
+    } else if (type == GGUF_VALUE_TYPE_BOOL) {
+        uint8_t b;
+        if (!strcmp(str,"true") || !strcmp(str,"1")) b = 1;
+        else if (!strcmp(str,"false") || !strcmp(str,"0")) b = 0;
+        else return 0;
+        *val = sdscatlen(*val,&b,1);
+        return 1;
+    } else if (type == GGUF_VALUE_TYPE_FLOAT32 ||
+               type == GGUF_VALUE_TYPE_FLOAT64)
+    {
+        double d = strtod(str,&end);
+        if (end == str || *end || errno) return 0;
+        if (type == GGUF_VALUE_TYPE_FLOAT32) {
+            float f = d;
+            *val = sdscatlen(*val,&f,sizeof(f));
+        } else {
+            *val = sdscatlen(*val,&d,sizeof(d));
+        }
+        return 1;
+    }
+
+    /* Integers: check the range of the type, then store the low bytes
+     * (GGUF files are little endian, like the hosts we support). */
+    uint64_t bytes;
+    int is_signed;
+    switch(type) {
+    case GGUF_VALUE_TYPE_UINT8: bytes = 1; is_signed = 0; break;
+    case GGUF_VALUE_TYPE_INT8: bytes = 1; is_signed = 1; break;
+    case GGUF_VALUE_TYPE_UINT16: bytes = 2; is_signed = 0; break;
+    case GGUF_VALUE_TYPE_INT16: bytes = 2; is_signed = 1; break;
+    case GGUF_VALUE_TYPE_UINT32: bytes = 4; is_signed = 0; break;
+    case GGUF_VALUE_TYPE_INT32: bytes = 4; is_signed = 1; break;
+    case GGUF_VALUE_TYPE_UINT64: bytes = 8; is_signed = 0; break;
+    case GGUF_VALUE_TYPE_INT64: bytes = 8; is_signed = 1; break;
+    default: return 0; // Arrays are not supported.
+    }
+    uint64_t u;
+    if (is_signed) {
+        long long ll = strtoll(str,&end,10);
+        int64_t max = bytes == 8 ? INT64_MAX : (INT64_C(1) << (bytes*8-1))-1;
+        if (ll > max || ll < -max-1) return 0;
+        u = (uint64_t)ll;
+    } else {
+        if (str[0] == '-') return 0;
+        unsigned long long ull = strtoull(str,&end,10);
+        if (bytes < 8 && ull >> (bytes*8)) return 0;
+        u = ull;
+    }
+    if (end == str || *end || errno) return 0;
+    *val = sdscatlen(*val,&u,bytes);
+    return 1;
+}
+
+/* Edit the key-value pairs of 'filename' in place, without rewriting
+ * the tensors data. Every edit is one of:
+ *
+ *  key=value       set an existing key, keeping its type.
+ *  key:type=value  set or add a key of the specified type.
+ *  -key            remove the key. */
+void gguf_tools_edit_kv(const char *filename, char **edits, int numedits) {
+    gguf_ctx *ctx = gguf_open(filename);
+    if (ctx == NULL) {
+        perror(filename);
+        exit(1);
+    }
+
+    for (int j = 0; j < numedits; j++) {
+        const char *edit = edits[j];
+        if (edit[0] == '-') {
+            if (gguf_del_kv(ctx,edit+1,strlen(edit+1)) == 0) {
+                if (errno == ENOENT)
+                    fprintf(stderr,"Key '%s' not found\n", edit+1);
+                else
+                    perror(edit+1);
+                exit(1);
+            }
+            printf("%s: removed\n", edit+1);
+            continue;
+        }
+
+        const char *eq = strchr(edit,'=');
+        if (eq == NULL) {
+            fprintf(stderr,"Invalid edit '%s': use key=value, "
+                           "key:type=value or -key\n", edit);
+            exit(1);
+        }
+        const char *colon = memchr(edit,':',eq-edit);
+        size_t keylen = colon ? (size_t)(colon-edit) : (size_t)(eq-edit);
+
+        /* Use the specified type or the type the key already has. */
+        int64_t type = -1;
+        if (colon) {
+            for (uint32_t t = 0; t <= GGUF_VALUE_TYPE_FLOAT64; t++) {
+                const char *name = gguf_get_value_type_name(t);
+                if (strlen(name) == (size_t)(eq-colon-1) &&
+                    !memcmp(name,colon+1,eq-colon-1)) type = t;
+            }
+        } else {
+            gguf_key key;
+            gguf_rewind(ctx);
+            while (gguf_get_key(ctx,&key)) {
+                if (key.namelen == keylen && !memcmp(key.name,edit,keylen)) {
+                    type = key.type;
+                    break;
+                }
+                gguf_do_with_value(ctx,key.type,key.val,NULL,0,0,NULL);
+            }
+            if (type == -1) {
+                fprintf(stderr,"Key '%.*s' not found: specify the type "
+                               "with key:type=value\n", (int)keylen, edit);
+                exit(1);
+            }
+        }
+
+        sds val = sdsempty();
+        if (type == -1 || edit_kv_encode(type,eq+1,&val) == 0) {
+            fprintf(stderr,"Invalid %s value for '%.*s'\n",
+                type == -1 ? "type or" : gguf_get_value_type_name(type),
+                (int)keylen, edit);
+            exit(1);
+        }
+        if (gguf_set_kv(ctx,edit,keylen,type,val,sdslen(val)) == 0) {
+            fprintf(stderr,"Setting '%.*s': %s\n",
+                (int)keylen, edit, strerror(errno));
+            exit(1);
+        }
+        printf("%.*s: set [%s]\n", (int)keylen, edit,
+            gguf_get_value_type_name(type));
+        sdsfree(val);
+    }
+    gguf_close(ctx);
+}
+
+/* =========================== 'bench' subcommand =========================== */
+
+#define BENCH_WEIGHTS (1<<24)   // Max weights converted per measure.
+#define BENCH_MIN_TIME 0.25     // Every measure runs at least this seconds.
+#define BENCH_MIN_RUNS 3        // And at least this number of times.
+
+/* Monotonic time in seconds. */
+static double bench_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+/* Pseudo random numbers (xorshift64*), so results are reproducible. */
+static uint64_t bench_rand(void) {
+    static uint64_t x = 0x9e3779b97f4a7c15ULL;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    return x * 2685821657736338717ULL;
+}
+
+/* Print 's' as a JSON string. */
+static void bench_json_string(const char *s) {
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') printf("\\%c",*s);
+        else if ((unsigned char)*s < 0x20) printf("\\u%04x",*s);
+        else putchar(*s);
+    }
+    putchar('"');
+}
+
+/* Return the CPU model from /proc/cpuinfo, or NULL if not available.
+ * The returned string is an sds string. */
+static sds bench_cpu_model(void) {
+    FILE *fp = fopen("/proc/cpuinfo","r");
+    if (fp == NULL) return NULL;
+    char line[256];
+    sds model = NULL;
+    while (model == NULL && fgets(line,sizeof(line),fp)) {
+        if (strncmp(line,"model name",10)) continue;
+        char *p = strchr(line,':');
+        if (p == NULL) continue;
+        model = sdstrim(sdsnew(p+1)," \t\n");
+    }
+    fclose(fp);
+    return model;
+}
+
+/* Fill 't' with a synthetic tensor of the specified type: random weights,
+ * encoded with gguf_float_to_type() when possible, otherwise random blocks
+ * (the decoding speed does not depend on the values). The weights data
+ * is allocated with malloc(). */
+static void bench_synthetic_tensor(uint32_t type, gguf_tensor *t) {
+    struct gguf_tensor_type_features *tf = gguf_get_tensor_type_features(type);
+    memset(t,0,sizeof(*t));
+    t->name = tf->name;
+    t->namelen = strlen(tf->name);
+    t->type = type;
+    t->ndim = 1;
+    t->dim[0] = t->num_weights = BENCH_WEIGHTS;
+    t->bsize = BENCH_WEIGHTS/tf->items_per_block*tf->bytes_per_block;
+    t->weights_data = malloc(t->bsize);
+    if (t->weights_data == NULL) {
+        perror("Allocating the synthetic tensor");
+        exit(1);
+    }
+
+    if (gguf_can_quantize(type)) {
+        float *w = malloc(sizeof(float)*BENCH_WEIGHTS);
+        if (w == NULL) {
+            perror("Allocating the synthetic tensor");
+            exit(1);
+        }
+        for (uint64_t j = 0; j < BENCH_WEIGHTS; j++)
+            w[j] = ((float)(bench_rand() >> 40) / (1 << 24) - 0.5f) * 0.1f;
+        gguf_float_to_type(type,w,t->weights_data,BENCH_WEIGHTS);
+        free(w);
+    } else {
+        for (uint64_t j = 0; j < t->bsize; j++)
+            t->weights_data[j] = bench_rand() >> 56;
+    }
+}
+
+/* Convert the tensor into 'dst' in 'dst_type' format, one STREAM_CHUNK
+ * per job, so that --threads is used and nothing is allocated while
+ * measuring. */
+struct bench_convert_state {
+    gguf_tensor *t;
+    uint32_t dst_type;
+    uint8_t *dst;
+    size_t weight_size;
+};
+
+static void bench_convert_job(void *privdata, uint64_t jobid) {
+    struct bench_convert_state *bs = privdata;
+    uint64_t first = jobid*STREAM_CHUNK;
+    uint64_t count = bs->t->num_weights-first;
+    if (count > STREAM_CHUNK) count = STREAM_CHUNK;
+    gguf_tensor_convert_range(bs->t,bs->dst_type,first,count,
+                              bs->dst+first*bs->weight_size);
+}
+
+/* Measure and print the conversion speed of the tensor into the three
+ * output formats. 'dst' has space for BENCH_WEIGHTS floats. If the
+ * tensor has more weights, only the first BENCH_WEIGHTS are used. */
+static void bench_dequant(gguf_tensor *tensor, void *dst, int *first) {
+    static const uint32_t outputs[] = {GGUF_TYPE_F32, GGUF_TYPE_F16, GGUF_TYPE_BF16};
+    struct gguf_tensor_type_features *tf =
+        gguf_get_tensor_type_features(tensor->type);
+    gguf_tensor t = *tensor;
+    if (t.num_weights > BENCH_WEIGHTS) {
+        t.num_weights = BENCH_WEIGHTS/tf->items_per_block*tf->items_per_block;
+        t.bsize = t.num_weights/tf->items_per_block*tf->bytes_per_block;
+    }
+
+    for (size_t j = 0; j < sizeof(outputs)/sizeof(outputs[0]); j++) {
+        struct bench_convert_state bs = {&t, outputs[j], dst,
+            outputs[j] == GGUF_TYPE_F32 ? sizeof(float) : sizeof(uint16_t)};
+        uint64_t numjobs = (t.num_weights+STREAM_CHUNK-1)/STREAM_CHUNK;
+
+        /* First run out of the measure: page faults, caches. */
+        gguf_parallel(Opt.threads,numjobs,bench_convert_job,&bs);
+        uint64_t runs = 0;
+        double start = bench_time(), elapsed;
+        do {
+            gguf_parallel(Opt.threads,numjobs,bench_convert_job,&bs);
+            runs++;
+            elapsed = bench_time()-start;
+        } while (elapsed < BENCH_MIN_TIME || runs < BENCH_MIN_RUNS);
+
+        double secs = elapsed/runs;
+        printf("%s\n    {\"type\": \"%s\", \"output\": \"%s\", "
+               "\"weights\": %" PRIu64 ", \"bytes\": %" PRIu64 ", "
+               "\"seconds\": %g, \"in_gb_s\": %.3f, \"out_gb_s\": %.3f, "
+               "\"weights_s\": %.4g}",
+            *first ? "" : ",", tf->name,
+            gguf_get_tensor_type_features(outputs[j])->name,
+            t.num_weights, t.bsize, secs, t.bsize/secs/1e9,
+            t.num_weights*bs.weight_size/secs/1e9, t.num_weights/secs);
+        *first = 0;
+    }
+}
+
+/* Write a GGUF file with a tokenizer-like array and many small tensors,
+ * used to measure header parsing when no file is given. */
+static void bench_write_header_file(const char *filename) {
+    gguf_ctx *ctx = gguf_create(filename,GGUF_OVERWRITE|GGUF_BUFFERED);
+    if (ctx == NULL) {
+        perror(filename);
+        exit(1);
+    }
+
+    /* 32k tokens array: elements type, count, then strings. */
+    uint64_t numtokens = 32000;
+    sds tokens = sdsempty();
+    uint32_t etype = GGUF_VALUE_TYPE_STRING;
+    tokens = sdscatlen(tokens,&etype,sizeof(etype));
+    tokens = sdscatlen(tokens,&numtokens,sizeof(numtokens));
+    for (uint64_t j = 0; j < numtokens; j++) {
+        char tok[32];
+        uint64_t len = snprintf(tok,sizeof(tok),"token_%" PRIu64,j);
+        tokens = sdscatlen(tokens,&len,sizeof(len));
+        tokens = sdscatlen(tokens,tok,len);
+    }
+    const char *key = "tokenizer.ggml.tokens";
+    int ok = gguf_append_kv(ctx,key,strlen(key),GGUF_VALUE_TYPE_ARRAY,
+                            tokens,sdslen(tokens));
+    sdsfree(tokens);
+
+    uint64_t numtensors = 2000, dim = 32;
+    float weights[32] = {0};
+    for (uint64_t j = 0; ok && j < numtensors; j++) {
+        char name[64];
+        snprintf(name,sizeof(name),"blk.%" PRIu64 ".ffn_up.weight",j);
+        ok = gguf_append_tensor_info(ctx,name,strlen(name),1,&dim,
+                                     GGUF_TYPE_F32,j*sizeof(weights));
+    }
+    for (uint64_t j = 0; ok && j < numtensors; j++)
+        ok = gguf_append_tensor_data(ctx,weights,sizeof(weights));
+    if (!ok || gguf_flush(ctx) == 0) {
+        perror("Writing the header benchmark file");
+        exit(1);
+    }
+    gguf_close(ctx);
+}
+
+/* Measure the writing speed of gguf_append_tensor_data() into 'filename'
+ * with the specified gguf_create() flags. The file is in the page cache,
+ * so this measures the library and the kernel write path, not the disk. */
+static void bench_writer(const char *filename, int flags, int first) {
+    uint64_t numtensors = 16, numweights = 1<<21;
+    float *weights = malloc(sizeof(float)*numweights);
+    if (weights == NULL) {
+        perror("Allocating the writer benchmark tensor");
+        exit(1);
+    }
+    for (uint64_t j = 0; j < numweights; j++)
+        weights[j] = (float)(bench_rand() >> 40) / (1 << 24);
+
+    gguf_ctx *ctx = gguf_create(filename,GGUF_OVERWRITE|flags);
+    if (ctx == NULL) {
+        perror(filename);
+        exit(1);
+    }
+    int ok = 1;
+    uint64_t bytes = numweights*sizeof(float);
+    for (uint64_t j = 0; ok && j < numtensors; j++) {
+        char name[64];
+        snprintf(name,sizeof(name),"tensor.%" PRIu64,j);
+        ok = gguf_append_tensor_info(ctx,name,strlen(name),1,&numweights,
+                                     GGUF_TYPE_F32,j*bytes);
+    }
+    double start = bench_time();
+    for (uint64_t j = 0; ok && j < numtensors; j++)
+        ok = gguf_append_tensor_data(ctx,weights,bytes);
+    if (ok) ok = gguf_flush(ctx);
+    double secs = bench_time()-start;
+    if (!ok) {
+        perror("Writing the writer benchmark file");
+        exit(1);
+    }
+    gguf_close(ctx);
+    unlink(filename);
+    free(weights);
+
+    printf("%s\n    {\"mode\": \"%s\", \"tensors\": %" PRIu64 ", "
+           "\"bytes\": %" PRIu64 ", \"seconds\": %g, \"gb_s\": %.3f}",
+        first ? "" : ",", (flags & GGUF_BUFFERED) ? "buffered" : "unbuffered",
+        numtensors, numtensors*bytes, secs, numtensors*bytes/secs/1e9);
+}
+
+/* Measure opening 'filename' and loading the header, with and without
+ * building the tensors index, in microseconds per open. */
+static void bench_header(const char *filename) {
+    int sidecar = 0;
+    double us[2];
+    for (int build_index = 0; build_index < 2; build_index++) {
+        uint64_t runs = 0;
+        double start = bench_time(), elapsed;
+        do {
+            gguf_ctx *ctx = gguf_open_flags(filename,GGUF_RDONLY);
+            if (ctx == NULL) {
+                perror(filename);
+                exit(1);
+            }
+            sidecar = ctx->hcache != NULL;
+            int ok = build_index ? gguf_build_index(ctx) :
+                                   gguf_load_header(ctx);
+            if (!ok) {
+                perror("Loading the header");
+                exit(1);
+            }
+            gguf_close(ctx);
+            runs++;
+            elapsed = bench_time()-start;
+        } while (elapsed < BENCH_MIN_TIME || runs < BENCH_MIN_RUNS);
+        us[build_index] = elapsed/runs*1e6;
+    }
+
+    gguf_ctx *ctx = gguf_open_flags(filename,GGUF_RDONLY);
+    printf("  \"header\": {\"file\": ");
+    bench_json_string(filename);
+    printf(", \"bytes\": %" PRIu64 ", \"kv\": %" PRIu64 ", "
+           "\"tensors\": %" PRIu64 ", \"sidecar\": %s, "
+           "\"parse_us\": %.1f, \"index_us\": %.1f},\n",
+        ctx->data_off ? ctx->data_off : ctx->size,
+        ctx->header->metadata_kv_count, ctx->header->tensor_count,
+        sidecar ? "true" : "false", us[0], us[1]);
+    gguf_close(ctx);
+}
+
+/* Benchmark the dequantization kernels, header parsing and tensors
+ * index building, and the writer, printing the results as JSON.
+ * Without a file, synthetic tensors of every supported type are used,
+ * otherwise the largest tensor of every type found in the file. */
+void gguf_tools_bench(const char *filename) {
+    const char *tmpdir = getenv("TMPDIR");
+    if (tmpdir == NULL) tmpdir = "/tmp";
+    sds tmpfile = sdscatprintf(sdsempty(),"%s/gguf-bench-%d.gguf",
+                               tmpdir, (int)getpid());
+
+    struct utsname un;
+    sds cpu = bench_cpu_model();
+    if (uname(&un) == -1) strcpy(un.machine,"unknown");
+    printf("{\n  \"machine\": ");
+    bench_json_string(un.machine);
+    printf(",\n  \"cpu\": ");
+    bench_json_string(cpu ? cpu : "unknown");
+    printf(",\n  \"kernels\": \"%s\",\n  \"threads\": %d,\n  \"source\": ",
+        gguf_kernels_name(), Opt.threads);
+    bench_json_string(filename ? filename : "synthetic");
+    printf(",\n");
+    sdsfree(cpu);
+
+    float *dst = malloc(sizeof(float)*BENCH_WEIGHTS);
+    if (dst == NULL) {
+        perror("Allocating the output buffer");
+        exit(1);
+    }
+
+    /* Dequantization kernels. */
+    int first = 1;
+    printf("  \"dequant\": [");
+    if (filename) {
+        gguf_ctx *ctx = gguf_open_flags(filename,GGUF_RDONLY);
+        if (ctx == NULL || gguf_build_index(ctx) == 0) {
+            perror(filename);
+            exit(1);
+        }
+        for (uint32_t type = 0; type < GGUF_TYPE_COUNT; type++) {
+            if (!gguf_can_dequantize(type)) continue;
+            gguf_tensor *largest = NULL;
+            for (uint64_t j = 0; j < ctx->header->tensor_count; j++) {
+                gguf_tensor *t = ctx->tensors+j;
+                if (t->type == type &&
+                    (largest == NULL || t->num_weights > largest->num_weights))
+                    largest = t;
+            }
+            if (largest) bench_dequant(largest,dst,&first);
+        }
+        gguf_close(ctx);
+    } else {
+        for (uint32_t type = 0; type < GGUF_TYPE_COUNT; type++) {
+            if (!gguf_can_dequantize(type)) continue;
+            gguf_tensor t;
+            bench_synthetic_tensor(type,&t);
+            bench_dequant(&t,dst,&first);
+            free(t.weights_data);
+        }
+    }
+    printf("\n  ],\n");
+    free(dst);
+
+    /* Header parsing and index building. */
+    if (filename) {
+        bench_header(filename);
+    } else {
+        bench_write_header_file(tmpfile);
+        bench_header(tmpfile);
+        unlink(tmpfile);
+    }
+
+    /* Writer. */
+    printf("  \"writer\": [");
+    bench_writer(tmpfile,GGUF_NONE,1);
+    bench_writer(tmpfile,GGUF_BUFFERED,0);
+    printf("\n  ]\n}\n");
+    sdsfree(tmpfile);
+}
+
+/* =========================== 'stats' subcommand =========================== */
+
+/* Weights magnitudes are counted in logarithmic bins: the float exponent
+ * and the higher STATS_SUB_BITS bits of the mantissa, that is, bins are
+ * 1/8 of an octave wide. The bins are simply the higher bits of |w|. */
+#define STATS_SUB_BITS 3
+#define STATS_BINS (256 << STATS_SUB_BITS)
+#define STATS_OUTLIER_RMS 6     // Outliers are weights with |w| > 6*rms.
+
+/* Partial statistics of a run of weights, merged by stats_merge(). */
+struct stats_partial {
+    uint64_t count;             // Finite weights.
+    uint64_t zeros;             // Weights equal to zero.
+    uint64_t nonfinite;         // NaN and infinite weights.
+    double mean, m2;            // Mean and sum of squared differences.
+    double min, max;
+    uint64_t hist[STATS_BINS];  // Magnitudes histogram.
+    uint64_t scales;            // Sub-block scales, see gguf_block_scales().
+    double scales_sum, scales_min, scales_max;
+    uint64_t scales_hist[256];  // log2 of the scales magnitude.
+};
+
+/* State of the stats jobs for one stream chunk: every job processes
+ * DEQUANT_CHUNK weights into its own partial. */
+struct stats_state {
+    gguf_tensor *chunk;
+    struct stats_partial *partials;
+    int error;
+};
+
+static void stats_partial_init(struct stats_partial *p) {
+    memset(p,0,sizeof(*p));
+    p->min = p->scales_min = INFINITY;
+    p->max = p->scales_max = -INFINITY;
+}
+
+/* Merge 'src' into 'dst', combining means and variances with the
+ * parallel algorithm of Chan et al. */
+static void stats_merge(struct stats_partial *dst, struct stats_partial *src) {
+    uint64_t n = dst->count + src->count;
+    if (n) {
+        double delta = src->mean - dst->mean;
+        dst->mean += delta * src->count / n;
+        dst->m2 += src->m2 + delta*delta * dst->count / n * src->count;
+    }
+    dst->count = n;
+    dst->zeros += src->zeros;
+    dst->nonfinite += src->nonfinite;
+    if (src->min < dst->min) dst->min = src->min;
+    if (src->max > dst->max) dst->max = src->max;
+    for (int j = 0; j < STATS_BINS; j++) dst->hist[j] += src->hist[j];
+    dst->scales += src->scales;
+    dst->scales_sum += src->scales_sum;
+    if (src->scales_min < dst->scales_min) dst->scales_min = src->scales_min;
+    if (src->scales_max > dst->scales_max) dst->scales_max = src->scales_max;
+    for (int j = 0; j < 256; j++) dst->scales_hist[j] += src->scales_hist[j];
+}
+
+/* Return the histogram bin of the magnitude of 'w'. */
+static inline uint32_t stats_bin(float w) {
+    uint32_t bits;
+    memcpy(&bits,&w,sizeof(bits));
+    return (bits & 0x7fffffff) >> (23-STATS_SUB_BITS);
+}
+
+/* The Makefile builds with -ffast-math, that lets the compiler assume
+ * there are no NaN and Inf values: isfinite() and the comparisons can't
+ * be trusted for them, so the weights are classified by testing the bits
+ * of their IEEE representation. */
+static inline int stats_nonfinite(float w) {
+    uint32_t bits;
+    memcpy(&bits,&w,sizeof(bits));
+    return (bits & 0x7f800000) == 0x7f800000;
+}
+
+static inline int stats_zero(float w) {
+    uint32_t bits;
+    memcpy(&bits,&w,sizeof(bits));
+    return (bits & 0x7fffffff) == 0;
+}
+
+static void stats_job(void *privdata, uint64_t jobid) {
+    struct stats_state *st = privdata;
+    gguf_tensor *chunk = st->chunk;
+    struct stats_partial *p = st->partials+jobid;
+    uint64_t first = jobid*DEQUANT_CHUNK;
+    uint64_t count = chunk->num_weights - first;
+    if (count > DEQUANT_CHUNK) count = DEQUANT_CHUNK;
+
+    float w[DEQUANT_CHUNK];
+    stats_partial_init(p);
+    if (gguf_dequant_range(chunk,first,count,w) == 0) {
+        st->error = 1;
+        return;
+    }
+
+    /* The decoded weights are still in the cache: a first pass for the
+     * mean, the other values and the histogram, then a second pass for
+     * the squared differences. */
+    double sum = 0;
+    for (uint64_t j = 0; j < count; j++) {
+        if (stats_nonfinite(w[j])) {
+            p->nonfinite++;
+            continue;
+        }
+        if (stats_zero(w[j])) p->zeros++;
+        if (w[j] < p->min) p->min = w[j];
+        if (w[j] > p->max) p->max = w[j];
+        p->hist[stats_bin(w[j])]++;
+        sum += w[j];
+    }
+    p->count = count - p->nonfinite;
+    if (p->count) p->mean = sum / p->count;
+    for (uint64_t j = 0; j < count; j++) {
+        if (stats_nonfinite(w[j])) continue;
+        double d = w[j] - p->mean;
+        p->m2 += d*d;
+    }
+
+    /* Scales of the blocks of this job. */
+    struct gguf_tensor_type_features *tf =
+        gguf_get_tensor_type_features(chunk->type);
+    uint64_t b0 = first / tf->items_per_block;
+    uint64_t b1 = (first+count+tf->items_per_block-1) / tf->items_per_block;
+    for (uint64_t b = b0; b < b1; b++) {
+        float scales[GGUF_MAX_BLOCK_SCALES];
+        int n = gguf_block_scales(chunk->type,
+            chunk->weights_data + b*tf->bytes_per_block,scales);
+        for (int j = 0; j < n; j++) {
+            if (stats_nonfinite(scales[j])) continue;
+            p->scales++;
+            p->scales_sum += scales[j];
+            if (scales[j] < p->scales_min) p->scales_min = scales[j];
+            if (scales[j] > p->scales_max) p->scales_max = scales[j];
+            p->scales_hist[stats_bin(scales[j]) >> STATS_SUB_BITS]++;
+        }
+    }
+}
+
+/* Print a histogram with 'bins' bins of log2 magnitudes (bin 127 is
+ * [1,2)) as "exp:count" pairs separated by 'sep', skipping empty bins.
+ * With 'shift' the bins are summed in groups of 1<<shift. */
+static void stats_print_hist(uint64_t *hist, int bins, int shift, const char *fmt, const char *sep) {
+    int printed = 0;
+    for (int j = 0; j < (bins >> shift); j++) {
+        uint64_t count = 0;
+        for (int k = 0; k < (1<<shift); k++) count += hist[(j<<shift)+k];
+        if (count == 0 || j == 0) continue; // Zeros are counted apart.
+        printf("%s",printed++ ? sep : "");
+        printf(fmt,j-127,count);
+    }
+}
+
+/* Print a double, using null (JSON) or an empty field (CSV) for
+ * missing values. */
+static void stats_print_double(double v, int valid) {
+    if (valid) printf("%.9g",v);
+    else if (!Opt.csv) printf("null");
+}
+
+/* Print the statistics of a tensor, as a JSON object or a CSV row. */
+static void stats_print(gguf_tensor *t, struct stats_partial *p, int first) {
+    int valid = p != NULL && p->count;
+    double stddev = 0, rms = 0;
+    uint64_t outliers = 0;
+    if (valid) {
+        stddev = sqrt(p->m2 / p->count);
+        rms = sqrt(p->mean*p->mean + stddev*stddev);
+
+        /* Count the weights in the bins starting above the threshold:
+         * the estimate is within one bin (1/8 of octave). */
+        float threshold = STATS_OUTLIER_RMS*rms;
+        for (uint32_t j = stats_bin(threshold)+1; j < STATS_BINS; j++)
+            outliers += p->hist[j];
+    }
+    const char *type = gguf_get_tensor_type_name(t->type);
+
+    if (Opt.csv) {
+        printf("%.*s,%s,%" PRIu64 ",", (int)t->namelen, t->name, type,
+            t->num_weights);
+        stats_print_double(p ? p->min : 0,valid); printf(",");
+        stats_print_double(p ? p->max : 0,valid); printf(",");
+        stats_print_double(p ? p->mean : 0,valid); printf(",");
+        stats_print_double(stddev,valid); printf(",");
+        stats_print_double(rms,valid); printf(",");
+        if (p) {
+            printf("%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",",
+                p->zeros, p->nonfinite, outliers, p->scales);
+        } else {
+            printf(",,,,");
+        }
+        stats_print_double(p && p->scales ? p->scales_min : 0,p && p->scales);
+        printf(",");
+        stats_print_double(p && p->scales ? p->scales_max : 0,p && p->scales);
+        printf(",");
+        stats_print_double(p && p->scales ? p->scales_sum/p->scales : 0,
+                           p && p->scales);
+        printf(",");
+        if (p) stats_print_hist(p->hist,STATS_BINS,STATS_SUB_BITS,
+                               "%d:%" PRIu64," ");
+        printf("\n");
+        return;
+    }
+
+    printf("%s\n    {\"name\": ", first ? "" : ",");
+    sds name = sdsnewlen(t->name,t->namelen);
+    bench_json_string(name);
+    sdsfree(name);
+    printf(", \"type\": \"%s\", \"weights\": %" PRIu64, type, t->num_weights);
+    if (p == NULL) {
+        printf(", \"error\": \"unsupported type\"}");
+        return;
+    }
+    printf(", \"min\": "); stats_print_double(p->min,valid);
+    printf(", \"max\": "); stats_print_double(p->max,valid);
+    printf(", \"mean\": "); stats_print_double(p->mean,valid);
+    printf(", \"stddev\": "); stats_print_double(stddev,valid);
+    printf(", \"rms\": "); stats_print_double(rms,valid);
+    printf(", \"zeros\": %" PRIu64 ", \"nonfinite\": %" PRIu64
+           ", \"outliers\": %" PRIu64 ",\n     \"histogram\": [",
+           p->zeros, p->nonfinite, outliers);
+    stats_print_hist(p->hist,STATS_BINS,STATS_SUB_BITS,
+                     "[%d, %" PRIu64 "]",", ");
+    printf("]");
+    if (p->scales) {
+        printf(",\n     \"scales\": {\"count\": %" PRIu64 ", \"min\": %.9g"
+               ", \"max\": %.9g, \"mean\": %.9g, \"histogram\": [",
+               p->scales, p->scales_min, p->scales_max,
+               p->scales_sum/p->scales);
+        stats_print_hist(p->scales_hist,256,0,"[%d, %" PRIu64 "]",", ");
+        printf("]}");
+    }
+    printf("}");
+}
+
+/* Show statistics about the weights of the tensors matching 'pattern'
+ * (all the tensors if NULL): min, max, mean, standard deviation, zero,
+ * non finite and outlier weights, a histogram of the magnitudes in
+ * octaves, and for block formats the distribution of the sub-block
+ * scales. Every tensor is read once, streaming it in chunks with the
+ * --io backend, and the blocks of every chunk are decoded by all the
+ * threads, each in its own partial statistics, merged at the end of
+ * the chunk (always in the same order, so the result does not depend
+ * on the number of threads). */
+void gguf_tools_stats(const char *filename, const char *pattern) {
+    gguf_shards *model = gguf_shards_open(filename,GGUF_RDONLY);
+    if (model == NULL) {
+        perror(filename);
+        exit(1);
+    }
+
+    uint64_t maxjobs = STREAM_CHUNK/DEQUANT_CHUNK;
+    struct stats_partial *partials = malloc(sizeof(*partials)*maxjobs);
+    struct stats_partial *total = malloc(sizeof(*total));
+    if (partials == NULL || total == NULL) {
+        perror("Allocating the statistics");
+        exit(1);
+    }
+
+    if (Opt.csv) {
+        printf("name,type,weights,min,max,mean,stddev,rms,zeros,nonfinite,"
+               "outliers,scales,scales_min,scales_max,scales_mean,"
+               "histogram\n");
+    } else {
+        printf("{\"file\": ");
+        bench_json_string(filename);
+        printf(", \"tensors\": [");
+    }
+
+    int first = 1;
+    for (uint32_t s = 0; s < model->count; s++) {
+        gguf_ctx *ctx = gguf_shards_get_ctx(model,s);
+        if (ctx == NULL || gguf_build_index(ctx) == 0) {
+            perror(model->filenames[s]);
+            exit(1);
+        }
+
+        /* Select the tensors of this shard, and stream the ones we can
+         * decode. */
+        uint64_t count = ctx->header->tensor_count, numsel = 0;
+        gguf_tensor *sel = malloc(sizeof(gguf_tensor)*(count ? count : 1));
+        if (sel == NULL) {
+            perror("Allocating the tensors list");
+            exit(1);
+        }
+        for (uint64_t j = 0; j < count; j++) {
+            gguf_tensor *t = ctx->tensors+j;
+            if (pattern && !strmatch(pattern,strlen(pattern),
+                                     t->name,t->namelen,0)) continue;
+            if (gguf_can_dequantize(t->type)) sel[numsel++] = *t;
+        }
+        gguf_advise(ctx,GGUF_ADVICE_SEQUENTIAL);
+        gguf_stream *stream = gguf_stream_open(ctx,sel,numsel,
+                                               STREAM_CHUNK,Opt.io);
+        if (stream == NULL) {
+            perror("Opening the tensors stream");
+            exit(1);
+        }
+
+        for (uint64_t j = 0; j < count; j++) {
+            gguf_tensor *t = ctx->tensors+j;
+            if (pattern && !strmatch(pattern,strlen(pattern),
+                                     t->name,t->namelen,0)) continue;
+            if (!gguf_can_dequantize(t->type)) {
+                stats_print(t,NULL,first);
+                first = 0;
+                continue;
+            }
+
+            stats_partial_init(total);
+            uint64_t done = 0;
+            while (done < t->num_weights) {
+                gguf_tensor chunk;
+                if (gguf_stream_next(stream,&chunk,NULL,NULL) != 1) {
+                    perror("Reading the tensors data");
+                    exit(1);
+                }
+                struct stats_state st = {&chunk, partials, 0};
+                uint64_t numjobs =
+                    (chunk.num_weights+DEQUANT_CHUNK-1)/DEQUANT_CHUNK;
+                gguf_parallel(Opt.threads,numjobs,stats_job,&st);
+                if (st.error) {
+                    fprintf(stderr,"Failed to decode %.*s\n",
+                        (int)t->namelen, t->name);
+                    exit(1);
+                }
+                for (uint64_t k = 0; k < numjobs; k++)
+                    stats_merge(total,partials+k);
+                done += chunk.num_weights;
+            }
+            stats_print(t,total,first);
+            first = 0;
+        }
+        gguf_stream_close(stream);
+        free(sel);
+    }
+    if (!Opt.csv) printf("\n]}\n");
+    free(partials);
+    free(total);
+    gguf_shards_close(model);
+}
+
+/* =========================== 'scan' subcommand ============================ */
+
+#define SCAN_BATCH 1024 // Files scanned in parallel before printing.
+
+/* Append to 's' the JSON string of the 'len' bytes at 'str'. */
+static sds scan_json_string(sds s, const char *str, size_t len) {
+    s = sdscatlen(s,"\"",1);
+    for (size_t j = 0; j < len; j++) {
+        unsigned char c = str[j];
+        if (c == '"' || c == '\\') s = sdscatprintf(s,"\\%c",c);
+        else if (c < 0x20) s = sdscatprintf(s,"\\u%04x",c);
+        else s = sdscatlen(s,str+j,1);
+    }
+    return sdscatlen(s,"\"",1);
+}
+
+/* Return the JSON line describing the model 'filename': only the header
+ * is parsed, using the read-only mapping (or the sidecar index, when
+ * valid), so the tensors data is never touched, and the key-value
+ * values are skipped without being decoded, except for a few general.*
+ * strings. */
+static sds scan_model(const char *filename) {
+    sds line = sdsnew("{\"file\": ");
+    line = scan_json_string(line,filename,strlen(filename));
+    gguf_ctx *ctx = gguf_open_flags(filename,GGUF_RDONLY);
+    if (ctx == NULL) {
+        line = sdscat(line,", \"error\": ");
+        const char *err = strerror(errno);
+        line = scan_json_string(line,err,strlen(err));
+        return sdscat(line,"}");
+    }
+
+    line = sdscatprintf(line,", \"size\": %" PRIu64 ", \"version\": %u"
+                        ", \"kv_count\": %" PRIu64 ", \"tensor_count\": %"
+                        PRIu64, ctx->size, ctx->header->version,
+                        ctx->header->metadata_kv_count,
+                        ctx->header->tensor_count);
+
+    static const char *strkeys[] = {"general.architecture","general.name",
+                                    NULL};
+    gguf_key key;
+    while (gguf_get_key(ctx,&key)) {
+        for (int j = 0; key.type == GGUF_VALUE_TYPE_STRING && strkeys[j]; j++) {
+            if (key.namelen != strlen(strkeys[j]) ||
+                memcmp(key.name,strkeys[j],key.namelen)) continue;
+            line = sdscatprintf(line,", \"%s\": ",strchr(strkeys[j],'.')+1);
+            line = scan_json_string(line,key.val->string.string,
+                                    key.val->string.len);
+        }
+        gguf_do_with_value(ctx,key.type,key.val,NULL,0,0,NULL);
+    }
+
+    /* Tensors list, parameters and bytes per type. */
+    uint64_t params = 0, type_bytes[GGUF_TYPE_COUNT] = {0};
+    sds tensors = sdsempty();
+    gguf_tensor t;
+    while (gguf_get_tensor(ctx,&t)) {
+        params += t.num_weights;
+        if (t.type < GGUF_TYPE_COUNT) type_bytes[t.type] += t.bsize;
+        const char *tname = gguf_get_tensor_type_name(t.type);
+        tensors = sdscat(tensors,sdslen(tensors) ? ", [" : "[");
+        tensors = scan_json_string(tensors,t.name,t.namelen);
+        tensors = sdscatprintf(tensors,", \"%s\", [",tname ? tname : "?");
+        for (uint32_t j = 0; j < t.ndim; j++)
+            tensors = sdscatprintf(tensors,"%s%" PRIu64,j ? ", " : "",
+                                   t.dim[j]);
+        tensors = sdscat(tensors,"]]");
+    }
+
+    line = sdscatprintf(line,", \"params\": %" PRIu64 ", \"bytes\": {",
+                        params);
+    int first = 1;
+    for (uint32_t j = 0; j < GGUF_TYPE_COUNT; j++) {
+        if (type_bytes[j] == 0) continue;
+        line = sdscatprintf(line,"%s\"%s\": %" PRIu64, first ? "" : ", ",
+                            gguf_get_tensor_type_name(j), type_bytes[j]);
+        first = 0;
+    }
+    line = sdscatprintf(line,"}, \"tensors\": [%s]}",tensors);
+    sdsfree(tensors);
+    gguf_close(ctx);
+    return line;
+}
+
+/* State of the scan jobs: every job scans a file of the batch. */
+struct scan_state {
+    char **files;
+    sds *lines;
+};
+
+static void scan_job(void *privdata, uint64_t jobid) {
+    struct scan_state *st = privdata;
+    st->lines[jobid] = scan_model(st->files[jobid]);
+}
+
+/* Append 'name' to the array of 'count' names. */
+static void scan_add_name(char ***names, uint64_t *count, sds name) {
+    char **new = realloc(*names,sizeof(char*)*(*count+1));
+    if (new == NULL) {
+        perror("Allocating the files list");
+        exit(1);
+    }
+    new[(*count)++] = name;
+    *names = new;
+}
+
+static int scan_cmp_names(const void *a, const void *b) {
+    return strcmp(*(char**)a,*(char**)b);
+}
+
+/* Add to the 'files' array the .gguf files in the directory 'path' and
+ * its subdirectories, sorted by name. */
+static void scan_dir(const char *path, char ***files, uint64_t *count) {
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        perror(path);
+        return;
+    }
+    struct dirent *de;
+    char **names = NULL;
+    uint64_t numnames = 0;
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.') continue;
+        scan_add_name(&names,&numnames,
+                      sdscatprintf(sdsempty(),"%s/%s",path,de->d_name));
+    }
+    closedir(dir);
+    if (numnames) qsort(names,numnames,sizeof(char*),scan_cmp_names);
+
+    for (uint64_t j = 0; j < numnames; j++) {
+        struct stat sb;
+        size_t len = sdslen(names[j]);
+        if (stat(names[j],&sb) == -1) {
+            sdsfree(names[j]);
+        } else if (S_ISDIR(sb.st_mode)) {
+            scan_dir(names[j],files,count);
+            sdsfree(names[j]);
+        } else if (len > 5 && !strcmp(names[j]+len-5,".gguf")) {
+            scan_add_name(files,count,names[j]);
+        } else {
+            sdsfree(names[j]);
+        }
+    }
+    free(names);
+}
+
+/* Print a JSON line for every model found in the directory 'path'
+ * (recursively), or listed in the file 'path', one per line ("-" for
+ * the standard input). The models are scanned by --threads threads, and
+ * printed in order. */
+void gguf_tools_scan(const char *path) {
+    char **files = NULL;
+    uint64_t count = 0;
+    struct stat sb;
+    int isdir = strcmp(path,"-") && stat(path,&sb) == 0 && S_ISDIR(sb.st_mode);
+    if (isdir) {
+        scan_dir(path,&files,&count);
+    } else {
+        FILE *fp = strcmp(path,"-") ? fopen(path,"r") : stdin;
+        if (fp == NULL) {
+            perror(path);
+            exit(1);
+        }
+        char buf[4096];
+        while (fgets(buf,sizeof(buf),fp)) {
+            sds name = sdstrim(sdsnew(buf),"\r\n");
+            if (sdslen(name) == 0) {
+                sdsfree(name);
+                continue;
+            }
+            scan_add_name(&files,&count,name);
+        }
+        if (fp != stdin) fclose(fp);
+    }
+
+    sds lines[SCAN_BATCH];
+    for (uint64_t j = 0; j < count; j += SCAN_BATCH) {
+        uint64_t n = count-j < SCAN_BATCH ? count-j : SCAN_BATCH;
+        struct scan_state st = {files+j, lines};
+        gguf_parallel(Opt.threads,n,scan_job,&st);
+        for (uint64_t k = 0; k < n; k++) {
+            printf("%s\n",lines[k]);
+            sdsfree(lines[k]);
+            sdsfree(files[j+k]);
+        }
+        fflush(stdout);
+    }
+    free(files);
+}
+
+/* ======================= Main and CLI options parsing ===================== */
+
+/* Print the library stats and the process page faults on stderr.
+ * Registered with atexit() by the --stats option. */
+void gguf_tools_print_stats(void) {
+    gguf_stats st;
+    gguf_get_stats(&st);
+    struct rusage ru;
+    getrusage(RUSAGE_SELF,&ru);
+
+    fprintf(stderr,"--- stats ---\n");
+    fprintf(stderr,"page faults: %ld minor, %ld major\n",
+        ru.ru_minflt, ru.ru_majflt);
+    fprintf(stderr,"remaps: %" PRIu64 ", %.2f MB mapped, %.3f ms\n",
+        st.remaps, st.bytes_mapped/1e6, st.remap_ns/1e6);
+    fprintf(stderr,"header loads: %" PRIu64 ", %.3f ms\n",
+        st.header_loads, st.header_ns/1e6);
+    fprintf(stderr,"writes: %" PRIu64 ", %.2f MB written, %.3f ms\n",
+        st.writes, st.bytes_written/1e6, st.write_ns/1e6);
+    fprintf(stderr,"stream reads: %" PRIu64 ", %.2f MB read, %.3f ms\n",
+        st.reads, st.bytes_read/1e6, st.read_ns/1e6);
+    for (uint32_t type = 0; type < GGUF_TYPE_COUNT; type++) {
+        gguf_dequant_stats ds;
+        gguf_get_dequant_stats(type,&ds);
+        if (ds.calls == 0) continue;
+        fprintf(stderr,"convert %s: %" PRIu64 " calls, %" PRIu64 " weights, "
+                       "%.2f MB, %.3f ms, %.2f GB/s\n",
+            gguf_get_tensor_type_features(type)->name, ds.calls, ds.weights,
+            ds.bytes/1e6, ds.ns/1e6, ds.ns ? (double)ds.bytes/ds.ns : 0);
+    }
+}
+
+void gguf_tools_usage(const char *progname) {
+    printf("Usage: %s <subcommand> [arguments...] [options...]\n"
+"Subcommands:\n"
+"  show <filename> -- show GGUF model keys and tensors.\n"
+"  inspect-tensor <filename> <tensor-name> [count] -- show tensor weights.\n"
+"  compare <file1> <file2> -- weights diff for matching tensor names.\n"
+"  stats <filename> [pattern] -- weights statistics, JSON output.\n"
+"  scan <dir|list> -- one JSON line per model, parsing just headers.\n"
+"  split-mixtral <ids...> mixtral.gguf out.gguf -- extract expert.\n"
+"  extract-experts <in> <ids> <out> [<ids> <out> ...] -- extract experts.\n"
+"  quantize <in> <out> <type> [pattern=type ...] -- re-quantize model.\n"
+"  convert <in> <out> --to f16|bf16|f32 [--only pattern] -- retype tensors.\n"
+"  split <in> <out-prefix> <max-size> -- split a model in shards.\n"
+"  merge <shard> <out> -- merge the shards of a model in a single file.\n"
+"  index <filename> -- write a sidecar index for faster opening.\n"
+"  edit-kv <filename> <key[:type]=value|-key> ... -- edit keys in place.\n"
+"  bench [filename] -- benchmark the library, JSON output.\n"
+"Options:\n"
+"  --verbose       :With 'show', print full arrays (e.g. token lists)\n"
+"  --diffable      :With 'show', print tensor content hashes instead of\n"
+"                   offsets and sizes. Reads all the tensors data, unless\n"
+"                   the hashes are in a sidecar written by 'index'\n"
+"  --threads <n>   :Number of threads used to process tensors\n"
+"  --io <backend>  :Tensors data reads: mmap (default), pread or direct\n"
+"  --stats         :Print library counters and timings at exit\n"
+"  --hugepages     :Back scratch buffers with huge pages\n"
+"  --budget <size> :Max bytes of tensors in flight when converting\n"
+"  --csv           :With 'stats', CSV output instead of JSON\n"
+"  --rows <a:b>    :With 'inspect-tensor', show only rows a to b-1\n"
+"  --cols <a:b>    :With 'inspect-tensor', show only columns a to b-1\n"
+"Example:\n"
+"  split-mixtral 65230776370407150546470161412165 mixtral.gguf out.gguf\n"
+           , progname);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) gguf_tools_usage(argv[0]);
+
+    /* Parse options before getting into subcommands parsing. */
+    int j = 1;
+    while (j < argc) {
+        /* Every time we find a an option, we try to parse it
+         * and remove the used argv[] entries. In this way '--options'
+         * can be anywhere, making the tool simpler to use. */
+        int used = 0; // Number of argv[] entries used by the option.
+        if (!strcmp(argv[j],"--verbose")) {
+            Opt.verbose = 1;
+            used = 1;
+        } else if (!strcmp(argv[j],"--diffable")) {
+            Opt.diffable = 1;
+            used = 1;
+        } else if (!strcmp(argv[j],"--io") && j+1 < argc) {
+            if (!strcmp(argv[j+1],"mmap")) {
+                Opt.io = GGUF_STREAM_MMAP;
+            } else if (!strcmp(argv[j+1],"pread")) {
+                Opt.io = GGUF_STREAM_PREAD;
+            } else if (!strcmp(argv[j+1],"direct")) {
+                Opt.io = GGUF_STREAM_DIRECT;
+            } else {
+                fprintf(stderr,"Invalid I/O backend: %s\n", argv[j+1]);
+                exit(1);
+            }
+            used = 2;
+        } else if (!strcmp(argv[j],"--stats")) {
+            Opt.stats = 1;
+            used = 1;
+        } else if (!strcmp(argv[j],"--hugepages")) {
+            Opt.hugepages = 1;
+            used = 1;
+        } else if (!strcmp(argv[j],"--csv")) {
+            Opt.csv = 1;
+            used = 1;
+        } else if (!strcmp(argv[j],"--budget") && j+1 < argc) {
+            Opt.budget = parse_size(argv[j+1]);
+            if (Opt.budget == 0) {
+                fprintf(stderr,"Invalid budget: %s\n", argv[j+1]);
+                exit(1);
+            }
+            used = 2;
+        } else if (!strcmp(argv[j],"--to") && j+1 < argc) {
+            Opt.to = argv[j+1];
+            used = 2;
+        } else if (!strcmp(argv[j],"--only") && j+1 < argc) {
+            Opt.only = argv[j+1];
+            used = 2;
+        } else if (!strcmp(argv[j],"--rows") && j+1 < argc) {
+            Opt.rows = argv[j+1];
+            used = 2;
+        } else if (!strcmp(argv[j],"--cols") && j+1 < argc) {
+            Opt.cols = argv[j+1];
+            used = 2;
+        } else if (!strcmp(argv[j],"--threads") && j+1 < argc) {
+            Opt.threads = atoi(argv[j+1]);
+            if (Opt.threads < 1) {
+                fprintf(stderr,"Invalid number of threads: %s\n", argv[j+1]);
+                exit(1);
+            }
+            used = 2;
+        }
+
+        if (used) {
+            /* Strip the option, including the argv[argc] NULL term. */
+            memmove(argv+j, argv+j+used, sizeof(char*) * (argc-j-used+1));
+            argc -= used;
+        } else {
+            j++;
+        }
+    }
+    if (argc < 2) gguf_tools_usage(argv[0]);
+    if (Opt.stats) {
+        gguf_stats_enable(1);
+        atexit(gguf_tools_print_stats);
+    }
+
+    if (!strcmp(argv[1],"show") && argc == 3) {
+        gguf_tools_show(argv[2]);
+    } else if (!strcmp(argv[1],"scan") && argc == 3) {
+        gguf_tools_scan(argv[2]);
+    } else if (!strcmp(argv[1],"stats") && (argc == 3 || argc == 4)) {
+        gguf_tools_stats(argv[2],argc == 4 ? argv[3] : NULL);
+    } else if (!strcmp(argv[1],"compare") && argc == 4) {
+        gguf_tools_compare(argv[2],argv[3]);
+    } else if (!strcmp(argv[1],"inspect-tensor") && (argc == 4 || argc == 5)) {
+        gguf_tools_inspect_weights(argv[2],argv[3],
+                                   argc == 5 ? atoi(argv[4]) : 0);
+    } else if (!strcmp(argv[1],"split-mixtral") && argc == 5) {
+        /* One digit per layer: if there are fewer digits than layers,
+         * the last one is repeated up to the last layer. */
+        size_t elen = strlen(argv[2]);
+        int *experts = malloc(sizeof(int)*(elen ? elen : 1));
+        if (experts == NULL) {
+            perror("Allocating experts list");
+            exit(1);
+        }
+        for (size_t j = 0; j < elen; j++) {
+            experts[j] = argv[2][j] - '0';
+            if (experts[j] < 0 || experts[j] > 9) {
+                fprintf(stderr,"Invalid expert ID: %c\n", argv[2][j]);
+                exit(1);
+            }
+        }
+        gguf_tools_split_mixtral(experts,elen,argv[3],argv[4]);
+    } else if (!strcmp(argv[1],"extract-experts") && argc >= 5 && argc%2 == 1) {
+        int numout = (argc-3)/2;
+        struct extract_output *outputs = calloc(numout,sizeof(*outputs));
+        if (outputs == NULL) {
+            perror("Allocating outputs");
+            exit(1);
+        }
+        for (int j = 0; j < numout; j++) {
+            outputs[j].filename = argv[4+j*2];
+            if (parse_expert_selection(argv[3+j*2],&outputs[j].sel) == 0) {
+                fprintf(stderr,"Invalid experts list: %s\n", argv[3+j*2]);
+                exit(1);
+            }
+        }
+        gguf_tools_extract_experts(argv[2],outputs,numout);
+    } else if (!strcmp(argv[1],"quantize") && argc >= 5) {
+        gguf_tools_quantize(argv[2],argv[3],argv[4],argv+5,argc-5);
+    } else if (!strcmp(argv[1],"convert") && argc == 4 && Opt.to) {
+        gguf_tools_convert(argv[2],argv[3],Opt.to,Opt.only);
+    } else if (!strcmp(argv[1],"split") && argc == 5) {
+        uint64_t max_size = parse_size(argv[4]);
+        if (max_size == 0) {
+            fprintf(stderr,"Invalid shard size: %s\n", argv[4]);
+            exit(1);
         }
-        gguf_tools_split_mixtral(experts,argv[3],argv[4]);
+        gguf_tools_reshard(argv[2],argv[3],max_size);
+    } else if (!strcmp(argv[1],"merge") && argc == 4) {
+        gguf_tools_reshard(argv[2],argv[3],0);
+    } else if (!strcmp(argv[1],"index") && argc == 3) {
+        gguf_tools_index(argv[2]);
+    } else if (!strcmp(argv[1],"edit-kv") && argc >= 4) {
+        gguf_tools_edit_kv(argv[2],argv+3,argc-3);
+    } else if (!strcmp(argv[1],"bench") && (argc == 2 || argc == 3)) {
+        gguf_tools_bench(argc == 3 ? argv[2] : NULL);
     } else {
         gguf_tools_usage(argv[0]);
     }
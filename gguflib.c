@@ -1,3 +1,7 @@
+#ifdef __linux__
+#define _GNU_SOURCE // For copy_file_range() and fallocate().
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -6,9 +10,20 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <unistd.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
+#endif
 #include <string.h>
+#include <ctype.h>
 #include <assert.h>
 #include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "gguflib.h"
 #include "fp16.h"
@@ -24,11 +39,7 @@ const char *gguf_value_name[] = {
 };
 
 /* GGUF tensor type to features lookup table. */
-struct gguf_tensor_type_features {
-    char *name;
-    uint32_t items_per_block;
-    uint32_t bytes_per_block;
-} gguf_tensor_type_features[] = {
+struct gguf_tensor_type_features gguf_tensor_type_features[] = {
     {"f32", 1, 4},
     {"f16", 1, 2},
     {"q4_0", 32, 18},
@@ -38,8 +49,8 @@ struct gguf_tensor_type_features {
     {"q5_0", 32, 22},
     {"q5_1", 32, 24},
     {"q8_0", 32, 34},
-    {"q8_1", 32, 40},
-    {"q2_k", 256, 82},
+    {"q8_1", 32, 36},
+    {"q2_k", 256, 84},
     {"q3_k", 256, 110},
     {"q4_k", 256, 144},
     {"q5_k", 256, 176},
@@ -48,8 +59,8 @@ struct gguf_tensor_type_features {
     {"iq2_xxs", 256, 66},
     {"iq2_xs", 256, 74},
     {"iq3_xxs", 256, 98},
-    {"iq1_s", 256, 110},
-    {"iq4_nl", 256, 50},
+    {"iq1_s", 256, 50},
+    {"iq4_nl", 32, 18},
     {"iq3_s", 256, 110},
     {"iq2_s", 256, 82},
     {"iq4_xs", 256, 136},
@@ -107,17 +118,108 @@ uint64_t gguf_value_len(uint32_t type, union gguf_value *val) {
     return valuelen;
 }
 
+/* ================================= Stats ================================== */
+
+/* Stats are disabled by default: the hot paths just check this flag,
+ * and don't read the clock or touch the counters unless enabled. */
+static int StatsEnabled = 0;
+static gguf_stats TotalStats;
+static gguf_dequant_stats DequantStats[GGUF_TYPE_COUNT];
+
+/* Enable (or disable, if 'enable' is 0) the collection of the context
+ * counters in ctx->stats and of the conversion counters. */
+void gguf_stats_enable(int enable) {
+    StatsEnabled = enable;
+}
+
+/* Return the current time in nanoseconds if stats are enabled, else 0. */
+static uint64_t gguf_stats_now(void) {
+    if (!StatsEnabled) return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+/* Add 'v' to the stats field of the context and of the totals. Atomic,
+ * since the streaming reader thread updates the context as well. */
+#define GGUF_STATS_ADD(ctx,field,v) do { \
+    __atomic_fetch_add(&(ctx)->stats.field,(v),__ATOMIC_RELAXED); \
+    __atomic_fetch_add(&TotalStats.field,(v),__ATOMIC_RELAXED); \
+} while(0)
+
+/* Account an operation of 'bytes' bytes started at 'start' (obtained
+ * with gguf_stats_now()) on the counters 'calls', 'bytes' and 'ns'. */
+#define GGUF_STATS_OP(ctx,start,bytes,calls_field,bytes_field,ns_field) do { \
+    if (StatsEnabled) { \
+        GGUF_STATS_ADD(ctx,calls_field,1); \
+        GGUF_STATS_ADD(ctx,bytes_field,(bytes)); \
+        GGUF_STATS_ADD(ctx,ns_field,gguf_stats_now()-(start)); \
+    } \
+} while(0)
+
+/* Fill 'stats' with the totals of all the contexts, including the ones
+ * already closed. */
+void gguf_get_stats(gguf_stats *stats) {
+    uint64_t *src = (uint64_t*)&TotalStats, *dst = (uint64_t*)stats;
+    for (size_t j = 0; j < sizeof(*stats)/sizeof(uint64_t); j++)
+        dst[j] = __atomic_load_n(src+j,__ATOMIC_RELAXED);
+}
+
+/* Fill 'stats' with the conversion counters of the specified tensor type,
+ * summed over all the conversion functions and output formats.
+ * Return 0 if the type is out of range, otherwise 1. */
+int gguf_get_dequant_stats(uint32_t type, gguf_dequant_stats *stats) {
+    if (type >= GGUF_TYPE_COUNT) return 0;
+    uint64_t *src = (uint64_t*)(DequantStats+type), *dst = (uint64_t*)stats;
+    for (size_t j = 0; j < sizeof(*stats)/sizeof(uint64_t); j++)
+        dst[j] = __atomic_load_n(src+j,__ATOMIC_RELAXED);
+    return 1;
+}
+
+/* write() to the context file, accounting the written bytes. */
+static ssize_t gguf_write(gguf_ctx *ctx, const void *buf, size_t len) {
+    uint64_t start = gguf_stats_now();
+    ssize_t nwritten = write(ctx->fd,buf,len);
+    if (nwritten > 0)
+        GGUF_STATS_OP(ctx,start,nwritten,writes,bytes_written,write_ns);
+    return nwritten;
+}
+
 /* =============================== GGUF file API ============================ */
 
-/* Open a GGUF file and return a parsing context. */
+static void gguf_free_index(gguf_ctx *ctx);
+static void gguf_free_header_cache(gguf_ctx *ctx);
+static int gguf_write_staged(gguf_ctx *ctx);
+
+/* Open a GGUF file and return a parsing context. The file is opened
+ * in read-write mode, so that it can be extended with the writing API.
+ * See gguf_open_flags() to open files in read-only mode. */
 gguf_ctx *gguf_open(const char *filename) {
-    int fd = open(filename,O_RDWR|O_APPEND);
+    return gguf_open_flags(filename,GGUF_NONE);
+}
+
+/* Like gguf_open(), but with flags. The supported flags are:
+ *
+ * GGUF_RDONLY: open the file in read-only mode, and map it with
+ *              PROT_READ. This works with files on read-only file
+ *              systems, and many processes inspecting the same
+ *              file share the same clean pages of the page cache.
+ *              The writing API can't be used with this context.
+ *              If a valid sidecar index exists (the file name plus
+ *              GGUF_SIDECAR_EXT, see gguf_write_sidecar()), it is
+ *              loaded instead of parsing the header. */
+gguf_ctx *gguf_open_flags(const char *filename, int flags) {
+    int fd = open(filename,(flags & GGUF_RDONLY) ? O_RDONLY : O_RDWR|O_APPEND);
     if (fd == -1) return NULL;
 
     /* Mapping successful. We can create our context object. */
     gguf_ctx *ctx = calloc(1, sizeof(*ctx));
-    if (!ctx) return NULL;
+    if (!ctx) {
+        close(fd);
+        return NULL;
+    }
     ctx->fd = fd;
+    ctx->flags = flags;
     ctx->alignment = 32; // Default alignment of GGUF files.
     ctx->data_off = 0;   // Set later.
     if (gguf_remap(ctx) == 0) {
@@ -125,6 +227,20 @@ gguf_ctx *gguf_open(const char *filename) {
         return NULL;
     }
     gguf_rewind(ctx);
+
+    /* Read-only files are likely immutable models: use the sidecar index
+     * if any, so that the header does not need to be parsed. */
+    if (flags & GGUF_RDONLY) {
+        int saved_errno = errno;
+        size_t len = strlen(filename)+sizeof(GGUF_SIDECAR_EXT);
+        char *sidecar = malloc(len);
+        if (sidecar) {
+            snprintf(sidecar,len,"%s%s",filename,GGUF_SIDECAR_EXT);
+            gguf_load_sidecar(ctx,sidecar);
+            free(sidecar);
+        }
+        errno = saved_errno;
+    }
     return ctx;
 }
 
@@ -147,14 +263,26 @@ void gguf_rewind(gguf_ctx *ctx) {
  * Return 1 on success, 0 on error. */
 int gguf_remap(gguf_ctx *ctx) {
     struct stat sb;
+    uint64_t start = gguf_stats_now();
 
-    /* Unmap if the file was already memory mapped. */
-    if (ctx->data) munmap(ctx->data,ctx->size);
+    /* Unmap if the file was already memory mapped. The tensors index
+     * points inside the old mapping, and the header may have changed, so
+     * both the index and the header cache are no longer valid. Buffered
+     * writers (see gguf_create()) may instead have the staging buffer
+     * as data: it is released later, once the file is mapped. */
+    if (ctx->data && ctx->data != ctx->wbuf) munmap(ctx->data,ctx->size);
+    ctx->data = NULL;
+    gguf_free_index(ctx);
+    gguf_free_header_cache(ctx);
 
     /* Get the size of the file to map, then map it. */
     if (fstat(ctx->fd,&sb) == -1) return 0;
 
-    void *mapped = mmap(0,sb.st_size,PROT_READ|PROT_WRITE,MAP_SHARED,ctx->fd,0);
+    void *mapped;
+    if (ctx->flags & GGUF_RDONLY)
+        mapped = mmap(0,sb.st_size,PROT_READ,MAP_PRIVATE,ctx->fd,0);
+    else
+        mapped = mmap(0,sb.st_size,PROT_READ|PROT_WRITE,MAP_SHARED,ctx->fd,0);
     if (mapped == MAP_FAILED) return 0;
 
     /* Minimal sanity check... */
@@ -167,6 +295,9 @@ int gguf_remap(gguf_ctx *ctx) {
     ctx->data = mapped;
     ctx->header = mapped;
     ctx->size = sb.st_size;
+    free(ctx->wbuf);
+    ctx->wbuf = NULL;
+    GGUF_STATS_OP(ctx,start,ctx->size,remaps,bytes_mapped,remap_ns);
     return 1;
 }
 
@@ -174,8 +305,12 @@ int gguf_remap(gguf_ctx *ctx) {
  * and cleanup resources. */
 void gguf_close(gguf_ctx *ctx) {
     if (ctx == NULL) return;
-    if (ctx->data) munmap(ctx->data,ctx->size);
+    if (ctx->flags & GGUF_BUFFERED) gguf_write_staged(ctx);
+    if (ctx->data && ctx->data != ctx->wbuf) munmap(ctx->data,ctx->size);
+    free(ctx->wbuf);
     close(ctx->fd);
+    gguf_free_index(ctx);
+    gguf_free_header_cache(ctx);
     free(ctx);
 }
 
@@ -207,6 +342,13 @@ int gguf_get_key(gguf_ctx *ctx, gguf_key *key) {
 /* Skip all the key values pairs in the GGUF files to get to the
  * tensors information segment. */
 void gguf_skip_key_values_section(gguf_ctx *ctx) {
+    /* With the header cache we know where the section ends. */
+    if (ctx->left_kv && gguf_load_header(ctx)) {
+        ctx->off = ctx->hcache->tensors_info_off;
+        ctx->left_kv = 0;
+        return;
+    }
+
     gguf_key key;
     while (gguf_get_key(ctx,&key))
         gguf_do_with_value(ctx,key.type,key.val,NULL,0,0,NULL);
@@ -239,6 +381,43 @@ void gguf_set_data_offset(gguf_ctx *ctx) {
     ctx->data_off = offset + padding;
 }
 
+/* Return the bytes used in the file by a tensor of the specified type
+ * and number of weights.
+ *
+ * To accurately calculate the bytes used by a tensor on the GGUF
+ * file, we need to take into account that quantization methods store
+ * tensors as block of N weights. So first of all we need to understand
+ * the number of padding weights (since the last block may have just
+ * fewer weights stored inside, but still requires to be stored to its full
+ * length). Then we can do the math to see how many blocks we need, and
+ * multiply by the block size to obtain the final total size. */
+static uint64_t gguf_tensor_bsize(uint32_t type, uint64_t num_weights) {
+    struct gguf_tensor_type_features *tf;
+    tf = gguf_get_tensor_type_features(type);
+    if (tf->items_per_block == 0) return 0; // Deprecated types.
+    uint64_t weights_padding = gguf_get_alignment_padding(tf->items_per_block,num_weights);
+    return ((num_weights+weights_padding) / tf->items_per_block) * tf->bytes_per_block;
+}
+
+/* Fill 'tensor' with the info of the tensor number 'idx', using the
+ * header cache. Return the offset of the next tensor info. */
+static uint64_t gguf_get_cached_tensor(gguf_ctx *ctx, uint64_t idx, gguf_tensor *tensor) {
+    gguf_header_cache *hc = ctx->hcache;
+    uint64_t off = hc->tensor_info_off[idx];
+    struct gguf_string *str = (struct gguf_string*) (ctx->data+off);
+    tensor->namelen = str->len;
+    tensor->name = str->string;
+    off += 8+str->len;
+    tensor->ndim = *(uint32_t*)(ctx->data+off);
+    memcpy(tensor->dim,ctx->data+off+4,8*tensor->ndim);
+    tensor->type = hc->tensor_type[idx];
+    tensor->offset = hc->tensor_offset[idx];
+    tensor->num_weights = hc->tensor_weights[idx];
+    tensor->bsize = hc->tensor_bsize[idx];
+    tensor->weights_data = ctx->data + tensor->offset;
+    return off + 4 + 8*tensor->ndim + 4 + 8; // ndim, dims, type, offset.
+}
+
 /* Parse the next tensor info data. Returns information into 'tensor'.
  * The function return value is 1 if a tensor was returned, or 0
  * if there are no longer tensors to process in this GGUF file or if
@@ -260,7 +439,17 @@ int gguf_get_tensor(gguf_ctx *ctx, gguf_tensor *tensor) {
 
     /* We want to return tensor data with offsets relative to the start
      * of the file, so that the user of the API is able to access tensors
-     * as it iterates over them. To do so, we need to perform a full
+     * as it iterates over them. To do so, we need to know where the
+     * data section starts: it is found by the header cache, that also
+     * decodes all the tensors info at once. */
+    if (gguf_load_header(ctx)) {
+        uint64_t idx = ctx->header->tensor_count - ctx->left_tensors;
+        ctx->off = gguf_get_cached_tensor(ctx,idx,tensor);
+        ctx->left_tensors--;
+        return 1;
+    }
+
+    /* No cache (out of memory or invalid tensor types): perform a full
      * scan if this is the first tensor info we are reading. */
     if (ctx->data_off == 0) gguf_set_data_offset(ctx);
 
@@ -297,622 +486,3883 @@ int gguf_get_tensor(gguf_ctx *ctx, gguf_tensor *tensor) {
     tensor->offset = ctx->data_off + *offset;
     tensor->weights_data = ctx->data + tensor->offset;
 
-    /* To accurately calculate the bytes used by this tensor on the GGUF
-     * file, we need to take into account that quantization methods store
-     * tensors as block of N weights. So first of all we need to understand
-     * the number of padding weights (since the last block may have just
-     * fewer weights stored inside, but still requires to be stored to its full
-     * length). Then we can do the math to see how many blocks we need, and
-     * multiply by the block size to obtain the final total size. */
-    struct gguf_tensor_type_features *tf;
-    tf = gguf_get_tensor_type_features(tensor->type);
-    uint64_t weights_padding = gguf_get_alignment_padding(tf->items_per_block,tensor->num_weights);
-    tensor->bsize = ((tensor->num_weights+weights_padding) / tf->items_per_block) * tf->bytes_per_block;
+    tensor->bsize = gguf_tensor_bsize(tensor->type,tensor->num_weights);
     return 1;
 }
 
-/* This function can be called after gguf_get_key(), since the context
- * offset will be in the position of a value.
- *
- * The function will process the value, including nested values (in the
- * case of an array value), and for each value will call the specified
- * callback. As a side effect of calling this function, the context offset
- * is advanced to consume the value.
- *
- * If the callback is set to NULL, no callback will be called,
- * but the value will be consumed, so that it will be possible
- * to call gguf_get_key() or gguf_get_tensor() to continue reading
- * the file.
- *
- * When the callback is called, it gets the argument 'privdata' and 'in_array'
- * as passed to this function. This is useful if the callback needs
- * to take state (for pretty printing or alike) and to know if the
- * elements it is processing belong to an array.
- *
- * The value of 'in_array' is the 1-based index of the element being
- * processed.
- *
- * In the case of arrays, callbacks are also called with the special
- * type ARRAY_START / ARRAY_END at the start/end of the array
- * processing. */
-void gguf_do_with_value(gguf_ctx *ctx, uint32_t type, union gguf_value *val,
-                        void *privdata, uint64_t in_array, uint64_t array_len,
-                        void(*callback)(void *privdata, uint32_t type,
-                                     union gguf_value *val, uint64_t in_array,
-                                     uint64_t array_len))
-{
-    if (type == GGUF_VALUE_TYPE_ARRAY) {
-        uint32_t etype; // Elements type.
-        uint64_t len;   // Number of elements.
-        etype = val->array.type;
-        len = val->array.len;
-        //exit(1);
-        ctx->off += 4+8; // Skip elements type / array length.
-        if (callback)
-            callback(privdata,GGUF_VALUE_TYPE_ARRAY_START,val,in_array,len);
-        for (uint64_t j = 0; j < len; j++) {
-            val = (union gguf_value*)(ctx->data+ctx->off);
-            gguf_do_with_value(ctx,etype,val,privdata,j+1,len,callback);
-            /* As a side effect of calling gguf_do_with_value() ctx->off
-             * will be update, so 'val' will be set to the next element. */
-        }
-        if (callback)
-            callback(privdata,GGUF_VALUE_TYPE_ARRAY_END,NULL,in_array,len);
-    } else {
-        if (callback)
-            callback(privdata,type,val,in_array,array_len);
-        ctx->off += gguf_value_len(type,val);
-    }
-}
-
-struct gguf_print_options {
-    uint64_t max_array_items;       // Don't print more than N items.
-};
+/* ============================== Header cache ============================== */
 
-/* Print a GGUF value. 'privdata' is used to pass guff_print_options and
- * may be NULL if no options are provided.
- *
- * The function is designed to be used as a callback of gguf_do_with_value(). */
-void gguf_print_value_callback(void *privdata, uint32_t type, union gguf_value *val, uint64_t in_array, uint64_t array_len) {
-    struct gguf_print_options *po = privdata;
-    if (po && po->max_array_items && in_array > po->max_array_items) {
-        if (in_array-1 == po->max_array_items)
-            printf("... %" PRIu64 " more items of %" PRIu64 "",
-                   array_len-in_array+1, array_len);
+static void gguf_free_header_cache(gguf_ctx *ctx) {
+    gguf_header_cache *hc = ctx->hcache;
+    if (hc == NULL) return;
+    gguf_free_index(ctx); // Built from the header cache.
+    ctx->hcache = NULL;
+    free(hc->tensor_hash);  // Never points to the sidecar mapping.
+    if (hc->map) {
+        munmap(hc->map,hc->map_size);
+        free(hc);
         return;
     }
-
-    switch (type) {
-        case GGUF_VALUE_TYPE_ARRAY_START:
-            printf("["); break;
-        case GGUF_VALUE_TYPE_ARRAY_END:
-            printf("]"); break;
-        case GGUF_VALUE_TYPE_UINT8:
-            printf("%u", val->uint8); break;
-        case GGUF_VALUE_TYPE_INT8:
-            printf("%d", val->int8); break;
-        case GGUF_VALUE_TYPE_UINT16:
-            printf("%u", val->uint16); break;
-        case GGUF_VALUE_TYPE_INT16:
-            printf("%d", val->int16); break;
-        case GGUF_VALUE_TYPE_UINT32:
-            printf("%u", val->uint32); break;
-        case GGUF_VALUE_TYPE_INT32:
-            printf("%d", val->int32); break;
-        case GGUF_VALUE_TYPE_FLOAT32:
-            printf("%f", val->float32); break;
-        case GGUF_VALUE_TYPE_BOOL:
-            if (val->boolval == 0 || val->boolval == 1)
-                printf("%s", val->boolval ? "true" : "false");
-            else
-                printf("Invalid boolean value %d", val->boolval);
-            break;
-        case GGUF_VALUE_TYPE_STRING:
-            printf("%.*s", (int)val->string.len, val->string.string); break;
-        case GGUF_VALUE_TYPE_UINT64:
-            printf("%" PRIu64 "", val->uint64); break;
-        case GGUF_VALUE_TYPE_INT64:
-            printf("%" PRId64 "", val->int64); break;
-        case GGUF_VALUE_TYPE_FLOAT64:
-            printf("%lf", val->float64); break;
-        default:
-            printf("Unknown type\n");
-            break;
-    }
-    if (in_array && in_array != array_len) printf(", ");
+    free(hc->kv_off);
+    free(hc->tensor_info_off);
+    free(hc->tensor_type);
+    free(hc->tensor_offset);
+    free(hc->tensor_weights);
+    free(hc->tensor_bsize);
+    free(hc);
 }
 
-/* Print the current value, including arrays. As a side effect
- * the value will be consumed from the context, that will now point
- * to the next item in the GGUF file.
+/* Decode the whole header in a single pass: the offset of every
+ * key-value pair is recorded, the tensors info section is decoded into
+ * ctx->hcache (see gguf_header_cache), and the data section offset and
+ * the alignment are set. Later gguf_skip_key_values_section() is O(1),
+ * and gguf_get_tensor() just copies the cached info: iterating the
+ * tensors again after a gguf_rewind() does not parse anything.
  *
- * If 'full' is true, in the case of arrays, the whole array is printed,
- * otherwise just the first few elements. */
-void gguf_print_value(gguf_ctx *ctx, uint32_t type, union gguf_value *val, int full) {
-    struct gguf_print_options po;
-    po.max_array_items = full ? 0 : 30;
-    gguf_do_with_value(ctx,type,val,&po,0,0,gguf_print_value_callback);
-}
+ * The function is called automatically when needed, and does nothing if
+ * the header is already loaded. The parsing state is not modified.
+ * The cache is released by gguf_remap(), since the header may change.
+ *
+ * Return 1 on success, 0 on out of memory or if the tensors info is
+ * not valid (errno is set to EINVAL). */
+int gguf_load_header(gguf_ctx *ctx) {
+    if (ctx->hcache) return 1;
+    uint64_t start = gguf_stats_now();
 
-/* ============================= GGUF writing API  ========================== */
+    /* Save the parsing state, so that we can restore it later. */
+    uint64_t off = ctx->off;
+    uint64_t left_kv = ctx->left_kv;
+    uint64_t left_tensors = ctx->left_tensors;
 
-/* Create an empty GGUF file with no key-value pairs nor tensors.
- * The file can be extended by using the APIs to add tensors and
- * keys.
- *
- * On success the context with the file already loaded is returned,
- * otherwise NULL is returned. */
-gguf_ctx *gguf_create(const char *filename, int flags) {
-    struct gguf_header hdr;
-    memcpy(&hdr.magic,"GGUF",4);
-    hdr.version = 3;
-    hdr.tensor_count = 0;
-    hdr.metadata_kv_count = 0;
+    uint64_t num_kv = ctx->header->metadata_kv_count;
+    uint64_t count = ctx->header->tensor_count;
+    uint64_t nk = num_kv ? num_kv : 1, nt = count ? count : 1;
+    gguf_header_cache *hc = calloc(1,sizeof(*hc));
+    if (hc == NULL) return 0;
+    ctx->hcache = hc;
+    hc->kv_off = malloc(sizeof(uint64_t)*nk);
+    hc->tensor_info_off = malloc(sizeof(uint64_t)*nt);
+    hc->tensor_type = malloc(sizeof(uint32_t)*nt);
+    hc->tensor_offset = malloc(sizeof(uint64_t)*nt);
+    hc->tensor_weights = malloc(sizeof(uint64_t)*nt);
+    hc->tensor_bsize = malloc(sizeof(uint64_t)*nt);
+    if (!hc->kv_off || !hc->tensor_info_off || !hc->tensor_type ||
+        !hc->tensor_offset || !hc->tensor_weights || !hc->tensor_bsize)
+    {
+        gguf_free_header_cache(ctx);
+        return 0;
+    }
 
-    FILE *fp = fopen(filename, flags & GGUF_OVERWRITE ? "w" : "wx");
-    if (fp == NULL) return NULL;
-    if (fwrite(&hdr,1,sizeof(hdr),fp) != sizeof(hdr)) {
-        fclose(fp);
-        return NULL;
+    /* Walk the key-value pairs. This also sets the alignment. */
+    gguf_key key;
+    ctx->off = sizeof(struct gguf_header);
+    ctx->left_kv = num_kv;
+    for (uint64_t j = 0; j < num_kv; j++) {
+        hc->kv_off[j] = ctx->off;
+        if (gguf_get_key(ctx,&key) == 0) break;
+        gguf_do_with_value(ctx,key.type,key.val,NULL,0,0,NULL);
     }
-    fclose(fp);
+    hc->tensors_info_off = ctx->off;
 
-    return gguf_open(filename);
-}
+    /* Decode the tensors info. Tensor offsets are relative to the data
+     * section, that starts after the tensors info, so they are fixed
+     * later. */
+    uint64_t o = ctx->off;
+    int valid = 1;
+    for (uint64_t j = 0; j < count; j++) {
+        hc->tensor_info_off[j] = o;
+        struct gguf_string *str = (struct gguf_string*) (ctx->data+o);
+        o += 8+str->len;        // Skip prefixed len + string.
+        uint32_t ndim = *(uint32_t*)(ctx->data+o);
+        o += 4;                 // Skip num dimensions.
+        if (ndim > GGUF_TENSOR_MAX_DIM) {
+            valid = 0;
+            break;
+        }
+        uint64_t num_weights = 1;
+        for (uint32_t d = 0; d < ndim; d++) {
+            num_weights *= *(uint64_t*)(ctx->data+o);
+            o += 8;             // Skip dimension.
+        }
+        uint32_t type = *(uint32_t*)(ctx->data+o);
+        o += 4;                 // Skip tensor type.
+        if (type >= GGUF_TYPE_COUNT) {
+            valid = 0;
+            break;
+        }
+        hc->tensor_type[j] = type;
+        hc->tensor_weights[j] = num_weights;
+        hc->tensor_bsize[j] = gguf_tensor_bsize(type,num_weights);
+        hc->tensor_offset[j] = *(uint64_t*)(ctx->data+o);
+        o += 8;                 // Skip tensor offset.
+    }
 
-/* Low level API to append some key-value data to the GGUF file identified
- * by the context 'ctx'. It's up to the caller to provide a well-formatted
- * value of the specified type in 'val'. The len is the raw bytes length of
- * the specified value. Higher level APIs use this one to create fields with
- * different numerical values, strings, ...
- *
- * On success the function returns 1. Otherwise 0.
- * The function fails and returns 0 with errno set to EINVAL if the
- * tensors count in the header is non-zero: we can't append key-value
- * data after the first tensor was emitted. */
-int gguf_append_kv(gguf_ctx *ctx, const char *keyname, uint64_t keylen, uint32_t type, void *val, uint64_t len) {
-    if (ctx->header->tensor_count != 0) {
+    /* Restore the parsing state. */
+    ctx->off = off;
+    ctx->left_kv = left_kv;
+    ctx->left_tensors = left_tensors;
+    if (!valid) {
+        gguf_free_header_cache(ctx);
         errno = EINVAL;
         return 0;
     }
-    if (write(ctx->fd,&keylen,sizeof(keylen)) != sizeof(keylen)) return 0;
-    if (write(ctx->fd,keyname,keylen) != (ssize_t)keylen) return 0;
-    if (write(ctx->fd,&type,sizeof(type)) != sizeof(type)) return 0;
-    if (write(ctx->fd,val,len) != (ssize_t)len) return 0;
-    if (gguf_remap(ctx) == 0) return 0;
-    ctx->header->metadata_kv_count++;
-    return 1;
-}
 
-/* Append tensor metadata (but not the actual tensor weights data) to the
- * GGUF file identified by 'ctx'. */
-int gguf_append_tensor_info(gguf_ctx *ctx, const char *tensorname, uint64_t namelen, uint32_t num_dim, uint64_t *dim, uint32_t type, uint64_t offset)
-{
-    if (write(ctx->fd,&namelen,sizeof(namelen)) != sizeof(namelen)) return 0;
-    if (write(ctx->fd,tensorname,namelen) != (ssize_t)namelen) return 0;
-    if (write(ctx->fd,&num_dim,sizeof(num_dim)) != sizeof(num_dim)) return 0;
-    for (uint32_t j = 0; j < num_dim; j++) {
-        if (write(ctx->fd,&dim[j],sizeof(uint64_t)) != sizeof(uint64_t))
-            return 0;
+    ctx->data_off = o + gguf_get_alignment_padding(ctx->alignment,o);
+    for (uint64_t j = 0; j < count; j++)
+        hc->tensor_offset[j] += ctx->data_off;
+    if (StatsEnabled) {
+        GGUF_STATS_ADD(ctx,header_loads,1);
+        GGUF_STATS_ADD(ctx,header_ns,gguf_stats_now()-start);
     }
-    if (write(ctx->fd,&type,sizeof(type)) != sizeof(type)) return 0;
-    if (write(ctx->fd,&offset,sizeof(offset)) != sizeof(offset)) return 0;
-    if (gguf_remap(ctx) == 0) return 0;
-    ctx->header->tensor_count++;
     return 1;
 }
 
-/* Append tensor data enforcing the GGUF file aligment.
- * The function will take care to add the padding required to start writing
- * the tensor at an alignment multiple. */
-int gguf_append_tensor_data(gguf_ctx *ctx, void *tensor, uint64_t tensor_size) {
-    char padding_data[1024] = {0};
-    assert(sizeof(padding_data) >= ctx->alignment);
+/* ============================== Tensors index ============================= */
 
-    uint64_t padding = gguf_get_alignment_padding(ctx->alignment,ctx->size);
-    if (write(ctx->fd,padding_data,padding) != (ssize_t)padding) return 0;
-    if (write(ctx->fd,tensor,tensor_size) != (ssize_t)tensor_size) return 0;
-    if (gguf_remap(ctx) == 0) return 0;
-    return 1;
+/* FNV-1a hash of 'len' bytes at 'p', starting from the hash 'h', so that
+ * non contiguous data can be hashed in steps. */
+static uint64_t gguf_fnv1a(uint64_t h, const void *p, size_t len) {
+    const uint8_t *b = p;
+    for (size_t j = 0; j < len; j++) {
+        h ^= b[j];
+        h *= 1099511628211ULL;
+    }
+    return h;
 }
 
-/* ============================ GGUF dequantization ========================= */
+#define GGUF_FNV1A_INIT 14695981039346656037ULL
 
-/* This callback is used by dequantization functions to store dequantized
- * weights in a different format than f32. By default all the dequantization
- * functions will store f32 floats just just f[j] = weight, but if
- * a store callback is passed, the function will be used. */
-typedef void (*store_float_callback)(void *dst, uint64_t idx, float f);
+/* FNV-1a hash of the tensor name, used by the tensors index. */
+static uint64_t gguf_hash_name(const char *name, size_t namelen) {
+    return gguf_fnv1a(GGUF_FNV1A_INIT,name,namelen);
+}
 
-/* Callback used to store F16 when dequantizing. */
-void gguf_store_f16_callback(void *dst, uint64_t idx, float f) {
-    uint16_t *f16 = dst;
-    f16[idx] = to_half(f);
+/* Release the tensors index, if any. */
+static void gguf_free_index(gguf_ctx *ctx) {
+    free(ctx->tensors);
+    free(ctx->index);
+    ctx->tensors = NULL;
+    ctx->index = NULL;
+    ctx->index_size = 0;
 }
 
-/* Callback used to store BF16 when dequantizing. */
-void gguf_store_bf16_callback(void *dst, uint64_t idx, float f) {
-    uint16_t *f16 = dst;
-    f16[idx] = to_brain(f);
+/* Return true if the tensor number 'idx' of the header cache is
+ * called 'name'. */
+static int gguf_cached_name_eq(gguf_ctx *ctx, uint64_t idx, const char *name, size_t namelen) {
+    struct gguf_string *str = (struct gguf_string*)
+        (ctx->data+ctx->hcache->tensor_info_off[idx]);
+    return str->len == namelen && memcmp(str->string,name,namelen) == 0;
 }
 
-/* Q8_0 blocks dequantization to floats.
- * 'dst' is supposed to have enough space for 'count' weights. */
-void gguf_q8_0_to_float(void *weights_data, void *dst, uint64_t count, store_float_callback store_callback) {
-    float *f = dst;
-    struct gguf_tensor_type_features *tf =
-        gguf_get_tensor_type_features(GGUF_TYPE_Q8_0);
+/* Build the hash table of the tensors index, from the header cache that
+ * must already be loaded. Return 1 on success, 0 on out of memory. */
+static int gguf_build_hash_table(gguf_ctx *ctx) {
+    uint64_t count = ctx->header->tensor_count;
+    uint64_t size = 16;
+    while (size < count*2) size *= 2; // Load factor <= 50%.
 
-    /* Very simple layout: |16 bit scale|32 x 8bit weights|
-     * Each weight is scale * quantized_weight[0..31] */
-    int8_t *block = weights_data;
-    uint64_t i = 0; // i-th weight to dequantize.
-    while(i < count) {
-        /* For each block get the scale and convert all the
-         * weights in the block. */
-        float scale = from_half(*((uint16_t*)block));
-        for (uint32_t j = 0; j < tf->items_per_block; j++) {
-            float weight = block[j+2] * scale; // j+2 to skip the scale bytes.
-            if (store_callback)
-                store_callback(dst,i,weight);
-            else
-                f[i] = weight;
-            if (++i == count) break;
-        }
-        block += tf->bytes_per_block; // Go to the next block.
-    }
-}
-
-/* Q4_K blocks dequantization to floats.
- * 'y' is supposed to have enough space for 'count' weights. */
-void gguf_q4_k_to_float(void *weights_data, void *dst, uint64_t count, store_float_callback store_callback) {
-    float *f = dst;
-    uint8_t *block = weights_data;
-    uint64_t i = 0; // i-th weight to dequantize.
-    while(i < count) {
-        /* Q4_K super-blocks have 256 total weights, split in 8 sub-block.
-         * Each 8 sub-blocks have a different set of scales/mins, so
-         * there are 16 total values for scales/mins, but the scales/mins
-         * are also quantized (6 bits each) using two different scales:
-         * scale_of_scales and scale_of_mins, that are two FP16 values
-         * at the start of the super block, so:
-         *
-         * |FP16 s_of_scales | +
-         * |FP16 s_of_mins   | +
-         * |16 6 bit integers d,m pairs, one per sub-block of 32 ele | +
-         * |256 x 4bit weights|
-         *
-         * Each quantized weight 'q' is restored as:
-         *
-         *      w = q * scale - min;
-         */
-        float scales_scale = from_half(*((uint16_t*)block));
-        float mins_scale  = from_half(*((uint16_t*)(block+2)));
-        block += 4;
-
-        /* Extract the 16 x 6 bit values scales-mins pairs. The
-         * encoding of those values is odd because of performance
-         * reasons:
-         *
-         *  dddddddd dddddddd dddddddd dddddddd mmmmmmmm mmmmmmmm
-         *  44000000|55111111|66222222|77333333|44000000|55111111
-         *
-         *  mmmmmmmm mmmmmmmm mmmmdddd mmmmdddd mmmmdddd mmmmdddd
-         *  66222222|77333333|44444444|55555555|66666666|77777777
-         *
-         * In the above diagram you can see the 12 bytes and the
-         * scales/mins 6 bits encodings. */
-
-        /* Scale scales/mins. */
-        float scales[8], mins[8];
-        for (int j = 0; j < 8; j++) {
-            uint8_t d,m;
-            if (j < 4) {
-                d = block[j] & 63;
-                m = block[j+4] & 63;
-            } else {
-                d = (block[j+4] & 0xF) | ((block[j-4] >> 6) << 4);
-                m = (block[j+4] >> 4) | ((block[j-0] >> 6) << 4);
-            }
-            scales[j] = d * scales_scale;
-            mins[j] = m * mins_scale;
-        }
-        block += 12; // Seek 4-bit weights start.
-
-        /* Finally we can extract the 256 weights.
-         * We process two blocks per time, because each
-         * 32 bytes have 64 weights stored like this:
-         * First 32 weights of the first block are the higher 4
-         * bits of each byte. Second 32 weights of the second
-         * block are lower 4 bits of each byte. */
-        for (uint32_t b = 0; b < 8; b += 2) {
-            float scale = scales[b];
-            float min = mins[b];
-            /* First set: higher bits. */
-            for (uint32_t j = 0; j < 32; j++) {
-                uint8_t w = block[j] & 0xf;
-                float weight = w * scale - min;
-                if (store_callback)
-                    store_callback(dst,i,weight);
-                else
-                    f[i] = weight;
-                if (++i == count) return;
-            }
-            /* Second set: lower bits. */
-            for (uint32_t j = 0; j < 32; j++) {
-                uint8_t w = block[j] >> 4;
-                float weight = w * scale - min;
-                if (store_callback)
-                    store_callback(dst,i,weight);
-                else
-                    f[i] = weight;
-                if (++i == count) return;
-            }
-            block += 32; // Skip the two processed blocks.
-        }
-    }
-}
-
-/* Q6_K blocks dequantization to floats.
- * 'y' is supposed to have enough space for 'count' weights. */
-void gguf_q6_k_to_float(void *weights_data, void *dst, uint64_t count, store_float_callback store_callback) {
-    float *f = dst;
-    uint8_t *block = weights_data;
-    uint64_t i = 0; // i-th weight to dequantize.
-    while(i < count) {
-        /* Q6_K super-blocks have 256 total weights, split in 16 sub-block
-         * of 16 elements. There are no mins, just scales. Each sub-block
-         * have a block-specific scale quantized at 8 bits via a single
-         * 16-bit main scale-of-scales.
-         *
-         * |128 bytes of lower 4 bits of quants| +
-         * |64 bytes of lower 2 bits of quants| +
-         * |16 bytes of 8-bit block scales | +
-         * |A single FP16 value: the scale of the scales above |
-         *
-         * Let's call "L" the lower 4 bits array (128 bytes)
-         * and "H" the higher 2 bits array (64 bytes)
-         *
-         * Values are logically encoded in two 128 weights clusters
-         * where the first cluster is the first 64 bytes of "L" and
-         * the first 32 bytes of "H".
-         *
-         * Higher bits of the i-th weight from 0 to 63 are stored in the
-         * lower 4 bits of L[i], while higher bits of the i-th weight
-         * from 64 to 127 are stored in the higher bits of L[i-64]:
-         *
-         * L = |64640000|65650101|66660202|...
-         *
-         * So this actually is: w_low = (L[i%64] >> i/64*4) & 15
-         *
-         * H = |96643200|97653301|98663402|...
-         *
-         * Higher bits of the i-th weight are arranged like that:
-         *
-         * From 0 to 31,  bits 0,1 of H[i]
-         * From 32 to 63, bits 3,2 of H[i-32]
-         * From 64 to 95, bits 5,4 of H[i-64]
-         * From 96 to 127, bits 7,6 of H[i-96]
-         *
-         * So this actually is: w_high = ((H[i%32] >> i/32*2) & 3) << 2
-         * The same is true with the next 128 weights cluster, but
-         * everything is relative to the second half of H and L.
-         *
-         * Finally, there is to extract the scale from the
-         * 16 blocks scales array. Scales are just sequential,
-         * so the i-th weight uses the scale[i/16].
-         *
-         * Important: In Q6_K the 6-bit quants are wisely stored
-         * as unsigned integers + 32, so that there is no need to
-         * do sign bit extension in order to convert the 6-bit value
-         * into 8 bit value. Instead the values from -32 to 31 are
-         * remapped in the 0-63 range (just adding 32).
-         */
-        float super_scale = from_half(*((uint16_t*)(block+128+64+16)));
-        uint8_t *L = block;
-        uint8_t *H = block+128;
-        int8_t *scales = (int8_t*)block+128+64;
-        for (int cluster = 0; cluster < 2; cluster++) {
-            for (uint64_t j = 0; j < 128; j++) {
-                float weight =
-                      (super_scale * scales[j/16]) *
-                       ((int8_t)
-                        ((((L[j%64] >> (j/64*4)) & 0xF) |
-                         (((H[j%32] >> (j/32*2)) & 3) << 4)))-32);
-                if (store_callback)
-                    store_callback(dst,i,weight);
-                else
-                    f[i] = weight;
-                if (++i == count) return;
-            }
-            L += 64;
-            H += 32;
-            scales += 8;
-        }
-        block += 128+64+16+2; // Go to the next block.
-    }
-}
-
-/* Q2_K blocks dequantization to floats.
- * 'y' is supposed to have enough space for 'count' weights. */
-void gguf_q2_k_to_float(void *weights_data, void *dst, uint64_t count, store_float_callback store_callback) {
-    float *f = dst;
-    uint8_t *block = weights_data;
-    uint64_t i = 0; // i-th weight to dequantize.
-    while(i < count) {
-        /* Q2_K superblocks of 256 weights:
-         * | 16 bytes of 16 scales, 16 mins quantized at 4 bits       | +
-         * | 64 bytes of 2-bit 256 quants (16 elements x 16 blocks)  | +
-         * | 2 bytes F16 scale of scales                              | +
-         * | 2 bytes F16 scale of mins                                |
-         *
-         * Weights are organized as follows:
-         *
-         *                               |76543210| (bit number)
-         * 16 bytes scales/mins are just |min scal| x 16, from block
-         * 0 to 15, sequentially.
-         *
-         * 64 bytes of 2 bits quants are stored like that:
-         * Weights from 0 to 31: bits 1,0 of bytes 0-31 (block 0, 1)
-         * Weights from 32 to 63: bits 3,2 of bytes 0-31 (block 2, 3)
-         * Weights from 64 to 95: bits 5,4 of bytes 0-31 (block 4, 5)
-         * Weights from 96 to 127: bits 7,6 of bytes 0-31 (block 6, 7)
-         *
-         * The same happens for the next 8 blocks, stored in the remaining
-         * 32 bytes.
-         *
-         * The final weight is computed as: w = q2 * block_scale - block_min.
-         *
-         * Since in this code we want to be simple more than fast (at least
-         * for now), the i-th weight can be found (considering we have
-         * two clusters of 128 weights each):
-         *
-         * cluster = i/128 # Cluster 0 or 1
-         * byte = i % 32
-         * shift = i / 32 * 2
-         * w[i] = (quants[byte + (cluster*32)] >> shift) & 3
-         */
-        float scale_of_scales = from_half(*((uint16_t*)(block+16+64)));
-        float scale_of_mins = from_half(*((uint16_t*)(block+16+64+2)));
-
-        float scale = 0, min = 0;
-        int bn = 0; // Block number
-        for (uint64_t cluster = 0; cluster < 2; cluster++) {
-            for (uint64_t j = 0; j < 128; j++) {
-                /* Use new scale/min for each 16 weights sub-block. */
-                if (j % 16 == 0) {
-                    scale = scale_of_scales * (block[bn] & 0xf);
-                    min = scale_of_mins * (block[bn] >> 4);
-                    bn++;
-                }
-                uint8_t q = (block[16+j%32+cluster*32] >> (j/32*2)) & 3;
-                float weight = q * scale - min;
-                if (store_callback)
-                    store_callback(dst,i,weight);
-                else
-                    f[i] = weight;
-                if (++i == count) return;
+    ctx->index = calloc(size,sizeof(uint32_t));
+    if (ctx->index == NULL) return 0;
+    ctx->index_size = size;
+
+    for (uint64_t j = 0; j < count; j++) {
+        struct gguf_string *str = (struct gguf_string*)
+            (ctx->data+ctx->hcache->tensor_info_off[j]);
+
+        /* On duplicated names the first tensor wins, like it happens
+         * with a linear scan. */
+        uint64_t mask = size-1;
+        uint64_t idx = gguf_hash_name(str->string,str->len) & mask;
+        while (1) {
+            uint32_t slot = ctx->index[idx];
+            if (slot == 0) {
+                ctx->index[idx] = j+1;
+                break;
             }
+            if (gguf_cached_name_eq(ctx,slot-1,str->string,str->len)) break;
+            idx = (idx+1) & mask;
         }
-        block += 16+64+4;
     }
+    return 1;
 }
 
-/* Q4_0 blocks dequantization to floats.
- * 'dst' is supposed to have enough space for 'count' weights. */
-void gguf_q4_0_to_float(void *weights_data, void *dst, uint64_t count, store_float_callback store_callback) {
-    float *f = dst;
-    struct gguf_tensor_type_features *tf =
-        gguf_get_tensor_type_features(GGUF_TYPE_Q4_0);
+/* Build the tensors index: ctx->tensors is populated with all the
+ * tensors, in file order, and an open addressing hash table (linear
+ * probing) maps names to tensor numbers. After the index is built,
+ * gguf_find_tensor() can lookup tensors by name in O(1). Both are
+ * obtained from the header cache, see gguf_load_header(). When the
+ * header was loaded from a sidecar file (see gguf_load_sidecar()) the
+ * hash table is already available, and gguf_find_tensor() works
+ * without touching the tensors info at all.
+ *
+ * The function can be called at any time: the parsing state of the
+ * context (used by gguf_get_key() / gguf_get_tensor()) is not modified.
+ * If the index already exists, nothing is done.
+ *
+ * Return 1 on success, 0 on error: out of memory or malformed tensors
+ * info section, in which case errno is set to EINVAL. */
+int gguf_build_index(gguf_ctx *ctx) {
+    if (ctx->tensors) return 1;
+    if (gguf_load_header(ctx) == 0) return 0;
+    if (ctx->index == NULL && gguf_build_hash_table(ctx) == 0) return 0;
 
-    /* Very simple layout: |16 bit scale|32 x 4bit weights|
-     * Each weight is scale * (quantized_weight[0..31] - 8) */
-    uint8_t *block = weights_data;
-    uint64_t i = 0; // i-th weight to dequantize.
-    while(i < count) {
-        /* For each block get the scale and convert all the
-         * weights in the block. */
-        float scale = from_half(*((uint16_t*)block));
-        /* First 16 weights are in the lower bits */
-        for (uint32_t j = 0; j < 16; j++) {
-            uint8_t value = block[j+2]; // j+2 to skip the scale bytes.
-            value &= 0xf;  // lower bits
-            float weight = ((int8_t) value - 8) * scale;
-            if (store_callback)
-                store_callback(dst,i,weight);
-            else
-                f[i] = weight;
-            if (++i == count) break;
-        }
-        /* Last 16 weights are in the higher bits */
-        for (uint32_t j = 0; j < 16; j++) {
-            uint8_t value = block[j+2]; // j+2 to skip the scale bytes.
-            value >>= 4;  // higher bits
-            float weight = ((int8_t) value - 8) * scale;
-            if (store_callback)
-                store_callback(dst,i,weight);
-            else
-                f[i] = weight;
-            if (++i == count) break;
-        }
-        block += tf->bytes_per_block; // Go to the next block.
-    }
+    uint64_t count = ctx->header->tensor_count;
+    ctx->tensors = malloc(sizeof(gguf_tensor)*(count ? count : 1));
+    if (ctx->tensors == NULL) return 0;
+    for (uint64_t j = 0; j < count; j++)
+        gguf_get_cached_tensor(ctx,j,ctx->tensors+j);
+    return 1;
 }
 
-/* Q4_1 blocks dequantization to floats.
- * 'dst' is supposed to have enough space for 'count' weights. */
-void gguf_q4_1_to_float(void *weights_data, void *dst, uint64_t count, store_float_callback store_callback) {
-    float *f = dst;
-    struct gguf_tensor_type_features *tf =
-        gguf_get_tensor_type_features(GGUF_TYPE_Q4_1);
+/* Return the number of the tensor with the specified name, or -1 if
+ * there is no such tensor (or on out of memory building the index). */
+static int64_t gguf_lookup_tensor(gguf_ctx *ctx, const char *name, size_t namelen) {
+    if (gguf_load_header(ctx) == 0) return -1;
+    if (ctx->index == NULL && gguf_build_hash_table(ctx) == 0) return -1;
 
-    /* Very simple layout: |16 bit scale|16 bit bias|32 x 4bit weights|
-     * Each weight is scale * quantized_weight[0..31] + bias */
-    uint8_t *block = weights_data;
-    uint64_t i = 0; // i-th weight to dequantize.
-    while(i < count) {
-        /* For each block get the scale and convert all the
-         * weights in the block. */
-        float scale = from_half(*((uint16_t*)block));
-        float bias = from_half(*((uint16_t*)block+1));
-        /* First 16 weights are in the lower bits */
-        for (uint32_t j = 0; j < 16; j++) {
-            uint8_t value = block[j+4]; // j+2 to skip the scale and bias bytes.
-            value &= 0xf;  // lower bits
-            float weight = value * scale + bias;
-            if (store_callback)
-                store_callback(dst,i,weight);
-            else
-                f[i] = weight;
-            if (++i == count) break;
+    uint64_t mask = ctx->index_size-1;
+    uint64_t idx = gguf_hash_name(name,namelen) & mask;
+    while (ctx->index[idx] != 0) {
+        uint64_t j = ctx->index[idx]-1;
+        if (gguf_cached_name_eq(ctx,j,name,namelen)) return j;
+        idx = (idx+1) & mask;
+    }
+    return -1;
+}
+
+/* Lookup the tensor with the specified name, filling 'tensor' with its
+ * info. The hash table of the tensors index is built on the first call,
+ * if needed.
+ *
+ * Return 1 if the tensor was found, otherwise 0 is returned and, like
+ * gguf_get_tensor() does, the tensor name is set to NULL. */
+int gguf_find_tensor(gguf_ctx *ctx, const char *name, size_t namelen, gguf_tensor *tensor) {
+    tensor->name = NULL;
+    int64_t j = gguf_lookup_tensor(ctx,name,namelen);
+    if (j == -1) return 0;
+    gguf_get_cached_tensor(ctx,j,tensor);
+    return 1;
+}
+
+/* ============================== Tensors hashing =========================== */
+
+/* XXH64, the 64 bit xxHash of Yann Collet (BSD licensed), used to hash
+ * the tensors content. The main loop is made of four independent
+ * lanes, so it runs at memory bandwidth speed. */
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t gguf_xxh_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64-r));
+}
+
+static inline uint64_t gguf_xxh_read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v,p,sizeof(v));
+    return v;
+}
+
+static inline uint64_t gguf_xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    acc = gguf_xxh_rotl(acc,31);
+    return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t gguf_xxh_merge(uint64_t acc, uint64_t val) {
+    acc ^= gguf_xxh_round(0,val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static uint64_t gguf_xxh64(const void *data, uint64_t len, uint64_t seed) {
+    const uint8_t *p = data, *end = p+len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+        uint64_t v2 = seed + XXH_PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_PRIME64_1;
+        for (; p+32 <= end; p += 32) {
+            v1 = gguf_xxh_round(v1,gguf_xxh_read64(p));
+            v2 = gguf_xxh_round(v2,gguf_xxh_read64(p+8));
+            v3 = gguf_xxh_round(v3,gguf_xxh_read64(p+16));
+            v4 = gguf_xxh_round(v4,gguf_xxh_read64(p+24));
+        }
+        h = gguf_xxh_rotl(v1,1) + gguf_xxh_rotl(v2,7) +
+            gguf_xxh_rotl(v3,12) + gguf_xxh_rotl(v4,18);
+        h = gguf_xxh_merge(h,v1);
+        h = gguf_xxh_merge(h,v2);
+        h = gguf_xxh_merge(h,v3);
+        h = gguf_xxh_merge(h,v4);
+    } else {
+        h = seed + XXH_PRIME64_5;
+    }
+    h += len;
+
+    for (; p+8 <= end; p += 8) {
+        h ^= gguf_xxh_round(0,gguf_xxh_read64(p));
+        h = gguf_xxh_rotl(h,27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (p+4 <= end) {
+        uint32_t v;
+        memcpy(&v,p,sizeof(v));
+        h ^= (uint64_t)v * XXH_PRIME64_1;
+        h = gguf_xxh_rotl(h,23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= (*p) * XXH_PRIME64_5;
+        h = gguf_xxh_rotl(h,11) * XXH_PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+/* The tensor hash is a two levels tree: the data is split in chunks of
+ * GGUF_HASH_CHUNK bytes hashed independently (and in parallel), then
+ * the array of the chunk hashes is hashed again. So the result does not
+ * depend on the number of threads used. */
+#define GGUF_HASH_CHUNK (1<<20)
+
+struct gguf_hash_job {
+    const uint8_t *data;
+    uint64_t len;
+    uint64_t *hashes;
+};
+
+static void gguf_hash_job(void *privdata, uint64_t jobid) {
+    struct gguf_hash_job *hj = privdata;
+    uint64_t off = jobid*GGUF_HASH_CHUNK;
+    uint64_t len = hj->len-off;
+    if (len > GGUF_HASH_CHUNK) len = GGUF_HASH_CHUNK;
+    hj->hashes[jobid] = gguf_xxh64(hj->data+off,len,jobid);
+}
+
+/* Hash 'len' bytes at 'data' with 'nthreads' threads. Return 0 on out
+ * of memory, setting errno. */
+static int gguf_hash_data(const uint8_t *data, uint64_t len, int nthreads, uint64_t *hash) {
+    uint64_t numchunks = (len+GGUF_HASH_CHUNK-1)/GGUF_HASH_CHUNK;
+    uint64_t *hashes = malloc(sizeof(uint64_t)*(numchunks ? numchunks : 1));
+    if (hashes == NULL) return 0;
+    struct gguf_hash_job hj = {data, len, hashes};
+    gguf_parallel(nthreads,numchunks,gguf_hash_job,&hj);
+    *hash = gguf_xxh64(hashes,sizeof(uint64_t)*numchunks,len);
+    free(hashes);
+    return 1;
+}
+
+/* If 'ctx' has the hash of the specified tensor in the header cache
+ * (see gguf_hash_tensors()), store it in '*hash' and return 1.
+ * Otherwise 0 is returned. */
+int gguf_cached_tensor_hash(gguf_ctx *ctx, gguf_tensor *tensor, uint64_t *hash) {
+    if (ctx->hcache == NULL || ctx->hcache->tensor_hash == NULL) return 0;
+    int64_t j = gguf_lookup_tensor(ctx,tensor->name,tensor->namelen);
+
+    /* Make sure it's the whole tensor, not a view of part of it. */
+    if (j == -1 || ctx->hcache->tensor_offset[j] != tensor->offset ||
+        ctx->hcache->tensor_bsize[j] != tensor->bsize) return 0;
+    *hash = ctx->hcache->tensor_hash[j];
+    return 1;
+}
+
+/* Return the 64 bit content hash of the tensor data (the 'bsize' bytes
+ * at 'weights_data'), so that tensors with the same type, shape and
+ * hash can be considered identical. The hash cached in 'ctx' is used
+ * if available, otherwise it is computed with 'nthreads' threads.
+ * 'ctx' can be NULL. On out of memory 0 is returned and errno is set. */
+uint64_t gguf_tensor_hash(gguf_ctx *ctx, gguf_tensor *tensor, int nthreads) {
+    uint64_t hash;
+    if (ctx && gguf_cached_tensor_hash(ctx,tensor,&hash)) return hash;
+    if (gguf_hash_data(tensor->weights_data,tensor->bsize,nthreads,&hash) == 0)
+        return 0;
+    return hash;
+}
+
+/* Compute the hash of all the tensors of 'ctx', storing them in the
+ * header cache, so that they are also saved by gguf_write_sidecar().
+ * This reads all the tensors data, using 'nthreads' threads.
+ * Nothing is done if the hashes are already available.
+ * Return 1 on success, 0 on error (out of memory or invalid header). */
+int gguf_hash_tensors(gguf_ctx *ctx, int nthreads) {
+    if (gguf_load_header(ctx) == 0) return 0;
+    gguf_header_cache *hc = ctx->hcache;
+    if (hc->tensor_hash) return 1;
+
+    uint64_t count = ctx->header->tensor_count;
+    uint64_t *hashes = malloc(sizeof(uint64_t)*(count ? count : 1));
+    if (hashes == NULL) return 0;
+    for (uint64_t j = 0; j < count; j++) {
+        if (gguf_hash_data(ctx->data+hc->tensor_offset[j],hc->tensor_bsize[j],
+                           nthreads,hashes+j) == 0)
+        {
+            free(hashes);
+            return 0;
+        }
+    }
+    hc->tensor_hash = hashes;
+    return 1;
+}
+
+/* ============================== Sidecar index ============================= */
+
+/* A sidecar index file (by default the model file name plus
+ * GGUF_SIDECAR_EXT) stores the header cache and the hash table of the
+ * tensors index of an immutable GGUF file, so that opening it does not
+ * need to parse the header at all. The layout is the following
+ * header, followed by the arrays, all in native byte order:
+ *
+ * kv_off[kv_count] tensor_info_off[tensor_count] tensor_offset[...]
+ * tensor_weights[...] tensor_bsize[...] tensor_type[...] index[index_size]
+ * tensor_hash[...] (only with the GGUF_SIDECAR_HASHES flag)
+ *
+ * The sidecar is only used if the GGUF file size, modification time
+ * and header hash (see gguf_sidecar_hash()) still match. */
+#define GGUF_SIDECAR_MAGIC "GGUFIDX"
+#define GGUF_SIDECAR_VERSION 2
+#define GGUF_SIDECAR_HASHES (1<<0)  // tensor_hash[tensor_count] follows.
+
+struct gguf_sidecar_header {
+    char magic[8];              // GGUF_SIDECAR_MAGIC, null terminated.
+    uint32_t version;           // GGUF_SIDECAR_VERSION.
+    uint32_t flags;             // GGUF_SIDECAR_* flags.
+    uint64_t file_size;         // GGUF file size.
+    uint64_t file_mtime;        // GGUF file modification time, nanoseconds.
+    uint64_t header_hash;       // See gguf_sidecar_hash().
+    uint64_t kv_count;
+    uint64_t tensor_count;
+    uint64_t alignment;
+    uint64_t tensors_info_off;
+    uint64_t data_off;
+    uint64_t index_size;
+};
+
+/* Size of the sidecar file for the specified counts. */
+static uint64_t gguf_sidecar_size(uint64_t kv_count, uint64_t tensor_count, uint64_t index_size, uint32_t flags) {
+    uint64_t hashes = (flags & GGUF_SIDECAR_HASHES) ? tensor_count*8 : 0;
+    return sizeof(struct gguf_sidecar_header) + kv_count*8 +
+           tensor_count*(8*4+4) + index_size*4 + hashes;
+}
+
+/* Modification time of the file, in nanoseconds. */
+static uint64_t gguf_file_mtime(struct stat *sb) {
+#ifdef __APPLE__
+    return (uint64_t)sb->st_mtimespec.tv_sec*1000000000 + sb->st_mtimespec.tv_nsec;
+#else
+    return (uint64_t)sb->st_mtim.tv_sec*1000000000 + sb->st_mtim.tv_nsec;
+#endif
+}
+
+/* Hash of the GGUF header used to validate sidecar files: the first and
+ * the last 4096 bytes before the data section. This covers the counts
+ * and the first keys, and the last tensors info, without reading the
+ * whole header, that is what the sidecar is designed to avoid. The file
+ * size and modification time are checked as well. */
+static uint64_t gguf_sidecar_hash(gguf_ctx *ctx, uint64_t data_off) {
+    uint64_t len = data_off < 4096 ? data_off : 4096;
+    uint64_t h = gguf_fnv1a(GGUF_FNV1A_INIT,ctx->data,len);
+    return gguf_fnv1a(h,ctx->data+data_off-len,len);
+}
+
+/* Write the sidecar index of the file opened by 'ctx' into 'filename'.
+ * The file is written in a temporary file and then renamed, so that
+ * concurrent gguf_load_sidecar() calls never see partial files.
+ * Return 1 on success, 0 on error. */
+int gguf_write_sidecar(gguf_ctx *ctx, const char *filename) {
+    if (gguf_load_header(ctx) == 0) return 0;
+    if (ctx->index == NULL && gguf_build_hash_table(ctx) == 0) return 0;
+
+    struct stat sb;
+    if (fstat(ctx->fd,&sb) == -1) return 0;
+    if ((uint64_t)sb.st_size != ctx->size) {
+        errno = EINVAL;     // Buffered writer not yet flushed.
+        return 0;
+    }
+
+    gguf_header_cache *hc = ctx->hcache;
+    uint64_t n = ctx->header->tensor_count;
+    struct gguf_sidecar_header sh = {0};
+    memcpy(sh.magic,GGUF_SIDECAR_MAGIC,sizeof(GGUF_SIDECAR_MAGIC));
+    sh.version = GGUF_SIDECAR_VERSION;
+    sh.flags = hc->tensor_hash ? GGUF_SIDECAR_HASHES : 0;
+    sh.file_size = ctx->size;
+    sh.file_mtime = gguf_file_mtime(&sb);
+    sh.header_hash = gguf_sidecar_hash(ctx,ctx->data_off);
+    sh.kv_count = ctx->header->metadata_kv_count;
+    sh.tensor_count = n;
+    sh.alignment = ctx->alignment;
+    sh.tensors_info_off = hc->tensors_info_off;
+    sh.data_off = ctx->data_off;
+    sh.index_size = ctx->index_size;
+
+    size_t tmplen = strlen(filename)+5;
+    char *tmpname = malloc(tmplen);
+    if (tmpname == NULL) return 0;
+    snprintf(tmpname,tmplen,"%s.tmp",filename);
+    FILE *fp = fopen(tmpname,"w");
+    if (fp == NULL) {
+        free(tmpname);
+        return 0;
+    }
+    int ok =
+        fwrite(&sh,sizeof(sh),1,fp) == 1 &&
+        fwrite(hc->kv_off,8,sh.kv_count,fp) == sh.kv_count &&
+        fwrite(hc->tensor_info_off,8,n,fp) == n &&
+        fwrite(hc->tensor_offset,8,n,fp) == n &&
+        fwrite(hc->tensor_weights,8,n,fp) == n &&
+        fwrite(hc->tensor_bsize,8,n,fp) == n &&
+        fwrite(hc->tensor_type,4,n,fp) == n &&
+        fwrite(ctx->index,4,sh.index_size,fp) == sh.index_size &&
+        (hc->tensor_hash == NULL || fwrite(hc->tensor_hash,8,n,fp) == n);
+    if (fclose(fp) != 0) ok = 0;
+    if (ok && rename(tmpname,filename) == -1) ok = 0;
+    if (!ok) unlink(tmpname);
+    free(tmpname);
+    return ok;
+}
+
+/* Load the header cache and the hash table of the tensors index from
+ * the sidecar file 'filename', written by gguf_write_sidecar(). The
+ * arrays of the header cache point directly to the mapped sidecar.
+ * Nothing is done if the header cache is already loaded.
+ *
+ * Return 1 on success. On error 0 is returned and the context is left
+ * untouched: errno is set to ESTALE if the sidecar does not match
+ * the GGUF file anymore, or to EINVAL if it is not valid. */
+int gguf_load_sidecar(gguf_ctx *ctx, const char *filename) {
+    if (ctx->hcache) return 1;
+    uint64_t start = gguf_stats_now();
+
+    struct stat sb, fsb;
+    if (fstat(ctx->fd,&fsb) == -1) return 0;
+    int fd = open(filename,O_RDONLY);
+    if (fd == -1) return 0;
+    if (fstat(fd,&sb) == -1) {
+        close(fd);
+        return 0;
+    }
+    if ((uint64_t)sb.st_size < sizeof(struct gguf_sidecar_header)) {
+        close(fd);
+        errno = EINVAL;
+        return 0;
+    }
+    uint8_t *map = mmap(0,sb.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+    close(fd);
+    if (map == MAP_FAILED) return 0;
+
+    /* Validate the sidecar: format, then the GGUF file it refers to. */
+    struct gguf_sidecar_header *sh = (struct gguf_sidecar_header*)map;
+    uint64_t n = sh->tensor_count;
+    int err = 0;
+    if (memcmp(sh->magic,GGUF_SIDECAR_MAGIC,sizeof(GGUF_SIDECAR_MAGIC)) ||
+        sh->version != GGUF_SIDECAR_VERSION ||
+        sh->kv_count != ctx->header->metadata_kv_count ||
+        n != ctx->header->tensor_count ||
+        sh->index_size < 16 || sh->index_size/2 < n ||
+        (sh->index_size & (sh->index_size-1)) ||
+        (sh->flags & ~GGUF_SIDECAR_HASHES) ||
+        (uint64_t)sb.st_size != gguf_sidecar_size(sh->kv_count,n,sh->index_size,sh->flags))
+    {
+        err = EINVAL;
+    } else if (sh->file_size != ctx->size ||
+               sh->file_mtime != gguf_file_mtime(&fsb) ||
+               sh->data_off > ctx->size ||
+               sh->header_hash != gguf_sidecar_hash(ctx,sh->data_off))
+    {
+        err = ESTALE;
+    }
+
+    gguf_header_cache *hc = NULL;
+    uint32_t *index = NULL;
+    uint64_t *hashes = NULL;
+    if (!err) {
+        hc = calloc(1,sizeof(*hc));
+        index = malloc(sizeof(uint32_t)*sh->index_size);
+        if (sh->flags & GGUF_SIDECAR_HASHES)
+            hashes = malloc(sizeof(uint64_t)*(n ? n : 1));
+        if (hc == NULL || index == NULL ||
+            ((sh->flags & GGUF_SIDECAR_HASHES) && hashes == NULL)) err = ENOMEM;
+    }
+    if (!err) {
+        uint8_t *p = map+sizeof(*sh);
+        hc->kv_off = (uint64_t*)p; p += sh->kv_count*8;
+        hc->tensor_info_off = (uint64_t*)p; p += n*8;
+        hc->tensor_offset = (uint64_t*)p; p += n*8;
+        hc->tensor_weights = (uint64_t*)p; p += n*8;
+        hc->tensor_bsize = (uint64_t*)p; p += n*8;
+        hc->tensor_type = (uint32_t*)p; p += n*4;
+        memcpy(index,p,sizeof(uint32_t)*sh->index_size);
+        p += sh->index_size*4;
+        if (hashes) {
+            memcpy(hashes,p,sizeof(uint64_t)*n);
+            hc->tensor_hash = hashes;
+        }
+        hc->tensors_info_off = sh->tensors_info_off;
+        hc->map = map;
+        hc->map_size = sb.st_size;
+
+        /* Don't trust offsets pointing outside the GGUF file. */
+        for (uint64_t j = 0; j < n && !err; j++) {
+            if (hc->tensor_info_off[j] >= sh->data_off ||
+                hc->tensor_offset[j] > ctx->size ||
+                hc->tensor_bsize[j] > ctx->size-hc->tensor_offset[j] ||
+                hc->tensor_type[j] >= GGUF_TYPE_COUNT) err = EINVAL;
+        }
+        /* Lookups stop at the first empty slot: a table without one
+         * would make them loop forever. The size was already checked
+         * against the load factor gguf_build_hash_table() uses. */
+        uint64_t empty = 0;
+        for (uint64_t j = 0; j < sh->index_size && !err; j++) {
+            if (index[j] > n) err = EINVAL;
+            if (index[j] == 0) empty++;
+        }
+        if (empty == 0) err = EINVAL;
+    }
+    if (err) {
+        free(hc);
+        free(index);
+        free(hashes);
+        munmap(map,sb.st_size);
+        errno = err;
+        return 0;
+    }
+
+    gguf_free_index(ctx);
+    ctx->hcache = hc;
+    ctx->index = index;
+    ctx->index_size = sh->index_size;
+    ctx->alignment = sh->alignment;
+    ctx->data_off = sh->data_off;
+    if (StatsEnabled) {
+        GGUF_STATS_ADD(ctx,header_loads,1);
+        GGUF_STATS_ADD(ctx,header_ns,gguf_stats_now()-start);
+    }
+    return 1;
+}
+
+/* ============================== Sharded models ============================ */
+
+/* Read the integer key 'name' of 'ctx' into *val, using the header
+ * cache, so that the parsing state is not modified. Return 1 on success,
+ * 0 if there is no such key or if it is not a non negative integer. */
+static int gguf_get_int_key(gguf_ctx *ctx, const char *name, uint64_t *val) {
+    if (gguf_load_header(ctx) == 0) return 0;
+    size_t namelen = strlen(name);
+    for (uint64_t j = 0; j < ctx->header->metadata_kv_count; j++) {
+        uint64_t off = ctx->hcache->kv_off[j];
+        struct gguf_string *str = (struct gguf_string*)(ctx->data+off);
+        if (str->len != namelen || memcmp(str->string,name,namelen)) continue;
+        off += 8+str->len;
+        uint32_t type = *(uint32_t*)(ctx->data+off);
+        union gguf_value *v = (union gguf_value*)(ctx->data+off+4);
+        int64_t sval = -1;
+        switch(type) {
+        case GGUF_VALUE_TYPE_UINT8: *val = v->uint8; return 1;
+        case GGUF_VALUE_TYPE_UINT16: *val = v->uint16; return 1;
+        case GGUF_VALUE_TYPE_UINT32: *val = v->uint32; return 1;
+        case GGUF_VALUE_TYPE_UINT64: *val = v->uint64; return 1;
+        case GGUF_VALUE_TYPE_INT8: sval = v->int8; break;
+        case GGUF_VALUE_TYPE_INT16: sval = v->int16; break;
+        case GGUF_VALUE_TYPE_INT32: sval = v->int32; break;
+        case GGUF_VALUE_TYPE_INT64: sval = v->int64; break;
+        }
+        if (sval < 0) return 0;
+        *val = sval;
+        return 1;
+    }
+    return 0;
+}
+
+/* If 'filename' is named like a shard (see GGUF_SHARD_FORMAT), set
+ * *prefixlen to the length of the name before the shard numbers, and
+ * *count to the number of shards, returning 1. Otherwise 0 is returned. */
+static int gguf_parse_shard_name(const char *filename, size_t *prefixlen, uint32_t *count) {
+    const char *suffix = "-00000-of-00000.gguf"; // Digits are placeholders.
+    size_t len = strlen(filename), slen = strlen(suffix);
+    if (len <= slen) return 0;
+    const char *s = filename+len-slen;
+    for (size_t j = 0; j < slen; j++) {
+        if (suffix[j] == '0' ? !isdigit((unsigned char)s[j]) : s[j] != suffix[j])
+            return 0;
+    }
+    *prefixlen = len-slen;
+    *count = strtoul(s+10,NULL,10);
+    return *count != 0;
+}
+
+/* Return the context of the shard number 'shard', opening it if needed.
+ * Return NULL on error: the file can't be opened, or it is not the
+ * expected shard (errno is set to EINVAL). */
+gguf_ctx *gguf_shards_get_ctx(gguf_shards *s, uint32_t shard) {
+    if (shard >= s->count) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (s->ctx[shard]) return s->ctx[shard];
+    gguf_ctx *ctx = gguf_open_flags(s->filenames[shard],s->flags);
+    if (ctx == NULL) return NULL;
+
+    uint64_t no, count;
+    if (s->count > 1 &&
+        (!gguf_get_int_key(ctx,"split.no",&no) || no != shard ||
+         !gguf_get_int_key(ctx,"split.count",&count) || count != s->count))
+    {
+        gguf_close(ctx);
+        errno = EINVAL;
+        return NULL;
+    }
+    s->ctx[shard] = ctx;
+    return ctx;
+}
+
+/* Open a model that may be split in many GGUF files (shards), named
+ * like GGUF_SHARD_FORMAT: <prefix>-00001-of-00005.gguf and so forth.
+ * Any of the shards can be specified. Every shard has the split.no,
+ * split.count and split.tensors.count keys, and the first one has all
+ * the other key-value pairs of the model. Files not named as shards
+ * are opened as models with a single shard.
+ *
+ * Only the first shard is opened here (its context also has the model
+ * key-value pairs, see gguf_shards_get_ctx()): the others are opened
+ * and mapped when their tensors are accessed. The files are opened
+ * with the specified flags, see gguf_open_flags().
+ *
+ * On success the shards context is returned, otherwise NULL. */
+gguf_shards *gguf_shards_open(const char *filename, int flags) {
+    size_t prefixlen;
+    uint32_t count;
+    if (!gguf_parse_shard_name(filename,&prefixlen,&count)) {
+        prefixlen = 0;
+        count = 1;
+    }
+
+    gguf_shards *s = calloc(1,sizeof(*s));
+    if (s == NULL) return NULL;
+    s->flags = flags;
+    s->count = count;
+    s->filenames = calloc(count,sizeof(char*));
+    s->ctx = calloc(count,sizeof(gguf_ctx*));
+    if (s->filenames == NULL || s->ctx == NULL) goto fail;
+    for (uint32_t j = 0; j < count; j++) {
+        size_t len = strlen(filename)+1;
+        s->filenames[j] = malloc(len);
+        if (s->filenames[j] == NULL) goto fail;
+        if (count == 1)
+            memcpy(s->filenames[j],filename,len);
+        else
+            snprintf(s->filenames[j],len,GGUF_SHARD_FORMAT,
+                (int)prefixlen,filename,j+1,count);
+    }
+
+    gguf_ctx *first = gguf_shards_get_ctx(s,0);
+    if (first == NULL) goto fail;
+    if (count == 1) {
+        s->tensor_count = first->header->tensor_count;
+    } else if (!gguf_get_int_key(first,"split.tensors.count",&s->tensor_count)) {
+        errno = EINVAL;
+        goto fail;
+    }
+    return s;
+
+fail:
+    {
+        int saved_errno = errno;
+        gguf_shards_close(s);
+        errno = saved_errno;
+    }
+    return NULL;
+}
+
+/* Close all the shards and release the shards context. */
+void gguf_shards_close(gguf_shards *s) {
+    if (s == NULL) return;
+    for (uint32_t j = 0; j < s->count; j++) {
+        if (s->filenames) free(s->filenames[j]);
+        if (s->ctx) gguf_close(s->ctx[j]);
+    }
+    free(s->filenames);
+    free(s->ctx);
+    free(s->tensor_shard);
+    free(s->tensor_idx);
+    free(s->index);
+    free(s);
+}
+
+/* Fill 'tensor' with the info of the tensor number 'idx' of the model,
+ * counting the tensors of all the shards in order. The shard holding
+ * it (the tensor offset and weights_data refer to its file and mapping)
+ * is stored in *shard, if not NULL: its context is s->ctx[*shard].
+ * The shards before the tensor shard are opened if needed.
+ *
+ * Return 1 on success, 0 if there is no such tensor or on error. */
+int gguf_shards_get_tensor(gguf_shards *s, uint64_t idx, gguf_tensor *tensor, uint32_t *shard) {
+    tensor->name = NULL;
+    if (s->tensor_shard && idx < s->tensor_count) {
+        uint32_t j = s->tensor_shard[idx];
+        gguf_get_cached_tensor(s->ctx[j],s->tensor_idx[idx],tensor);
+        if (shard) *shard = j;
+        return 1;
+    }
+
+    uint64_t first = 0;
+    for (uint32_t j = 0; j < s->count; j++) {
+        gguf_ctx *ctx = gguf_shards_get_ctx(s,j);
+        if (ctx == NULL || gguf_load_header(ctx) == 0) return 0;
+        if (idx < first+ctx->header->tensor_count) {
+            gguf_get_cached_tensor(ctx,idx-first,tensor);
+            if (shard) *shard = j;
+            return 1;
+        }
+        first += ctx->header->tensor_count;
+    }
+    errno = ENOENT;
+    return 0;
+}
+
+/* Build the tensors index of the whole model: all the shards are opened,
+ * and a single hash table (like the one of gguf_build_index()) maps the
+ * names to the global tensor numbers. If the tensors of the shards are
+ * not split.tensors.count, errno is set to EINVAL. Models with a single
+ * file just use the index of the file, see gguf_build_index().
+ *
+ * Return 1 on success, 0 on error. */
+int gguf_shards_build_index(gguf_shards *s) {
+    if (s->index) return 1;
+    if (s->count == 1) return gguf_build_index(s->ctx[0]);
+
+    uint64_t total = 0;
+    for (uint32_t j = 0; j < s->count; j++) {
+        gguf_ctx *ctx = gguf_shards_get_ctx(s,j);
+        if (ctx == NULL || gguf_load_header(ctx) == 0) return 0;
+        total += ctx->header->tensor_count;
+    }
+    if (total != s->tensor_count || total >= UINT32_MAX) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    uint64_t size = 16;
+    while (size < total*2) size *= 2; // Load factor <= 50%.
+    s->tensor_shard = malloc(sizeof(uint32_t)*(total ? total : 1));
+    s->tensor_idx = malloc(sizeof(uint64_t)*(total ? total : 1));
+    s->index = calloc(size,sizeof(uint32_t));
+    if (!s->tensor_shard || !s->tensor_idx || !s->index) {
+        free(s->tensor_shard);
+        free(s->tensor_idx);
+        free(s->index);
+        s->tensor_shard = NULL;
+        s->tensor_idx = NULL;
+        s->index = NULL;
+        return 0;
+    }
+    s->index_size = size;
+
+    uint64_t g = 0, mask = size-1;
+    for (uint32_t j = 0; j < s->count; j++) {
+        gguf_ctx *ctx = s->ctx[j];
+        for (uint64_t t = 0; t < ctx->header->tensor_count; t++, g++) {
+            s->tensor_shard[g] = j;
+            s->tensor_idx[g] = t;
+            struct gguf_string *str = (struct gguf_string*)
+                (ctx->data+ctx->hcache->tensor_info_off[t]);
+
+            /* On duplicated names the first tensor wins. */
+            uint64_t idx = gguf_hash_name(str->string,str->len) & mask;
+            while (1) {
+                uint32_t slot = s->index[idx];
+                if (slot == 0) {
+                    s->index[idx] = g+1;
+                    break;
+                }
+                if (gguf_cached_name_eq(s->ctx[s->tensor_shard[slot-1]],
+                        s->tensor_idx[slot-1],str->string,str->len)) break;
+                idx = (idx+1) & mask;
+            }
+        }
+    }
+    return 1;
+}
+
+/* Lookup the tensor with the specified name in all the shards, like
+ * gguf_find_tensor() does for a single file. The index is built on the
+ * first call, if needed, and *shard is set as gguf_shards_get_tensor()
+ * does. Return 1 if the tensor was found, otherwise 0. */
+int gguf_shards_find_tensor(gguf_shards *s, const char *name, size_t namelen, gguf_tensor *tensor, uint32_t *shard) {
+    tensor->name = NULL;
+
+    /* Single files have their own index, that may come from a sidecar. */
+    if (s->count == 1) {
+        if (shard) *shard = 0;
+        return gguf_find_tensor(s->ctx[0],name,namelen,tensor);
+    }
+    if (gguf_shards_build_index(s) == 0) return 0;
+
+    uint64_t mask = s->index_size-1;
+    uint64_t idx = gguf_hash_name(name,namelen) & mask;
+    while (s->index[idx] != 0) {
+        uint64_t g = s->index[idx]-1;
+        uint32_t j = s->tensor_shard[g];
+        if (gguf_cached_name_eq(s->ctx[j],s->tensor_idx[g],name,namelen)) {
+            gguf_get_cached_tensor(s->ctx[j],s->tensor_idx[g],tensor);
+            if (shard) *shard = j;
+            return 1;
+        }
+        idx = (idx+1) & mask;
+    }
+    return 0;
+}
+
+/* ============================== Access hints ============================== */
+
+/* Translate GGUF_ADVICE_* into the madvise() one. */
+static int gguf_madvise_flag(int advice) {
+    switch(advice) {
+    case GGUF_ADVICE_SEQUENTIAL: return MADV_SEQUENTIAL;
+    case GGUF_ADVICE_RANDOM: return MADV_RANDOM;
+    case GGUF_ADVICE_WILLNEED: return MADV_WILLNEED;
+    case GGUF_ADVICE_DONTNEED: return MADV_DONTNEED;
+    default: return MADV_NORMAL;
+    }
+}
+
+/* Call madvise() on the pages covering [start, end) of the file mapping.
+ * With GGUF_ADVICE_DONTNEED only the pages fully inside the range are
+ * used, so that data outside the range is never dropped. */
+static int gguf_advise_range(gguf_ctx *ctx, uint64_t start, uint64_t end, int advice) {
+    /* Buffered writers may have no file mapping yet. */
+    if (ctx->data == NULL || ctx->data == ctx->wbuf) return 1;
+
+    uint64_t pagesize = sysconf(_SC_PAGESIZE);
+    if (end > ctx->size) end = ctx->size;
+    if (advice == GGUF_ADVICE_DONTNEED) {
+        start = (start+pagesize-1) / pagesize * pagesize;
+        end = end / pagesize * pagesize;
+    } else {
+        start = start / pagesize * pagesize;
+    }
+    if (start >= end) return 1;
+    return madvise(ctx->data+start,end-start,gguf_madvise_flag(advice)) == 0;
+}
+
+/* Give the kernel an hint about the way the whole file is going to be
+ * accessed via the memory mapping: GGUF_ADVICE_SEQUENTIAL makes the
+ * kernel read ahead more aggressively (and free pages already read
+ * sooner), GGUF_ADVICE_RANDOM disables read ahead. Other GGUF_ADVICE_*
+ * values apply to the whole file like in gguf_advise_tensor().
+ *
+ * Hints are tied to the mapping, so they must be given again after
+ * gguf_remap(). Return 1 on success, 0 on error. */
+int gguf_advise(gguf_ctx *ctx, int advice) {
+    return gguf_advise_range(ctx,0,ctx->size,advice);
+}
+
+/* Give the kernel an hint about the data of the specified tensor:
+ *
+ * GGUF_ADVICE_WILLNEED: start reading the tensor data in background.
+ * Calling it for the next tensor while the current one is processed
+ * overlaps I/O and computation.
+ * GGUF_ADVICE_DONTNEED: the tensor data was processed, release the
+ * pages from the process, so that scanning files larger than the RAM
+ * does not grow the memory usage.
+ *
+ * Return 1 on success, 0 on error. */
+int gguf_advise_tensor(gguf_ctx *ctx, gguf_tensor *tensor, int advice) {
+    return gguf_advise_range(ctx,tensor->offset,
+                             tensor->offset+tensor->bsize,advice);
+}
+
+/* ============================ Streaming reader ============================ */
+
+/* A stream delivers the data of a list of tensors, in order, one chunk at
+ * a time. Every chunk is returned as a gguf_tensor "view": a tensor with
+ * the same type, covering a range of weights of the original tensor,
+ * whose weights_data points either inside the file mapping (the mmap
+ * backend) or inside a staging buffer where the data was read with
+ * pread() (the pread and O_DIRECT backends). This way all the functions
+ * accepting tensors (dequantization, conversion, writing) work the same
+ * with any backend.
+ *
+ * The pread backends use two staging buffers: a background thread reads
+ * the next chunk while the caller processes the current one. */
+#define GGUF_STREAM_ALIGN 4096  // O_DIRECT offsets/sizes alignment.
+
+#define GGUF_SLOT_FREE 0        // Slot can be filled by the reader.
+#define GGUF_SLOT_FILLED 1      // Slot contains a chunk.
+#define GGUF_SLOT_ERROR 2       // Reading the chunk failed.
+#define GGUF_SLOT_END 3         // No more chunks.
+
+struct gguf_stream_slot {
+    uint8_t *buf;           // GGUF_STREAM_ALIGN aligned staging buffer.
+    gguf_tensor view;       // Chunk returned to the caller.
+    uint64_t tensor_idx;    // Index of the tensor the chunk belongs to.
+    uint64_t first;         // First weight of the chunk.
+    int state;              // GGUF_SLOT_* state.
+    int err;                // errno of GGUF_SLOT_ERROR.
+};
+
+struct gguf_stream {
+    gguf_ctx *ctx;
+    gguf_tensor *tensors;   // Tensors to stream, in order.
+    uint64_t count;         // Number of tensors.
+    uint64_t chunk_weights; // Max weights per chunk.
+    int backend;            // GGUF_STREAM_* backend.
+    int fd;                 // File descriptor for the pread backends.
+    uint64_t next_tensor;   // Reading position: tensor and weight.
+    uint64_t next_first;
+    gguf_tensor prev;       // mmap backend: last chunk returned.
+    int have_prev;
+    struct gguf_stream_slot slots[2];
+    int cur;                // Slot returned to the caller, or -1.
+    int ended;              // Set once the end of stream is returned.
+    int stop;               // Ask the reader thread to exit.
+    int reader_started;
+    pthread_t reader;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/* Compute the next chunk, advancing the reading position. Sets the
+ * tensor index, first weight and chunk view (without data pointer).
+ * Return 0 if there are no more chunks. */
+static int gguf_stream_advance(gguf_stream *s, uint64_t *tensor_idx, uint64_t *first, gguf_tensor *view) {
+    while (s->next_tensor < s->count &&
+           s->next_first >= s->tensors[s->next_tensor].num_weights)
+    {
+        s->next_tensor++;
+        s->next_first = 0;
+    }
+    if (s->next_tensor == s->count) return 0;
+
+    gguf_tensor *t = s->tensors+s->next_tensor;
+    struct gguf_tensor_type_features *tf =
+        gguf_get_tensor_type_features(t->type);
+    uint64_t n = t->num_weights - s->next_first;
+    if (n > s->chunk_weights) n = s->chunk_weights;
+
+    *tensor_idx = s->next_tensor;
+    *first = s->next_first;
+    *view = *t;
+    view->ndim = 1;
+    memset(view->dim,0,sizeof(view->dim));
+    view->dim[0] = n;
+    view->num_weights = n;
+    view->offset = t->offset +
+                   s->next_first/tf->items_per_block*tf->bytes_per_block;
+    view->bsize = (n+tf->items_per_block-1)/tf->items_per_block *
+                  tf->bytes_per_block;
+    view->weights_data = NULL;
+    s->next_first += n;
+    return 1;
+}
+
+/* Read the 'size' bytes at 'offset' of the file 'fd' (opened by
+ * gguf_open_read_fd()) in 'buf', that must be GGUF_STREAM_ALIGN aligned
+ * and have space for 'size' + 2*GGUF_STREAM_ALIGN bytes: the range is
+ * extended at both ends to the I/O alignment. Return a pointer to the
+ * data at 'offset' inside 'buf', or NULL on error. */
+static uint8_t *gguf_read_aligned(gguf_ctx *ctx, int fd, uint8_t *buf, uint64_t offset, uint64_t size) {
+    uint64_t start = offset / GGUF_STREAM_ALIGN * GGUF_STREAM_ALIGN;
+    uint64_t end = offset + size;
+    uint64_t len = (end-start+GGUF_STREAM_ALIGN-1) /
+                   GGUF_STREAM_ALIGN * GGUF_STREAM_ALIGN;
+    uint64_t got = 0;
+    uint64_t t0 = gguf_stats_now();
+    while (got < end-start) {
+        ssize_t nread = pread(fd,buf+got,len-got,start+got);
+        if (nread == -1 && errno == EINTR) continue;
+#ifdef O_DIRECT
+        /* Some file systems accept O_DIRECT at open() time, but
+         * not on reads: switch to normal reads. */
+        if (nread == -1 && errno == EINVAL &&
+            (fcntl(fd,F_GETFL) & O_DIRECT))
+        {
+            if (fcntl(fd,F_SETFL,fcntl(fd,F_GETFL) & ~O_DIRECT) == -1)
+                return NULL;
+            continue;
+        }
+#endif
+        if (nread == -1) return NULL;
+        if (nread == 0) {
+            errno = EIO; // File truncated.
+            return NULL;
+        }
+        got += nread;
+        GGUF_STATS_OP(ctx,t0,nread,reads,bytes_read,read_ns);
+        t0 = gguf_stats_now();
+    }
+    return buf + (offset-start);
+}
+
+/* Read the data of the chunk 'view' in the slot buffer, setting the
+ * view data pointer. Return 1 on success, 0 on error. */
+static int gguf_stream_read(gguf_stream *s, struct gguf_stream_slot *slot) {
+    slot->view.weights_data = gguf_read_aligned(s->ctx,s->fd,slot->buf,
+        slot->view.offset,slot->view.bsize);
+    return slot->view.weights_data != NULL;
+}
+
+/* Return a new file descriptor to read the file of 'ctx' with the
+ * pread 'backend' (GGUF_STREAM_PREAD or GGUF_STREAM_DIRECT), or -1 on
+ * error. The descriptor is not shared with the context, so that
+ * O_DIRECT does not affect it. */
+static int gguf_open_read_fd(gguf_ctx *ctx, int backend) {
+    int fd = -1;
+#if defined(__linux__) && defined(O_DIRECT)
+    if (backend == GGUF_STREAM_DIRECT) {
+        char path[64];
+        snprintf(path,sizeof(path),"/proc/self/fd/%d",ctx->fd);
+        fd = open(path,O_RDONLY|O_DIRECT);
+    }
+#else
+    (void)backend;
+#endif
+    if (fd == -1) fd = dup(ctx->fd);
+    return fd;
+}
+
+/* Reader thread of the pread backends: fill the two slots in turn. */
+static void *gguf_stream_reader(void *arg) {
+    gguf_stream *s = arg;
+    int j = 0;
+    while(1) {
+        struct gguf_stream_slot *slot = s->slots+j;
+        pthread_mutex_lock(&s->lock);
+        while (!s->stop && slot->state != GGUF_SLOT_FREE)
+            pthread_cond_wait(&s->cond,&s->lock);
+        int stop = s->stop;
+        pthread_mutex_unlock(&s->lock);
+        if (stop) break;
+
+        int state;
+        if (!gguf_stream_advance(s,&slot->tensor_idx,&slot->first,&slot->view))
+            state = GGUF_SLOT_END;
+        else if (gguf_stream_read(s,slot))
+            state = GGUF_SLOT_FILLED;
+        else
+            state = GGUF_SLOT_ERROR;
+
+        pthread_mutex_lock(&s->lock);
+        slot->err = errno;
+        slot->state = state;
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+        if (state != GGUF_SLOT_FILLED) break;
+        j ^= 1;
+    }
+    return NULL;
+}
+
+/* Open a stream delivering the data of the 'count' tensors in the
+ * 'tensors' array (obtained from 'ctx'), in order, in chunks of up to
+ * 'chunk_weights' weights, that must be a multiple of the items per
+ * block of all the tensors types (any multiple of 256 works with all
+ * the quantization formats). The tensors array must stay valid while
+ * the stream is used.
+ *
+ * The 'backend' is one of:
+ *
+ * GGUF_STREAM_MMAP: the chunks point inside the file mapping. The
+ * kernel is asked to read ahead the next chunk, and to release the
+ * pages of the chunks already processed (see gguf_advise_tensor()).
+ * GGUF_STREAM_PREAD: the chunks are read with pread() in staging
+ * buffers, by a background thread, one chunk ahead.
+ * GGUF_STREAM_DIRECT: like GGUF_STREAM_PREAD, but the file is read
+ * with O_DIRECT, bypassing the page cache. If the file system does
+ * not support it, normal reads are used.
+ *
+ * Return the stream, or NULL on error with errno set (EINVAL if the
+ * chunk size is not compatible with the tensors). */
+gguf_stream *gguf_stream_open(gguf_ctx *ctx, gguf_tensor *tensors, uint64_t count, uint64_t chunk_weights, int backend) {
+    uint64_t max_bytes = 0; // Biggest chunk in bytes.
+    for (uint64_t j = 0; j < count; j++) {
+        struct gguf_tensor_type_features *tf =
+            gguf_get_tensor_type_features(tensors[j].type);
+        if (chunk_weights == 0 || tf == NULL || tf->items_per_block == 0 ||
+            chunk_weights % tf->items_per_block != 0)
+        {
+            errno = EINVAL;
+            return NULL;
+        }
+        uint64_t bytes = chunk_weights/tf->items_per_block*tf->bytes_per_block;
+        if (bytes > max_bytes) max_bytes = bytes;
+    }
+
+    gguf_stream *s = calloc(1,sizeof(*s));
+    if (s == NULL) return NULL;
+    s->ctx = ctx;
+    s->tensors = tensors;
+    s->count = count;
+    s->chunk_weights = chunk_weights;
+    s->backend = backend;
+    s->fd = -1;
+    s->cur = -1;
+    if (backend == GGUF_STREAM_MMAP) return s;
+
+    s->fd = gguf_open_read_fd(ctx,backend);
+
+    /* Each buffer can hold the biggest chunk, extended at both ends
+     * to the I/O alignment. */
+    uint64_t bufsize = max_bytes + GGUF_STREAM_ALIGN*2;
+    for (int j = 0; j < 2; j++) {
+        void *buf;
+        if (posix_memalign(&buf,GGUF_STREAM_ALIGN,bufsize) != 0) {
+            buf = NULL;
+            errno = ENOMEM;
+        }
+        s->slots[j].buf = buf;
+    }
+    pthread_mutex_init(&s->lock,NULL);
+    pthread_cond_init(&s->cond,NULL);
+    if (s->fd == -1 || s->slots[0].buf == NULL || s->slots[1].buf == NULL) {
+        gguf_stream_close(s);
+        return NULL;
+    }
+
+    int err = pthread_create(&s->reader,NULL,gguf_stream_reader,s);
+    if (err) {
+        gguf_stream_close(s);
+        errno = err;
+        return NULL;
+    }
+    s->reader_started = 1;
+    return s;
+}
+
+/* Get the next chunk of the stream. On success 1 is returned, and:
+ *
+ * 'chunk' is set to the chunk view, valid until the next call.
+ * 'tensor_idx' is set to the index, in the tensors array, of the tensor
+ * the chunk belongs to, and 'first' to the index of the first weight of
+ * the chunk inside such tensor. Both pointers can be NULL.
+ *
+ * At the end of the stream 0 is returned. On I/O error -1 is returned
+ * and errno is set. */
+int gguf_stream_next(gguf_stream *s, gguf_tensor *chunk, uint64_t *tensor_idx, uint64_t *first) {
+    if (s->ended) return 0;
+
+    uint64_t idx, f;
+    if (s->backend == GGUF_STREAM_MMAP) {
+        if (s->have_prev)
+            gguf_advise_tensor(s->ctx,&s->prev,GGUF_ADVICE_DONTNEED);
+        if (!gguf_stream_advance(s,&idx,&f,chunk)) {
+            s->ended = 1;
+            return 0;
+        }
+        chunk->weights_data = s->ctx->data + chunk->offset;
+        s->prev = *chunk;
+        s->have_prev = 1;
+
+        /* Start reading the next chunk: compute it without moving
+         * the reading position. */
+        uint64_t saved_tensor = s->next_tensor, saved_first = s->next_first;
+        gguf_tensor next;
+        uint64_t nidx, nf;
+        if (gguf_stream_advance(s,&nidx,&nf,&next))
+            gguf_advise_tensor(s->ctx,&next,GGUF_ADVICE_WILLNEED);
+        s->next_tensor = saved_tensor;
+        s->next_first = saved_first;
+    } else {
+        pthread_mutex_lock(&s->lock);
+        /* Give the previous chunk back to the reader. */
+        if (s->cur != -1) {
+            s->slots[s->cur].state = GGUF_SLOT_FREE;
+            pthread_cond_broadcast(&s->cond);
+            s->cur ^= 1;
+        } else {
+            s->cur = 0;
+        }
+        struct gguf_stream_slot *slot = s->slots+s->cur;
+        while (slot->state == GGUF_SLOT_FREE)
+            pthread_cond_wait(&s->cond,&s->lock);
+        int state = slot->state;
+        pthread_mutex_unlock(&s->lock);
+
+        if (state != GGUF_SLOT_FILLED) {
+            s->ended = 1;
+            if (state == GGUF_SLOT_END) return 0;
+            errno = slot->err;
+            return -1;
+        }
+        *chunk = slot->view;
+        idx = slot->tensor_idx;
+        f = slot->first;
+    }
+    if (tensor_idx) *tensor_idx = idx;
+    if (first) *first = f;
+    return 1;
+}
+
+/* Stop the stream and free its resources. */
+void gguf_stream_close(gguf_stream *s) {
+    if (s == NULL) return;
+    if (s->backend != GGUF_STREAM_MMAP) {
+        if (s->reader_started) {
+            pthread_mutex_lock(&s->lock);
+            s->stop = 1;
+            pthread_cond_broadcast(&s->cond);
+            pthread_mutex_unlock(&s->lock);
+            pthread_join(s->reader,NULL);
+        }
+        pthread_mutex_destroy(&s->lock);
+        pthread_cond_destroy(&s->cond);
+        free(s->slots[0].buf);
+        free(s->slots[1].buf);
+        if (s->fd != -1) close(s->fd);
+    }
+    free(s);
+}
+
+/* This function can be called after gguf_get_key(), since the context
+ * offset will be in the position of a value.
+ *
+ * The function will process the value, including nested values (in the
+ * case of an array value), and for each value will call the specified
+ * callback. As a side effect of calling this function, the context offset
+ * is advanced to consume the value.
+ *
+ * If the callback is set to NULL, no callback will be called,
+ * but the value will be consumed, so that it will be possible
+ * to call gguf_get_key() or gguf_get_tensor() to continue reading
+ * the file.
+ *
+ * When the callback is called, it gets the argument 'privdata' and 'in_array'
+ * as passed to this function. This is useful if the callback needs
+ * to take state (for pretty printing or alike) and to know if the
+ * elements it is processing belong to an array.
+ *
+ * The value of 'in_array' is the 1-based index of the element being
+ * processed.
+ *
+ * In the case of arrays, callbacks are also called with the special
+ * type ARRAY_START / ARRAY_END at the start/end of the array
+ * processing. */
+void gguf_do_with_value(gguf_ctx *ctx, uint32_t type, union gguf_value *val,
+                        void *privdata, uint64_t in_array, uint64_t array_len,
+                        void(*callback)(void *privdata, uint32_t type,
+                                     union gguf_value *val, uint64_t in_array,
+                                     uint64_t array_len))
+{
+    if (type == GGUF_VALUE_TYPE_ARRAY) {
+        uint32_t etype; // Elements type.
+        uint64_t len;   // Number of elements.
+        etype = val->array.type;
+        len = val->array.len;
+        //exit(1);
+        ctx->off += 4+8; // Skip elements type / array length.
+
+        /* Without a callback we are just skipping the value. Arrays of
+         * fixed width elements are skipped at once, strings with a tight
+         * loop on the length prefixes. Only arrays of arrays need the
+         * recursion below. */
+        if (callback == NULL && etype != GGUF_VALUE_TYPE_ARRAY) {
+            if (etype != GGUF_VALUE_TYPE_STRING) {
+                ctx->off += len*gguf_value_len(etype,NULL);
+                return;
+            }
+            uint64_t off = ctx->off;
+            for (uint64_t j = 0; j < len; j++)
+                off += 8+*(uint64_t*)(ctx->data+off);
+            ctx->off = off;
+            return;
+        }
+
+        if (callback)
+            callback(privdata,GGUF_VALUE_TYPE_ARRAY_START,val,in_array,len);
+        for (uint64_t j = 0; j < len; j++) {
+            val = (union gguf_value*)(ctx->data+ctx->off);
+            gguf_do_with_value(ctx,etype,val,privdata,j+1,len,callback);
+            /* As a side effect of calling gguf_do_with_value() ctx->off
+             * will be update, so 'val' will be set to the next element. */
+        }
+        if (callback)
+            callback(privdata,GGUF_VALUE_TYPE_ARRAY_END,NULL,in_array,len);
+    } else {
+        if (callback)
+            callback(privdata,type,val,in_array,array_len);
+        ctx->off += gguf_value_len(type,val);
+    }
+}
+
+struct gguf_print_options {
+    uint64_t max_array_items;       // Don't print more than N items.
+};
+
+/* Print a GGUF value. 'privdata' is used to pass guff_print_options and
+ * may be NULL if no options are provided.
+ *
+ * The function is designed to be used as a callback of gguf_do_with_value(). */
+void gguf_print_value_callback(void *privdata, uint32_t type, union gguf_value *val, uint64_t in_array, uint64_t array_len) {
+    struct gguf_print_options *po = privdata;
+    if (po && po->max_array_items && in_array > po->max_array_items) {
+        if (in_array-1 == po->max_array_items)
+            printf("... %" PRIu64 " more items of %" PRIu64 "",
+                   array_len-in_array+1, array_len);
+        return;
+    }
+
+    switch (type) {
+        case GGUF_VALUE_TYPE_ARRAY_START:
+            printf("["); break;
+        case GGUF_VALUE_TYPE_ARRAY_END:
+            printf("]"); break;
+        case GGUF_VALUE_TYPE_UINT8:
+            printf("%u", val->uint8); break;
+        case GGUF_VALUE_TYPE_INT8:
+            printf("%d", val->int8); break;
+        case GGUF_VALUE_TYPE_UINT16:
+            printf("%u", val->uint16); break;
+        case GGUF_VALUE_TYPE_INT16:
+            printf("%d", val->int16); break;
+        case GGUF_VALUE_TYPE_UINT32:
+            printf("%u", val->uint32); break;
+        case GGUF_VALUE_TYPE_INT32:
+            printf("%d", val->int32); break;
+        case GGUF_VALUE_TYPE_FLOAT32:
+            printf("%f", val->float32); break;
+        case GGUF_VALUE_TYPE_BOOL:
+            if (val->boolval == 0 || val->boolval == 1)
+                printf("%s", val->boolval ? "true" : "false");
+            else
+                printf("Invalid boolean value %d", val->boolval);
+            break;
+        case GGUF_VALUE_TYPE_STRING:
+            printf("%.*s", (int)val->string.len, val->string.string); break;
+        case GGUF_VALUE_TYPE_UINT64:
+            printf("%" PRIu64 "", val->uint64); break;
+        case GGUF_VALUE_TYPE_INT64:
+            printf("%" PRId64 "", val->int64); break;
+        case GGUF_VALUE_TYPE_FLOAT64:
+            printf("%lf", val->float64); break;
+        default:
+            printf("Unknown type\n");
+            break;
+    }
+    if (in_array && in_array != array_len) printf(", ");
+}
+
+/* Print the current value, including arrays. As a side effect
+ * the value will be consumed from the context, that will now point
+ * to the next item in the GGUF file.
+ *
+ * If 'full' is true, in the case of arrays, the whole array is printed,
+ * otherwise just the first few elements. */
+void gguf_print_value(gguf_ctx *ctx, uint32_t type, union gguf_value *val, int full) {
+    struct gguf_print_options po;
+    po.max_array_items = full ? 0 : 30;
+    gguf_do_with_value(ctx,type,val,&po,0,0,gguf_print_value_callback);
+}
+
+/* ============================= GGUF writing API  ========================== */
+
+/* Create an empty GGUF file with no key-value pairs nor tensors.
+ * The file can be extended by using the APIs to add tensors and
+ * keys.
+ *
+ * If the GGUF_OVERWRITE flag is given, an existing file with the
+ * same name is truncated, otherwise the function fails.
+ *
+ * If the GGUF_BUFFERED flag is given, the header, the key-value pairs
+ * and the tensors info are staged in memory (ctx->data points to the
+ * staging buffer) so that appending them costs just a memcpy(), instead
+ * of a few write() calls and a remap of the whole file. The staged data
+ * is written to the file as soon as the first tensor data is appended,
+ * and the tensors data is written directly (without remapping) at the
+ * end of the file. Call gguf_flush() to make sure everything is written
+ * and to map the resulting file. In this mode, appending key-values or
+ * tensors info after the first tensor data fails with EINVAL.
+ *
+ * On success the context with the file already loaded is returned,
+ * otherwise NULL is returned. */
+gguf_ctx *gguf_create(const char *filename, int flags) {
+    struct gguf_header hdr;
+    memcpy(&hdr.magic,"GGUF",4);
+    hdr.version = 3;
+    hdr.tensor_count = 0;
+    hdr.metadata_kv_count = 0;
+
+    if (flags & GGUF_BUFFERED) {
+        int fd = open(filename,
+            O_RDWR|O_CREAT|(flags & GGUF_OVERWRITE ? O_TRUNC : O_EXCL),0666);
+        if (fd == -1) return NULL;
+        gguf_ctx *ctx = calloc(1, sizeof(*ctx));
+        if (ctx) ctx->wbuf = malloc(4096);
+        if (ctx == NULL || ctx->wbuf == NULL) {
+            free(ctx);
+            close(fd);
+            return NULL;
+        }
+        memcpy(ctx->wbuf,&hdr,sizeof(hdr));
+        ctx->wbuf_len = sizeof(hdr);
+        ctx->wbuf_alloc = 4096;
+        ctx->fd = fd;
+        ctx->flags = flags;
+        ctx->alignment = 32;
+        ctx->data = ctx->wbuf;
+        ctx->header = (struct gguf_header*)ctx->wbuf;
+        ctx->size = sizeof(hdr);
+        gguf_rewind(ctx);
+        return ctx;
+    }
+
+    FILE *fp = fopen(filename, flags & GGUF_OVERWRITE ? "w" : "wx");
+    if (fp == NULL) return NULL;
+    if (fwrite(&hdr,1,sizeof(hdr),fp) != sizeof(hdr)) {
+        fclose(fp);
+        return NULL;
+    }
+    fclose(fp);
+
+    return gguf_open(filename);
+}
+
+/* Write at 'offset' all the data described by the 'iov' array,
+ * handling short writes. Return 1 on success, 0 on error. */
+static int gguf_pwritev_all(int fd, struct iovec *iov, int iovcnt, uint64_t offset) {
+    while (iovcnt) {
+        ssize_t nwritten = pwritev(fd,iov,iovcnt,offset);
+        if (nwritten == -1) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        offset += nwritten;
+        /* Skip the fully written buffers, adjust the partial one. */
+        while (iovcnt && (size_t)nwritten >= iov->iov_len) {
+            nwritten -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt) {
+            iov->iov_base = (char*)iov->iov_base + nwritten;
+            iov->iov_len -= nwritten;
+        }
+    }
+    return 1;
+}
+
+/* Append 'len' bytes, in 'count' pieces, to the staging buffer of a
+ * GGUF_BUFFERED context. Return 1 on success, 0 on error. */
+static int gguf_stage(gguf_ctx *ctx, struct iovec *iov, int count) {
+    if (ctx->wbuf == NULL || ctx->staged_written) {
+        errno = EINVAL;
+        return 0;
+    }
+    uint64_t len = 0;
+    for (int j = 0; j < count; j++) len += iov[j].iov_len;
+    if (ctx->wbuf_len+len > ctx->wbuf_alloc) {
+        uint64_t alloc = ctx->wbuf_alloc;
+        while (alloc < ctx->wbuf_len+len) alloc *= 2;
+        uint8_t *wbuf = realloc(ctx->wbuf,alloc);
+        if (wbuf == NULL) return 0;
+        gguf_free_index(ctx); // Points to the old buffer.
+        ctx->wbuf = wbuf;
+        ctx->wbuf_alloc = alloc;
+        ctx->data = wbuf;
+        ctx->header = (struct gguf_header*)wbuf;
+    }
+    gguf_free_header_cache(ctx); // The header is changing.
+    for (int j = 0; j < count; j++) {
+        memcpy(ctx->wbuf+ctx->wbuf_len,iov[j].iov_base,iov[j].iov_len);
+        ctx->wbuf_len += iov[j].iov_len;
+    }
+    ctx->size = ctx->wbuf_len;
+    return 1;
+}
+
+/* Write the staged header, key-values and tensors info of a
+ * GGUF_BUFFERED context at the start of the file, if not already done.
+ * Return 1 on success, 0 on error. */
+static int gguf_write_staged(gguf_ctx *ctx) {
+    if (ctx->wbuf == NULL || ctx->staged_written) return 1;
+    struct iovec iov = {ctx->wbuf, ctx->wbuf_len};
+    uint64_t start = gguf_stats_now();
+    if (gguf_pwritev_all(ctx->fd,&iov,1,0) == 0) return 0;
+    GGUF_STATS_OP(ctx,start,ctx->wbuf_len,writes,bytes_written,write_ns);
+    ctx->staged_written = 1;
+    return 1;
+}
+
+/* Finalize the writes of a GGUF_BUFFERED context: the staged data is
+ * written, if needed, and the file is mapped again, so that the context
+ * can be used to read the file as usual. For non buffered contexts
+ * this function does nothing, since every append already updates
+ * the file and the mapping.
+ *
+ * Return 1 on success, 0 on error. */
+int gguf_flush(gguf_ctx *ctx) {
+    if (!(ctx->flags & GGUF_BUFFERED)) return 1;
+    if (gguf_write_staged(ctx) == 0) return 0;
+    return gguf_remap(ctx);
+}
+
+/* Low level API to append some key-value data to the GGUF file identified
+ * by the context 'ctx'. It's up to the caller to provide a well-formatted
+ * value of the specified type in 'val'. The len is the raw bytes length of
+ * the specified value. Higher level APIs use this one to create fields with
+ * different numerical values, strings, ...
+ *
+ * On success the function returns 1. Otherwise 0.
+ * The function fails and returns 0 with errno set to EINVAL if the
+ * tensors count in the header is non-zero: we can't append key-value
+ * data after the first tensor was emitted: to edit the key-value pairs
+ * of an existing file use gguf_set_kv() and gguf_del_kv(). */
+int gguf_append_kv(gguf_ctx *ctx, const char *keyname, uint64_t keylen, uint32_t type, void *val, uint64_t len) {
+    if (ctx->header->tensor_count != 0) {
+        errno = EINVAL;
+        return 0;
+    }
+    if (ctx->flags & GGUF_BUFFERED) {
+        struct iovec iov[4] = {
+            {&keylen, sizeof(keylen)},
+            {(void*)keyname, keylen},
+            {&type, sizeof(type)},
+            {val, len}
+        };
+        if (gguf_stage(ctx,iov,4) == 0) return 0;
+        ctx->header->metadata_kv_count++;
+        return 1;
+    }
+    if (gguf_write(ctx,&keylen,sizeof(keylen)) != sizeof(keylen)) return 0;
+    if (gguf_write(ctx,keyname,keylen) != (ssize_t)keylen) return 0;
+    if (gguf_write(ctx,&type,sizeof(type)) != sizeof(type)) return 0;
+    if (gguf_write(ctx,val,len) != (ssize_t)len) return 0;
+    if (gguf_remap(ctx) == 0) return 0;
+    ctx->header->metadata_kv_count++;
+    return 1;
+}
+
+/* Append tensor metadata (but not the actual tensor weights data) to the
+ * GGUF file identified by 'ctx'. */
+int gguf_append_tensor_info(gguf_ctx *ctx, const char *tensorname, uint64_t namelen, uint32_t num_dim, uint64_t *dim, uint32_t type, uint64_t offset)
+{
+    if (ctx->flags & GGUF_BUFFERED) {
+        struct iovec iov[6] = {
+            {&namelen, sizeof(namelen)},
+            {(void*)tensorname, namelen},
+            {&num_dim, sizeof(num_dim)},
+            {dim, sizeof(uint64_t)*num_dim},
+            {&type, sizeof(type)},
+            {&offset, sizeof(offset)}
+        };
+        if (gguf_stage(ctx,iov,6) == 0) return 0;
+        ctx->header->tensor_count++;
+        return 1;
+    }
+    if (gguf_write(ctx,&namelen,sizeof(namelen)) != sizeof(namelen)) return 0;
+    if (gguf_write(ctx,tensorname,namelen) != (ssize_t)namelen) return 0;
+    if (gguf_write(ctx,&num_dim,sizeof(num_dim)) != sizeof(num_dim)) return 0;
+    for (uint32_t j = 0; j < num_dim; j++) {
+        if (gguf_write(ctx,&dim[j],sizeof(uint64_t)) != sizeof(uint64_t))
+            return 0;
+    }
+    if (gguf_write(ctx,&type,sizeof(type)) != sizeof(type)) return 0;
+    if (gguf_write(ctx,&offset,sizeof(offset)) != sizeof(offset)) return 0;
+    if (gguf_remap(ctx) == 0) return 0;
+    ctx->header->tensor_count++;
+    return 1;
+}
+
+/* Append tensor data enforcing the GGUF file aligment.
+ * The function will take care to add the padding required to start writing
+ * the tensor at an alignment multiple. */
+int gguf_append_tensor_data(gguf_ctx *ctx, void *tensor, uint64_t tensor_size) {
+    char padding_data[1024] = {0};
+    assert(sizeof(padding_data) >= ctx->alignment);
+
+    uint64_t padding = gguf_get_alignment_padding(ctx->alignment,ctx->size);
+    if (ctx->flags & GGUF_BUFFERED) {
+        if (gguf_write_staged(ctx) == 0) return 0;
+        struct iovec iov[2] = {
+            {padding_data, padding},
+            {tensor, tensor_size}
+        };
+        uint64_t start = gguf_stats_now();
+        if (gguf_pwritev_all(ctx->fd,iov,2,ctx->size) == 0) return 0;
+        GGUF_STATS_OP(ctx,start,padding+tensor_size,writes,bytes_written,write_ns);
+        ctx->size += padding+tensor_size;
+        return 1;
+    }
+    if (gguf_write(ctx,padding_data,padding) != (ssize_t)padding) return 0;
+    if (gguf_write(ctx,tensor,tensor_size) != (ssize_t)tensor_size) return 0;
+    if (gguf_remap(ctx) == 0) return 0;
+    return 1;
+}
+
+/* Copy 'len' bytes from 'in_fd' at offset 'in_off' to 'out_fd' at
+ * 'out_off', without moving the data through user space when
+ * possible. The methods tried are, in this order:
+ *
+ * 1. FICLONERANGE, if both offsets and the length are multiples of the
+ *    file system block size: file systems with reflinks support (btrfs,
+ *    XFS, ...) will share the extents, making the copy instant.
+ * 2. copy_file_range(), that copies the data inside the kernel (and may
+ *    be offloaded to the storage or the NFS server).
+ * 3. sendfile().
+ * 4. pwrite() of 'src', that must point to the source bytes in memory.
+ *
+ * 'out_fd' must not be in O_APPEND mode. Return 1 on success, 0 on error. */
+static int gguf_copy_range(int out_fd, uint64_t out_off, int in_fd, uint64_t in_off, uint64_t len, const uint8_t *src) {
+#ifdef __linux__
+    struct stat in_sb, out_sb;
+    if (fstat(in_fd,&in_sb) == 0 && fstat(out_fd,&out_sb) == 0) {
+        uint64_t bs = in_sb.st_blksize > out_sb.st_blksize ?
+                      in_sb.st_blksize : out_sb.st_blksize;
+        if (bs && in_off % bs == 0 && out_off % bs == 0 && len % bs == 0) {
+            struct file_clone_range fcr;
+            fcr.src_fd = in_fd;
+            fcr.src_offset = in_off;
+            fcr.src_length = len;
+            fcr.dest_offset = out_off;
+            if (ioctl(out_fd,FICLONERANGE,&fcr) == 0) return 1;
+        }
+    }
+
+    /* Note that on partial copies we just continue with the next method
+     * from the point we reached. */
+    while (len) {
+        loff_t ioff = in_off, ooff = out_off;
+        ssize_t copied = copy_file_range(in_fd,&ioff,out_fd,&ooff,len,0);
+        if (copied <= 0) {
+            if (copied == -1 && errno == EINTR) continue;
+            break;
+        }
+        in_off += copied;
+        out_off += copied;
+        src += copied;
+        len -= copied;
+    }
+
+    if (len && lseek(out_fd,out_off,SEEK_SET) != -1) {
+        while (len) {
+            off_t ioff = in_off;
+            ssize_t copied = sendfile(out_fd,in_fd,&ioff,len);
+            if (copied <= 0) {
+                if (copied == -1 && errno == EINTR) continue;
+                break;
+            }
+            in_off += copied;
+            out_off += copied;
+            src += copied;
+            len -= copied;
+        }
+    }
+#else
+    (void)in_fd;
+    (void)in_off;
+#endif
+    if (len == 0) return 1;
+    struct iovec iov = {(void*)src, len};
+    return gguf_pwritev_all(out_fd,&iov,1,out_off);
+}
+
+/* Append the data of the tensor 'tensor', obtained from the context
+ * 'src' with gguf_get_tensor() or gguf_find_tensor(), to the GGUF file
+ * of 'ctx', enforcing the file alignment like gguf_append_tensor_data().
+ * The data is copied from file to file by the kernel (or shared via
+ * reflinks, when the file system and the alignment allow it), so the
+ * source data is not faulted in memory.
+ *
+ * On success 1 is returned, otherwise 0. */
+int gguf_append_tensor_from(gguf_ctx *ctx, gguf_ctx *src, gguf_tensor *tensor) {
+    char padding_data[1024] = {0};
+    assert(sizeof(padding_data) >= ctx->alignment);
+
+    if ((ctx->flags & GGUF_BUFFERED) && gguf_write_staged(ctx) == 0)
+        return 0;
+
+    /* Non buffered contexts use O_APPEND, that is not compatible with
+     * writes at a given offset: disable it while we copy. */
+    int fl = -1;
+    if (!(ctx->flags & GGUF_BUFFERED)) {
+        fl = fcntl(ctx->fd,F_GETFL);
+        if (fl == -1 || fcntl(ctx->fd,F_SETFL,fl & ~O_APPEND) == -1)
+            return 0;
+    }
+
+    uint64_t padding = gguf_get_alignment_padding(ctx->alignment,ctx->size);
+    struct iovec iov = {padding_data, padding};
+    uint64_t start = gguf_stats_now();
+    int retval = gguf_pwritev_all(ctx->fd,&iov,1,ctx->size) &&
+                 gguf_copy_range(ctx->fd,ctx->size+padding,src->fd,
+                     tensor->offset,tensor->bsize,tensor->weights_data);
+    if (retval)
+        GGUF_STATS_OP(ctx,start,padding+tensor->bsize,writes,bytes_written,write_ns);
+
+    if (fl != -1) {
+        int saved_errno = errno;
+        fcntl(ctx->fd,F_SETFL,fl);
+        errno = saved_errno;
+    }
+    if (!retval) return 0;
+
+    if (ctx->flags & GGUF_BUFFERED) {
+        ctx->size += padding+tensor->bsize;
+        return 1;
+    }
+    return gguf_remap(ctx);
+}
+
+/* ============================= Tensors pipeline =========================== */
+
+/* gguf_pipeline_run() processes a list of tensors in three stages, each
+ * working on a different tensor at the same time: a reader thread loads
+ * the source data of tensor N+1, the caller thread transforms tensor N,
+ * and a writer thread writes tensor N-1 with pwrite() at its output
+ * offset, that is known in advance (the tensors info are already
+ * written), so writes don't depend on the file position.
+ *
+ * Tensors are assigned in turn to GGUF_PIPELINE_SLOTS slots, each with
+ * a scratch arena for the source and destination buffers: a tensor
+ * enters the pipeline only when its slot is free and the bytes of the
+ * tensors in flight fit the budget, so both the queues and the memory
+ * used are bounded, and after the first tensors the same mappings are
+ * reused for the whole run. */
+#define GGUF_PIPELINE_SLOTS 4
+#define GGUF_PIPELINE_BUDGET (512*1024*1024) // Default in-flight budget.
+
+struct gguf_pipeline {
+    gguf_ctx *in, *out;
+    gguf_pipeline_tensor *tensors;
+    uint64_t count;
+    gguf_transform_func transform;
+    void *privdata;
+    uint64_t budget;            // Max bytes in flight, see above.
+    int backend;                // GGUF_STREAM_* backend for the reads.
+    int fd;                     // pread backends file descriptor.
+    uint64_t data_off;          // Output data section offset.
+    gguf_arena *arenas[GGUF_PIPELINE_SLOTS];
+    gguf_tensor *views;         // Source tensors with data in memory.
+    uint8_t **dst;              // Destination buffers.
+    uint64_t inflight;          // Bytes of the tensors in flight.
+    uint64_t admitted, read, transformed, written; // Tensors done by stage.
+    int err;                    // errno of the first error, or 0.
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/* Bytes of memory used by a tensor while in the pipeline. */
+static uint64_t gguf_pipeline_need(struct gguf_pipeline *p, uint64_t idx) {
+    gguf_pipeline_tensor *pt = p->tensors+idx;
+    if (pt->copy) return 0;
+    uint64_t src = p->backend == GGUF_STREAM_MMAP ? 0 :
+                   pt->src.bsize+GGUF_STREAM_ALIGN*3;
+    return src+pt->dst_size;
+}
+
+/* Set the pipeline error, if not already set, waking up all the stages. */
+static void gguf_pipeline_fail(struct gguf_pipeline *p, int err) {
+    pthread_mutex_lock(&p->lock);
+    if (p->err == 0) p->err = err ? err : EIO;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/* Mark one more tensor as done by a stage, releasing 'bytes' of the
+ * budget. */
+static void gguf_pipeline_done(struct gguf_pipeline *p, uint64_t *counter, uint64_t bytes) {
+    pthread_mutex_lock(&p->lock);
+    (*counter)++;
+    p->inflight -= bytes;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/* Wait until '*counter' is greater than 'idx'. Return 0 on error. */
+static int gguf_pipeline_wait(struct gguf_pipeline *p, uint64_t *counter, uint64_t idx) {
+    pthread_mutex_lock(&p->lock);
+    while (p->err == 0 && *counter <= idx)
+        pthread_cond_wait(&p->cond,&p->lock);
+    int ok = p->err == 0;
+    pthread_mutex_unlock(&p->lock);
+    return ok;
+}
+
+/* Reader stage: admit the tensors, then load them. With the mmap backend
+ * the pages are faulted in, so that the transform stage does not wait
+ * for the disk, otherwise the data is read in the slot arena. */
+static void *gguf_pipeline_reader(void *arg) {
+    struct gguf_pipeline *p = arg;
+    for (uint64_t j = 0; j < p->count; j++) {
+        gguf_pipeline_tensor *pt = p->tensors+j;
+        uint64_t need = gguf_pipeline_need(p,j);
+
+        pthread_mutex_lock(&p->lock);
+        while (p->err == 0 &&
+               (p->written+GGUF_PIPELINE_SLOTS <= j ||
+                (p->inflight && p->inflight+need > p->budget)))
+        {
+            pthread_cond_wait(&p->cond,&p->lock);
+        }
+        int err = p->err;
+        if (!err) {
+            p->inflight += need;
+            p->admitted++;
+        }
+        pthread_mutex_unlock(&p->lock);
+        if (err) break;
+
+        gguf_tensor *view = p->views+j;
+        *view = pt->src;
+        if (!pt->copy) {
+            gguf_arena *arena = p->arenas[j % GGUF_PIPELINE_SLOTS];
+            gguf_arena_reset(arena);
+            if (p->backend == GGUF_STREAM_MMAP) {
+                gguf_advise_tensor(p->in,view,GGUF_ADVICE_WILLNEED);
+                volatile uint8_t sum = 0;
+                for (uint64_t k = 0; k < view->bsize; k += 4096)
+                    sum += view->weights_data[k];
+                (void)sum;
+            } else {
+                /* O_DIRECT needs the buffer aligned to GGUF_STREAM_ALIGN,
+                 * while arena buffers are just GGUF_ARENA_ALIGN aligned. */
+                uint8_t *buf = gguf_arena_alloc(arena,
+                    view->bsize+GGUF_STREAM_ALIGN*3);
+                if (buf) buf += gguf_get_alignment_padding(GGUF_STREAM_ALIGN,
+                                                           (uintptr_t)buf);
+                if (buf) view->weights_data = gguf_read_aligned(p->in,p->fd,
+                    buf,view->offset,view->bsize);
+                if (buf == NULL || view->weights_data == NULL) {
+                    gguf_pipeline_fail(p,errno);
+                    break;
+                }
+            }
+            p->dst[j] = gguf_arena_alloc(arena,pt->dst_size);
+            if (p->dst[j] == NULL) {
+                gguf_pipeline_fail(p,errno ? errno : ENOMEM);
+                break;
+            }
+        }
+        gguf_pipeline_done(p,&p->read,0);
+    }
+    return NULL;
+}
+
+/* Writer stage: write every transformed tensor at its offset, or copy
+ * it from the input file with gguf_copy_range(). */
+static void *gguf_pipeline_writer(void *arg) {
+    struct gguf_pipeline *p = arg;
+    for (uint64_t j = 0; j < p->count; j++) {
+        if (!gguf_pipeline_wait(p,&p->transformed,j)) break;
+
+        gguf_pipeline_tensor *pt = p->tensors+j;
+        uint64_t off = p->data_off+pt->dst_offset;
+        uint64_t start = gguf_stats_now();
+        int retval;
+        if (pt->copy) {
+            retval = gguf_copy_range(p->out->fd,off,p->in->fd,pt->src.offset,
+                pt->src.bsize,pt->src.weights_data);
+        } else {
+            struct iovec iov = {p->dst[j], pt->dst_size};
+            retval = gguf_pwritev_all(p->out->fd,&iov,1,off);
+            if (p->backend == GGUF_STREAM_MMAP)
+                gguf_advise_tensor(p->in,&pt->src,GGUF_ADVICE_DONTNEED);
+        }
+        if (!retval) {
+            gguf_pipeline_fail(p,errno);
+            break;
+        }
+        uint64_t len = pt->copy ? pt->src.bsize : pt->dst_size;
+        GGUF_STATS_OP(p->out,start,len,writes,bytes_written,write_ns);
+        gguf_pipeline_done(p,&p->written,gguf_pipeline_need(p,j));
+    }
+    return NULL;
+}
+
+/* Write the data of 'count' tensors into the GGUF file 'out', reading
+ * them from 'in', in a three stages pipeline (see the top comment of
+ * this section), transforming them with the 'transform' callback:
+ *
+ *     int transform(void *privdata, uint64_t idx, gguf_tensor *src,
+ *                   void *dst);
+ *
+ * The callback receives the index of the tensor in the 'tensors' array,
+ * the source tensor 'src' with the data in memory, and 'dst', where it
+ * must write the dst_size bytes of output data. It is called in the
+ * thread calling this function, in order, and can use gguf_parallel()
+ * to split its work. It returns 1 on success, 0 on error (the pipeline
+ * is stopped and this function fails).
+ *
+ * For every tensor the caller fills a gguf_pipeline_tensor with the
+ * 'src' tensor of 'in' (from gguf_get_tensor() or gguf_find_tensor();
+ * a view of part of a tensor is fine), the 'dst_offset' relative to the
+ * data section, as passed to gguf_append_tensor_info(), and the output
+ * 'dst_size'. With 'copy' set the data is copied as it is instead, by
+ * the kernel when possible (see gguf_append_tensor_from()), and
+ * 'dst_size' is not used.
+ *
+ * The header and all the tensors info must already be appended to 'out'
+ * (with GGUF_BUFFERED they are written by this function), and no tensor
+ * data. The tensors can be in any order: the file is extended to the end
+ * of the last tensor of the data section, padding included.
+ *
+ * 'budget' is the max number of bytes of source and destination buffers
+ * in flight (0 for the default of 512MB): tensors bigger than the budget
+ * are processed alone. The source data is read with the 'backend' of the
+ * streaming reader (GGUF_STREAM_MMAP, PREAD or DIRECT). With 'flags' set
+ * to GGUF_ARENA_HUGEPAGES, the buffers are backed by huge pages.
+ *
+ * Return 1 on success, 0 on error with errno set. */
+int gguf_pipeline_run(gguf_ctx *out, gguf_ctx *in, gguf_pipeline_tensor *tensors, uint64_t count, gguf_transform_func transform, void *privdata, uint64_t budget, int backend, int flags) {
+    if ((out->flags & GGUF_BUFFERED) && gguf_write_staged(out) == 0)
+        return 0;
+    for (uint64_t j = 0; j < count; j++) {
+        gguf_tensor *src = &tensors[j].src;
+        if (src->offset+src->bsize > in->size ||
+            (!tensors[j].copy && transform == NULL))
+        {
+            errno = EINVAL;
+            return 0;
+        }
+    }
+
+    struct gguf_pipeline p;
+    memset(&p,0,sizeof(p));
+    p.in = in;
+    p.out = out;
+    p.tensors = tensors;
+    p.count = count;
+    p.transform = transform;
+    p.privdata = privdata;
+    p.budget = budget ? budget : GGUF_PIPELINE_BUDGET;
+    p.backend = backend;
+    p.fd = -1;
+    p.data_off = out->size + gguf_get_alignment_padding(out->alignment,out->size);
+    p.views = malloc(sizeof(gguf_tensor)*(count ? count : 1));
+    p.dst = calloc(count ? count : 1,sizeof(uint8_t*));
+    int ok = p.views && p.dst;
+    for (int j = 0; ok && j < GGUF_PIPELINE_SLOTS; j++)
+        ok = (p.arenas[j] = gguf_arena_new(0,flags)) != NULL;
+    if (ok && backend != GGUF_STREAM_MMAP)
+        ok = (p.fd = gguf_open_read_fd(in,backend)) != -1;
+
+    /* Non buffered contexts use O_APPEND, that is not compatible with
+     * writes at a given offset: disable it while we write. */
+    int fl = -1;
+    if (ok && !(out->flags & GGUF_BUFFERED)) {
+        fl = fcntl(out->fd,F_GETFL);
+        ok = fl != -1 && fcntl(out->fd,F_SETFL,fl & ~O_APPEND) != -1;
+    }
+    if (!ok) p.err = errno ? errno : ENOMEM;
+    pthread_mutex_init(&p.lock,NULL);
+    pthread_cond_init(&p.cond,NULL);
+
+    pthread_t reader, writer;
+    int started = 0;
+    if (p.err == 0) {
+        int err = pthread_create(&reader,NULL,gguf_pipeline_reader,&p);
+        if (!err) {
+            started++;
+            err = pthread_create(&writer,NULL,gguf_pipeline_writer,&p);
+        }
+        if (!err) started++;
+        else gguf_pipeline_fail(&p,err);
+    }
+
+    /* Transform stage, in the caller thread. */
+    for (uint64_t j = 0; started == 2 && j < count; j++) {
+        if (!gguf_pipeline_wait(&p,&p.read,j)) break;
+        gguf_pipeline_tensor *pt = tensors+j;
+        if (!pt->copy && transform(privdata,j,p.views+j,p.dst[j]) == 0) {
+            gguf_pipeline_fail(&p,errno);
+            break;
+        }
+        gguf_pipeline_done(&p,&p.transformed,0);
+    }
+    if (started >= 1) pthread_join(reader,NULL);
+    if (started == 2) pthread_join(writer,NULL);
+
+    /* Extend the file to the end of the data section: holes left by
+     * the alignment padding read as zeros. */
+    uint64_t end = p.data_off;
+    for (uint64_t j = 0; j < count; j++) {
+        uint64_t len = tensors[j].copy ? tensors[j].src.bsize :
+                                         tensors[j].dst_size;
+        if (p.data_off+tensors[j].dst_offset+len > end)
+            end = p.data_off+tensors[j].dst_offset+len;
+    }
+    if (p.err == 0 && ftruncate(out->fd,end) == -1) p.err = errno;
+    if (fl != -1) fcntl(out->fd,F_SETFL,fl);
+
+    for (int j = 0; j < GGUF_PIPELINE_SLOTS; j++)
+        if (p.arenas[j]) gguf_arena_free(p.arenas[j]);
+    if (p.fd != -1) close(p.fd);
+    free(p.views);
+    free(p.dst);
+    pthread_mutex_destroy(&p.lock);
+    pthread_cond_destroy(&p.cond);
+    if (p.err) {
+        errno = p.err;
+        return 0;
+    }
+
+    if (out->flags & GGUF_BUFFERED) {
+        out->size = end;
+        return 1;
+    }
+    return gguf_remap(out);
+}
+
+/* ============================= In-place editing =========================== */
+
+/* When the header of an existing file is edited, the space between the
+ * end of the tensors info and the start of the data section is taken
+ * by an uint8 array key-value pair with this name, so that the data
+ * section (and with it every tensor offset) stays where it is. The
+ * overhead is the key length and name, the value type, and the array
+ * items type and length. */
+#define GGUF_PADDING_KEY "gguflib.padding"
+#define GGUF_PADDING_OVERHEAD (8+sizeof(GGUF_PADDING_KEY)-1+4+4+8)
+
+/* When the header no longer fits before the data section, the data is
+ * moved forward by at least this amount of bytes, so that further edits
+ * will likely fit without moving it again. */
+#define GGUF_EDIT_SLACK (64*1024)
+
+static uint64_t gguf_gcd(uint64_t a, uint64_t b) {
+    while (b) {
+        uint64_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/* Insert 'len' bytes in the file 'fd' of 'size' bytes, so that the data
+ * at 'off' and after moves to 'off'+'len'. On Linux we first try
+ * FALLOC_FL_INSERT_RANGE, that just shifts the file extents (ext4 and XFS
+ * support it, if 'off' and 'len' are multiples of the file system block
+ * size 'bs'). Otherwise the data is copied from the end of the file
+ * backward, so that the source is never overwritten before being read.
+ * The content of the inserted range is undefined.
+ *
+ * Return 1 on success, 0 on error. */
+static int gguf_insert_range(int fd, uint64_t off, uint64_t len, uint64_t size, uint64_t bs) {
+#if defined(__linux__) && defined(FALLOC_FL_INSERT_RANGE)
+    uint64_t aligned_off = off - off % bs;
+    if (len % bs == 0 &&
+        fallocate(fd,FALLOC_FL_INSERT_RANGE,aligned_off,len) == 0) return 1;
+#else
+    (void)bs;
+#endif
+    uint64_t bufsize = 8*1024*1024;
+    uint8_t *buf = malloc(bufsize);
+    if (buf == NULL) return 0;
+    uint64_t end = size;
+    while (end > off) {
+        uint64_t chunk = end-off < bufsize ? end-off : bufsize;
+        uint64_t start = end-chunk;
+        uint64_t done = 0;
+        while (done < chunk) {
+            ssize_t nread = pread(fd,buf+done,chunk-done,start+done);
+            if (nread <= 0) {
+                if (nread == -1 && errno == EINTR) continue;
+                if (nread == 0) errno = EIO;
+                free(buf);
+                return 0;
+            }
+            done += nread;
+        }
+        struct iovec iov = {buf, chunk};
+        if (gguf_pwritev_all(fd,&iov,1,start+len) == 0) {
+            free(buf);
+            return 0;
+        }
+        end = start;
+    }
+    free(buf);
+    return 1;
+}
+
+/* Return the length of the key-value pair number 'j' of the header
+ * cache 'hc' with 'num_kv' pairs. */
+static uint64_t gguf_cached_kv_len(gguf_header_cache *hc, uint64_t num_kv, uint64_t j) {
+    uint64_t end = j+1 < num_kv ? hc->kv_off[j+1] : hc->tensors_info_off;
+    return end - hc->kv_off[j];
+}
+
+/* Serialize a key-value pair at 'p', returning the pointer to the
+ * first byte after it. */
+static uint8_t *gguf_put_kv(uint8_t *p, const char *keyname, uint64_t keylen, uint32_t type, const void *val, uint64_t len) {
+    memcpy(p,&keylen,sizeof(keylen)); p += sizeof(keylen);
+    memcpy(p,keyname,keylen); p += keylen;
+    memcpy(p,&type,sizeof(type)); p += sizeof(type);
+    memcpy(p,val,len); p += len;
+    return p;
+}
+
+/* Implement gguf_set_kv() and gguf_del_kv(): 'val' is NULL to remove
+ * the key. */
+static int gguf_edit_kv(gguf_ctx *ctx, const char *keyname, uint64_t keylen, uint32_t type, void *val, uint64_t len) {
+    /* Changing the alignment would require to move every tensor. */
+    if ((ctx->flags & (GGUF_RDONLY|GGUF_BUFFERED)) ||
+        (keylen == strlen("general.alignment") &&
+         memcmp(keyname,"general.alignment",keylen) == 0) ||
+        (keylen == strlen(GGUF_PADDING_KEY) &&
+         memcmp(keyname,GGUF_PADDING_KEY,keylen) == 0))
+    {
+        errno = EINVAL;
+        return 0;
+    }
+    if (gguf_load_header(ctx) == 0) return 0;
+
+    gguf_header_cache *hc = ctx->hcache;
+    uint64_t num_kv = ctx->header->metadata_kv_count;
+    uint64_t count = ctx->header->tensor_count;
+    uint64_t info_start = hc->tensors_info_off, info_end = info_start;
+    if (count) {
+        gguf_tensor tensor;
+        info_end = gguf_get_cached_tensor(ctx,count-1,&tensor);
+    }
+    uint64_t data_off = ctx->data_off;
+
+    /* Compute the size of the new header without padding. */
+    uint64_t newlen = sizeof(struct gguf_header) + (info_end - info_start);
+    uint64_t reclen = val ? 8+keylen+4+len : 0;
+    int found = 0;
+    for (uint64_t j = 0; j < num_kv; j++) {
+        struct gguf_string *name = (struct gguf_string*)(ctx->data+hc->kv_off[j]);
+        if (name->len == keylen && memcmp(name->string,keyname,keylen) == 0) {
+            found = 1;
+            newlen += reclen;
+        } else if (!(name->len == strlen(GGUF_PADDING_KEY) &&
+                   memcmp(name->string,GGUF_PADDING_KEY,name->len) == 0))
+        {
+            newlen += gguf_cached_kv_len(hc,num_kv,j);
+        }
+    }
+    if (!found && val == NULL) {
+        errno = ENOENT;
+        return 0;
+    }
+    if (!found) newlen += reclen;
+
+    /* Where the data section will start. Files without tensors just end
+     * after the header. Otherwise, if the header fits, the data stays
+     * where it is and the padding key takes the space left, unless the
+     * alignment padding is enough. If it does not fit, the data section
+     * is moved forward by a multiple of both the alignment and the file
+     * system block size. */
+    struct stat sb;
+    if (fstat(ctx->fd,&sb) == -1) return 0;
+    uint64_t bs = sb.st_blksize > 0 ? (uint64_t)sb.st_blksize : 4096;
+    uint64_t new_data_off = newlen, padlen = 0;
+    if (count) {
+        new_data_off = data_off;
+        if (newlen + gguf_get_alignment_padding(ctx->alignment,newlen) != data_off) {
+            if (newlen + GGUF_PADDING_OVERHEAD > data_off) {
+                uint64_t unit = bs / gguf_gcd(bs,ctx->alignment) * ctx->alignment;
+                uint64_t grow = newlen + GGUF_PADDING_OVERHEAD + GGUF_EDIT_SLACK - data_off;
+                new_data_off += grow + gguf_get_alignment_padding(unit,grow);
+            }
+            padlen = new_data_off - newlen;
+        }
+    }
+
+    /* Build the new header. */
+    uint8_t *buf = malloc(newlen + padlen);
+    if (buf == NULL) return 0;
+    struct gguf_header hdr = *ctx->header;
+    hdr.metadata_kv_count = 0;
+    uint8_t *p = buf + sizeof(hdr);
+    for (uint64_t j = 0; j < num_kv; j++) {
+        struct gguf_string *name = (struct gguf_string*)(ctx->data+hc->kv_off[j]);
+        if (name->len == keylen && memcmp(name->string,keyname,keylen) == 0) {
+            if (val == NULL) continue;
+            p = gguf_put_kv(p,keyname,keylen,type,val,len);
+        } else if (name->len == strlen(GGUF_PADDING_KEY) &&
+                   memcmp(name->string,GGUF_PADDING_KEY,name->len) == 0)
+        {
+            continue;
+        } else {
+            uint64_t kvlen = gguf_cached_kv_len(hc,num_kv,j);
+            memcpy(p,ctx->data+hc->kv_off[j],kvlen);
+            p += kvlen;
+        }
+        hdr.metadata_kv_count++;
+    }
+    if (!found) {
+        p = gguf_put_kv(p,keyname,keylen,type,val,len);
+        hdr.metadata_kv_count++;
+    }
+    if (padlen) {
+        struct {
+            uint32_t type;
+            uint64_t len;
+        } __attribute__((packed)) arr = {
+            GGUF_VALUE_TYPE_UINT8, padlen - GGUF_PADDING_OVERHEAD
+        };
+        p = gguf_put_kv(p,GGUF_PADDING_KEY,strlen(GGUF_PADDING_KEY),
+                        GGUF_VALUE_TYPE_ARRAY,&arr,sizeof(arr));
+        memset(p,0,arr.len);
+        p += arr.len;
+        hdr.metadata_kv_count++;
+    }
+    memcpy(buf,&hdr,sizeof(hdr));
+    memcpy(p,ctx->data+info_start,info_end-info_start);
+    p += info_end-info_start;
+    assert((uint64_t)(p-buf) == newlen+padlen);
+
+    /* Write it. The file is opened with O_APPEND, that is not compatible
+     * with writes at a given offset: disable it while we write. */
+    int fl = fcntl(ctx->fd,F_GETFL);
+    if (fl == -1 || fcntl(ctx->fd,F_SETFL,fl & ~O_APPEND) == -1) {
+        free(buf);
+        return 0;
+    }
+    uint64_t start = gguf_stats_now();
+    struct iovec iov = {buf, newlen+padlen};
+    int retval = 1;
+    if (new_data_off > data_off)
+        retval = gguf_insert_range(ctx->fd,data_off,new_data_off-data_off,
+                                   ctx->size,bs);
+    if (retval) retval = gguf_pwritev_all(ctx->fd,&iov,1,0);
+    if (retval && count == 0 && newlen < ctx->size)
+        retval = ftruncate(ctx->fd,newlen) == 0;
+    if (retval)
+        GGUF_STATS_OP(ctx,start,newlen+padlen,writes,bytes_written,write_ns);
+    int saved_errno = errno;
+    fcntl(ctx->fd,F_SETFL,fl);
+    free(buf);
+    errno = saved_errno;
+    if (!retval) return 0;
+
+    ctx->data_off = 0;
+    if (gguf_remap(ctx) == 0) return 0;
+    gguf_rewind(ctx);
+    return 1;
+}
+
+/* Set the key 'keyname' of an existing GGUF file to the value 'val' of
+ * 'len' raw bytes of the specified type (see gguf_append_kv()). If the
+ * key does not exist, it is added after the other key-value pairs.
+ *
+ * Only the header is rewritten: the tensors info is copied as it is
+ * and the data section is not touched if the new header fits in the
+ * space before it. To make this possible, any space left is filled by
+ * the GGUF_PADDING_KEY key. When the header no longer fits, the data
+ * section is moved forward (in constant time, on file systems supporting
+ * FALLOC_FL_INSERT_RANGE), reserving some space for future edits. Tensor
+ * offsets are relative to the data section, so they remain valid.
+ *
+ * The file is modified in place: if the process is interrupted while
+ * the data is moved, the file may be left corrupted. The context
+ * must not be read-only nor buffered, and the 'general.alignment' key
+ * can't be changed (errno is set to EINVAL).
+ *
+ * On success 1 is returned and the context is rewinded, otherwise 0. */
+int gguf_set_kv(gguf_ctx *ctx, const char *keyname, uint64_t keylen, uint32_t type, void *val, uint64_t len) {
+    return gguf_edit_kv(ctx,keyname,keylen,type,val,len);
+}
+
+/* Remove the key 'keyname' from an existing GGUF file, with the same
+ * in-place strategy of gguf_set_kv(). If the key does not exist, 0 is
+ * returned and errno is set to ENOENT. */
+int gguf_del_kv(gguf_ctx *ctx, const char *keyname, uint64_t keylen) {
+    return gguf_edit_kv(ctx,keyname,keylen,0,NULL,0);
+}
+
+/* ============================ GGUF dequantization ========================= */
+
+/* All the quantized formats are dequantized one block at a time by a
+ * block decoder: a function that gets a pointer to a block and
+ * converts it into items_per_block floats. For every format there is
+ * a scalar decoder, that is the reference implementation (and the
+ * documentation of the format), and, when the CPU supports it, a
+ * vectorized one producing the same output. The decoder to use is
+ * selected at runtime, see gguf_select_kernels().
+ *
+ * The non quantized F32, F16 and BF16 formats are handled in the same
+ * way, as blocks of 32 weights. */
+typedef void (*block_decoder)(const uint8_t *block, float *dst);
+
+/* Q8_0 block decoder. */
+static void gguf_q8_0_block_scalar(const uint8_t *block, float *dst) {
+    /* Very simple layout: |16 bit scale|32 x 8bit weights|
+     * Each weight is scale * quantized_weight[0..31] */
+    float scale = from_half(*((uint16_t*)block));
+    const int8_t *q = (const int8_t*)(block+2); // Skip the scale bytes.
+    for (uint32_t j = 0; j < 32; j++)
+        dst[j] = q[j] * scale;
+}
+
+/* Extract the 8 scales/mins pairs, 6 bits each, of Q4_K and Q5_K
+ * blocks, from the 12 bytes at 's' (see gguf_q4_k_block_scalar() for the
+ * encoding), multiplying them by the super-block scales. */
+static inline void gguf_k4_scales_mins(const uint8_t *s, float scales_scale,
+                    float mins_scale, float *scales, float *mins)
+{
+    for (int j = 0; j < 8; j++) {
+        uint8_t d,m;
+        if (j < 4) {
+            d = s[j] & 63;
+            m = s[j+4] & 63;
+        } else {
+            d = (s[j+4] & 0xF) | ((s[j-4] >> 6) << 4);
+            m = (s[j+4] >> 4) | ((s[j-0] >> 6) << 4);
+        }
+        scales[j] = d * scales_scale;
+        mins[j] = m * mins_scale;
+    }
+}
+
+/* Q4_K block decoder. */
+static void gguf_q4_k_block_scalar(const uint8_t *block, float *dst) {
+    /* Q4_K super-blocks have 256 total weights, split in 8 sub-block.
+     * Each 8 sub-blocks have a different set of scales/mins, so
+     * there are 16 total values for scales/mins, but the scales/mins
+     * are also quantized (6 bits each) using two different scales:
+     * scale_of_scales and scale_of_mins, that are two FP16 values
+     * at the start of the super block, so:
+     *
+     * |FP16 s_of_scales | +
+     * |FP16 s_of_mins   | +
+     * |16 6 bit integers d,m pairs, one per sub-block of 32 ele | +
+     * |256 x 4bit weights|
+     *
+     * Each quantized weight 'q' is restored as:
+     *
+     *      w = q * scale - min;
+     */
+    float scales_scale = from_half(*((uint16_t*)block));
+    float mins_scale  = from_half(*((uint16_t*)(block+2)));
+    block += 4;
+
+    /* Extract the 16 x 6 bit values scales-mins pairs. The
+     * encoding of those values is odd because of performance
+     * reasons:
+     *
+     *  dddddddd dddddddd dddddddd dddddddd mmmmmmmm mmmmmmmm
+     *  44000000|55111111|66222222|77333333|44000000|55111111
+     *
+     *  mmmmmmmm mmmmmmmm mmmmdddd mmmmdddd mmmmdddd mmmmdddd
+     *  66222222|77333333|44444444|55555555|66666666|77777777
+     *
+     * In the above diagram you can see the 12 bytes and the
+     * scales/mins 6 bits encodings. */
+
+    /* Scale scales/mins. */
+    float scales[8], mins[8];
+    gguf_k4_scales_mins(block,scales_scale,mins_scale,scales,mins);
+    block += 12; // Seek 4-bit weights start.
+
+    /* Finally we can extract the 256 weights.
+     * We process two blocks per time, because each
+     * 32 bytes have 64 weights stored like this:
+     * First 32 weights of the first block are the lower 4
+     * bits of each byte. Second 32 weights of the second
+     * block are higher 4 bits of each byte. */
+    for (uint32_t b = 0; b < 8; b += 2) {
+        /* First set: lower bits. */
+        for (uint32_t j = 0; j < 32; j++) {
+            uint8_t w = block[j] & 0xf;
+            *dst++ = w * scales[b] - mins[b];
+        }
+        /* Second set: higher bits. */
+        for (uint32_t j = 0; j < 32; j++) {
+            uint8_t w = block[j] >> 4;
+            *dst++ = w * scales[b+1] - mins[b+1];
+        }
+        block += 32; // Skip the two processed blocks.
+    }
+}
+
+/* Q6_K block decoder. */
+static void gguf_q6_k_block_scalar(const uint8_t *block, float *dst) {
+    /* Q6_K super-blocks have 256 total weights, split in 16 sub-block
+     * of 16 elements. There are no mins, just scales. Each sub-block
+     * have a block-specific scale quantized at 8 bits via a single
+     * 16-bit main scale-of-scales.
+     *
+     * |128 bytes of lower 4 bits of quants| +
+     * |64 bytes of lower 2 bits of quants| +
+     * |16 bytes of 8-bit block scales | +
+     * |A single FP16 value: the scale of the scales above |
+     *
+     * Let's call "L" the lower 4 bits array (128 bytes)
+     * and "H" the higher 2 bits array (64 bytes)
+     *
+     * Values are logically encoded in two 128 weights clusters
+     * where the first cluster is the first 64 bytes of "L" and
+     * the first 32 bytes of "H".
+     *
+     * Higher bits of the i-th weight from 0 to 63 are stored in the
+     * lower 4 bits of L[i], while higher bits of the i-th weight
+     * from 64 to 127 are stored in the higher bits of L[i-64]:
+     *
+     * L = |64640000|65650101|66660202|...
+     *
+     * So this actually is: w_low = (L[i%64] >> i/64*4) & 15
+     *
+     * H = |96643200|97653301|98663402|...
+     *
+     * Higher bits of the i-th weight are arranged like that:
+     *
+     * From 0 to 31,  bits 0,1 of H[i]
+     * From 32 to 63, bits 3,2 of H[i-32]
+     * From 64 to 95, bits 5,4 of H[i-64]
+     * From 96 to 127, bits 7,6 of H[i-96]
+     *
+     * So this actually is: w_high = ((H[i%32] >> i/32*2) & 3) << 2
+     * The same is true with the next 128 weights cluster, but
+     * everything is relative to the second half of H and L.
+     *
+     * Finally, there is to extract the scale from the
+     * 16 blocks scales array. Scales are just sequential,
+     * so the i-th weight uses the scale[i/16].
+     *
+     * Important: In Q6_K the 6-bit quants are wisely stored
+     * as unsigned integers + 32, so that there is no need to
+     * do sign bit extension in order to convert the 6-bit value
+     * into 8 bit value. Instead the values from -32 to 31 are
+     * remapped in the 0-63 range (just adding 32).
+     */
+    float super_scale = from_half(*((uint16_t*)(block+128+64+16)));
+    const uint8_t *L = block;
+    const uint8_t *H = block+128;
+    const int8_t *scales = (const int8_t*)block+128+64;
+    for (int cluster = 0; cluster < 2; cluster++) {
+        for (uint64_t j = 0; j < 128; j++) {
+            *dst++ =
+                  (super_scale * scales[j/16]) *
+                   ((int8_t)
+                    ((((L[j%64] >> (j/64*4)) & 0xF) |
+                     (((H[j%32] >> (j/32*2)) & 3) << 4)))-32);
+        }
+        L += 64;
+        H += 32;
+        scales += 8;
+    }
+}
+
+/* Q2_K block decoder. */
+static void gguf_q2_k_block_scalar(const uint8_t *block, float *dst) {
+    /* Q2_K superblocks of 256 weights:
+     * | 16 bytes of 16 scales, 16 mins quantized at 4 bits       | +
+     * | 64 bytes of 2-bit 256 quants (16 elements x 16 blocks)  | +
+     * | 2 bytes F16 scale of scales                              | +
+     * | 2 bytes F16 scale of mins                                |
+     *
+     * Weights are organized as follows:
+     *
+     *                               |76543210| (bit number)
+     * 16 bytes scales/mins are just |min scal| x 16, from block
+     * 0 to 15, sequentially.
+     *
+     * 64 bytes of 2 bits quants are stored like that:
+     * Weights from 0 to 31: bits 1,0 of bytes 0-31 (block 0, 1)
+     * Weights from 32 to 63: bits 3,2 of bytes 0-31 (block 2, 3)
+     * Weights from 64 to 95: bits 5,4 of bytes 0-31 (block 4, 5)
+     * Weights from 96 to 127: bits 7,6 of bytes 0-31 (block 6, 7)
+     *
+     * The same happens for the next 8 blocks, stored in the remaining
+     * 32 bytes.
+     *
+     * The final weight is computed as: w = q2 * block_scale - block_min.
+     *
+     * Since in this code we want to be simple more than fast (the
+     * vectorized decoders are there for speed), the i-th weight can be
+     * found (considering we have two clusters of 128 weights each):
+     *
+     * cluster = i/128 # Cluster 0 or 1
+     * byte = i % 32
+     * shift = i / 32 * 2
+     * w[i] = (quants[byte + (cluster*32)] >> shift) & 3
+     */
+    float scale_of_scales = from_half(*((uint16_t*)(block+16+64)));
+    float scale_of_mins = from_half(*((uint16_t*)(block+16+64+2)));
+
+    float scale = 0, min = 0;
+    int bn = 0; // Block number
+    for (uint64_t cluster = 0; cluster < 2; cluster++) {
+        for (uint64_t j = 0; j < 128; j++) {
+            /* Use new scale/min for each 16 weights sub-block. */
+            if (j % 16 == 0) {
+                scale = scale_of_scales * (block[bn] & 0xf);
+                min = scale_of_mins * (block[bn] >> 4);
+                bn++;
+            }
+            uint8_t q = (block[16+j%32+cluster*32] >> (j/32*2)) & 3;
+            *dst++ = q * scale - min;
+        }
+    }
+}
+
+/* Q4_0 block decoder. */
+static void gguf_q4_0_block_scalar(const uint8_t *block, float *dst) {
+    /* Very simple layout: |16 bit scale|32 x 4bit weights|
+     * Each weight is scale * (quantized_weight[0..31] - 8) */
+    float scale = from_half(*((uint16_t*)block));
+    const uint8_t *q = block+2; // Skip the scale bytes.
+    /* First 16 weights are in the lower bits, the last 16 weights
+     * are in the higher bits. */
+    for (uint32_t j = 0; j < 16; j++) {
+        dst[j] = ((int8_t)(q[j] & 0xf) - 8) * scale;
+        dst[j+16] = ((int8_t)(q[j] >> 4) - 8) * scale;
+    }
+}
+
+/* Q4_1 block decoder. */
+static void gguf_q4_1_block_scalar(const uint8_t *block, float *dst) {
+    /* Very simple layout: |16 bit scale|16 bit bias|32 x 4bit weights|
+     * Each weight is scale * quantized_weight[0..31] + bias */
+    float scale = from_half(*((uint16_t*)block));
+    float bias = from_half(*((uint16_t*)block+1));
+    const uint8_t *q = block+4; // Skip the scale and bias bytes.
+    /* First 16 weights are in the lower bits, the last 16 weights
+     * are in the higher bits. */
+    for (uint32_t j = 0; j < 16; j++) {
+        dst[j] = (q[j] & 0xf) * scale + bias;
+        dst[j+16] = (q[j] >> 4) * scale + bias;
+    }
+}
+
+/* Q5_0 block decoder. */
+static void gguf_q5_0_block_scalar(const uint8_t *block, float *dst) {
+    /* Like Q4_0, with an additional 32 bit integer holding the fifth
+     * bit of each quant: |16 bit scale|32 bits of high bits|32 x 4bit|
+     * The high bit of the i-th weight is the bit i of the 32 bits
+     * integer, and the weight is scale * (quantized_weight[0..31] - 16) */
+    float scale = from_half(*((uint16_t*)block));
+    uint32_t qh;
+    memcpy(&qh,block+2,sizeof(qh));
+    const uint8_t *q = block+6; // Skip the scale and high bits.
+    for (uint32_t j = 0; j < 16; j++) {
+        uint8_t q0 = (q[j] & 0xf) | (((qh >> j) & 1) << 4);
+        uint8_t q1 = (q[j] >> 4) | (((qh >> (j+16)) & 1) << 4);
+        dst[j] = ((int8_t)q0 - 16) * scale;
+        dst[j+16] = ((int8_t)q1 - 16) * scale;
+    }
+}
+
+/* Q5_1 block decoder. */
+static void gguf_q5_1_block_scalar(const uint8_t *block, float *dst) {
+    /* Like Q4_1, with the high bits stored like in Q5_0:
+     * |16 bit scale|16 bit bias|32 bits of high bits|32 x 4bit weights|
+     * Each weight is scale * quantized_weight[0..31] + bias */
+    float scale = from_half(*((uint16_t*)block));
+    float bias = from_half(*((uint16_t*)block+1));
+    uint32_t qh;
+    memcpy(&qh,block+4,sizeof(qh));
+    const uint8_t *q = block+8; // Skip the scale, bias and high bits.
+    for (uint32_t j = 0; j < 16; j++) {
+        uint8_t q0 = (q[j] & 0xf) | (((qh >> j) & 1) << 4);
+        uint8_t q1 = (q[j] >> 4) | (((qh >> (j+16)) & 1) << 4);
+        dst[j] = q0 * scale + bias;
+        dst[j+16] = q1 * scale + bias;
+    }
+}
+
+/* Q3_K block decoder. */
+static void gguf_q3_k_block_scalar(const uint8_t *block, float *dst) {
+    /* Q3_K super-blocks have 256 weights, split in 16 sub-blocks of
+     * 16 weights, each with its own 6 bit scale:
+     *
+     * |32 bytes of high bits of quants| +
+     * |64 bytes of lower 2 bits of quants| +
+     * |12 bytes of 16 x 6 bit scales| +
+     * |FP16 super-block scale|
+     *
+     * The lower 2 bits are stored exactly like in Q2_K (two clusters
+     * of 128 weights), while the high bit of the i-th weight is the
+     * bit i/32 of hmask[i%32]. Quants are in the -4..3 range: when the
+     * high bit is set, the quant is just the lower 2 bits, otherwise
+     * 4 is subtracted.
+     *
+     * The scales are stored as unsigned values adding 32. The lower 4
+     * bits of the scales 0-7 are the lower 4 bits of bytes 0-7 and the
+     * lower 4 bits of the scales 8-15 are the higher 4 bits of the
+     * same bytes. The higher 2 bits of the j-th scale are the bits
+     * j/4*2 and j/4*2+1 of the byte 8+j%4.
+     *
+     * Each weight is: d * (scale[i/16]-32) * quant. */
+    const uint8_t *hmask = block;
+    const uint8_t *q = block+32;
+    const uint8_t *s = block+32+64;
+    float d = from_half(*((uint16_t*)(block+32+64+12)));
+
+    float scales[16];
+    for (int j = 0; j < 16; j++) {
+        int sc = (j < 8 ? s[j] & 0xf : s[j-8] >> 4) |
+                 (((s[8+j%4] >> (j/4*2)) & 3) << 4);
+        scales[j] = d * (sc-32);
+    }
+
+    for (uint32_t j = 0; j < 256; j++) {
+        int low = (q[j/128*32 + j%32] >> (j%128/32*2)) & 3;
+        int high = (hmask[j%32] >> (j/32)) & 1;
+        dst[j] = scales[j/16] * (int8_t)((low | (high << 2)) - 4);
+    }
+}
+
+/* Q5_K block decoder. */
+static void gguf_q5_k_block_scalar(const uint8_t *block, float *dst) {
+    /* Q5_K super-blocks are like Q4_K ones, with 32 additional bytes
+     * holding the fifth bit of each quant:
+     *
+     * |FP16 s_of_scales | +
+     * |FP16 s_of_mins   | +
+     * |16 6 bit integers d,m pairs, like in Q4_K | +
+     * |32 bytes of high bits of quants| +
+     * |256 x 4bit weights, like in Q4_K|
+     *
+     * The high bit of the i-th weight is the bit i/32 of qh[i%32], and
+     * each weight is restored as: w = q * scale - min; */
+    float scales_scale = from_half(*((uint16_t*)block));
+    float mins_scale  = from_half(*((uint16_t*)(block+2)));
+    float scales[8], mins[8];
+    gguf_k4_scales_mins(block+4,scales_scale,mins_scale,scales,mins);
+    const uint8_t *qh = block+16;
+    const uint8_t *q = block+48;
+
+    for (uint32_t b = 0; b < 8; b += 2) {
+        for (uint32_t j = 0; j < 32; j++) {
+            uint8_t w = (q[j] & 0xf) | (((qh[j] >> b) & 1) << 4);
+            *dst++ = w * scales[b] - mins[b];
+        }
+        for (uint32_t j = 0; j < 32; j++) {
+            uint8_t w = (q[j] >> 4) | (((qh[j] >> (b+1)) & 1) << 4);
+            *dst++ = w * scales[b+1] - mins[b+1];
+        }
+        q += 32;
+    }
+}
+
+/* Q8_K block decoder. */
+static void gguf_q8_k_block_scalar(const uint8_t *block, float *dst) {
+    /* |FP32 scale|256 x 8bit weights|16 x 16 bit sums of blocks of 16|
+     * The sums are only useful for dot products, not to dequantize. */
+    float scale;
+    memcpy(&scale,block,sizeof(scale));
+    const int8_t *q = (const int8_t*)(block+4);
+    for (uint32_t j = 0; j < 256; j++)
+        dst[j] = q[j] * scale;
+}
+
+/* Non linear mapping of the 4 bit quants of the IQ4 formats. */
+static const int8_t gguf_iq4_values[16] = {
+    -127, -104, -83, -65, -49, -35, -22, -10,
+    1, 13, 25, 38, 53, 69, 89, 113
+};
+
+/* IQ4_NL block decoder. */
+static void gguf_iq4_nl_block_scalar(const uint8_t *block, float *dst) {
+    /* Same layout as Q4_0: |16 bit scale|32 x 4bit quants|, but the
+     * quants are indexes of the non uniform gguf_iq4_values[] table.
+     * Each weight is scale * gguf_iq4_values[quant] */
+    float scale = from_half(*((uint16_t*)block));
+    const uint8_t *q = block+2;
+    for (uint32_t j = 0; j < 16; j++) {
+        dst[j] = scale * gguf_iq4_values[q[j] & 0xf];
+        dst[j+16] = scale * gguf_iq4_values[q[j] >> 4];
+    }
+}
+
+/* IQ4_XS block decoder. */
+static void gguf_iq4_xs_block_scalar(const uint8_t *block, float *dst) {
+    /* Super-blocks of 256 weights, in 8 IQ4_NL-alike sub-blocks of 32
+     * weights with 6 bit scales (stored adding 32):
+     *
+     * |FP16 super-block scale| +
+     * |16 bits: higher 2 bits of the 8 scales| +
+     * |4 bytes: lower 4 bits of the 8 scales| +
+     * |8 x 16 bytes of 4bit quants, laid out like IQ4_NL|
+     *
+     * Each weight is d * (scale-32) * gguf_iq4_values[quant] */
+    float d = from_half(*((uint16_t*)block));
+    uint16_t scales_h;
+    memcpy(&scales_h,block+2,sizeof(scales_h));
+    const uint8_t *scales_l = block+4;
+    const uint8_t *q = block+8;
+    for (int b = 0; b < 8; b++) {
+        int sc = ((scales_l[b/2] >> (b%2*4)) & 0xf) |
+                 (((scales_h >> (b*2)) & 3) << 4);
+        float scale = d * (sc-32);
+        for (uint32_t j = 0; j < 16; j++) {
+            dst[j] = scale * gguf_iq4_values[q[j] & 0xf];
+            dst[j+16] = scale * gguf_iq4_values[q[j] >> 4];
+        }
+        q += 16;
+        dst += 32;
+    }
+}
+
+/* F32, F16 and BF16 block decoders: 32 weights per block. */
+static void gguf_f32_block_scalar(const uint8_t *block, float *dst) {
+    memcpy(dst,block,sizeof(float)*32);
+}
+
+static void gguf_f16_block_scalar(const uint8_t *block, float *dst) {
+    const uint16_t *w16 = (const uint16_t*)block;
+    for (uint32_t j = 0; j < 32; j++) dst[j] = from_half(w16[j]);
+}
+
+static void gguf_bf16_block_scalar(const uint8_t *block, float *dst) {
+    const uint16_t *w16 = (const uint16_t*)block;
+    for (uint32_t j = 0; j < 32; j++) dst[j] = from_brain(w16[j]);
+}
+
+/* Store in 'scales' the effective scales of the sub-blocks of the
+ * block of the specified type at 'block', that is, for super-block
+ * formats, the sub-block scales multiplied by the scale of scales (the
+ * mins are not reported). These are the values the quantizer chose, so
+ * their distribution tells how well the format fits the weights.
+ * 'scales' must have space for GGUF_MAX_BLOCK_SCALES floats.
+ *
+ * Return the number of scales, or 0 for types without scales (the
+ * float formats) or not supported. */
+int gguf_block_scales(uint32_t type, const uint8_t *block, float *scales) {
+    float d, mins[8];
+    int sc;
+    switch(type) {
+    case GGUF_TYPE_Q8_0:
+    case GGUF_TYPE_Q4_0:
+    case GGUF_TYPE_Q4_1:
+    case GGUF_TYPE_Q5_0:
+    case GGUF_TYPE_Q5_1:
+    case GGUF_TYPE_IQ4_NL:
+        scales[0] = from_half(*((uint16_t*)block));
+        return 1;
+    case GGUF_TYPE_Q8_K:
+        memcpy(scales,block,sizeof(float));
+        return 1;
+    case GGUF_TYPE_Q2_K:
+        d = from_half(*((uint16_t*)(block+16+64)));
+        for (int j = 0; j < 16; j++) scales[j] = d * (block[j] & 0xf);
+        return 16;
+    case GGUF_TYPE_Q3_K: {
+        const uint8_t *s = block+32+64;
+        d = from_half(*((uint16_t*)(block+32+64+12)));
+        for (int j = 0; j < 16; j++) {
+            sc = (j < 8 ? s[j] & 0xf : s[j-8] >> 4) |
+                 (((s[8+j%4] >> (j/4*2)) & 3) << 4);
+            scales[j] = d * (sc-32);
+        }
+        return 16;
+    }
+    case GGUF_TYPE_Q4_K:
+    case GGUF_TYPE_Q5_K:
+        gguf_k4_scales_mins(block+4,from_half(*((uint16_t*)block)),
+                            from_half(*((uint16_t*)(block+2))),scales,mins);
+        return 8;
+    case GGUF_TYPE_Q6_K:
+        d = from_half(*((uint16_t*)(block+128+64+16)));
+        for (int j = 0; j < 16; j++)
+            scales[j] = d * ((const int8_t*)(block+128+64))[j];
+        return 16;
+    case GGUF_TYPE_IQ4_XS: {
+        uint16_t scales_h;
+        d = from_half(*((uint16_t*)block));
+        memcpy(&scales_h,block+2,sizeof(scales_h));
+        for (int b = 0; b < 8; b++) {
+            sc = ((block[4+b/2] >> (b%2*4)) & 0xf) |
+                 (((scales_h >> (b*2)) & 3) << 4);
+            scales[b] = d * (sc-32);
+        }
+        return 8;
+    }
+    default:
+        return 0;
+    }
+}
+
+/* Once a block is decoded, if the output format is not F32, the block
+ * floats are converted to the target format by an output store
+ * function, that writes 'count' weights into 'dst'. */
+typedef void (*output_store)(uint16_t *dst, const float *src, uint64_t count);
+
+static void gguf_store_f16_scalar(uint16_t *dst, const float *src, uint64_t count) {
+    for (uint64_t j = 0; j < count; j++) dst[j] = to_half(src[j]);
+}
+
+static void gguf_store_bf16_scalar(uint16_t *dst, const float *src, uint64_t count) {
+    for (uint64_t j = 0; j < count; j++) dst[j] = to_brain(src[j]);
+}
+
+#if defined(__x86_64__) && !defined(GGUF_NO_SIMD)
+/* AVX2 block decoders and output stores. They are compiled regardless of
+ * the -march option, and are used only if the CPU supports AVX2, FMA
+ * and F16C.
+ * The math is performed exactly as in the scalar decoders (including
+ * the fused multiply-add the compiler uses for 'q*scale +/- min'),
+ * so that the output is the same. */
+#include <immintrin.h>
+#define GGUF_AVX2 __attribute__((target("avx2,fma,f16c")))
+
+/* Convert 32 unsigned bytes into 32 floats, in four registers. */
+GGUF_AVX2 static inline void gguf_avx2_u8_to_f32(__m256i q, __m256 f[4]) {
+    __m128i lo = _mm256_castsi256_si128(q);
+    __m128i hi = _mm256_extracti128_si256(q,1);
+    f[0] = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(lo));
+    f[1] = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(lo,8)));
+    f[2] = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(hi));
+    f[3] = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(hi,8)));
+}
+
+/* Store 32 weights computed as q*scale-min, where the first 16 weights
+ * use scale0/min0 and the last 16 weights scale1/min1. */
+GGUF_AVX2 static inline void gguf_avx2_store_fmsub(__m256i q, float scale0,
+                float min0, float scale1, float min1, float *dst)
+{
+    __m256 f[4];
+    gguf_avx2_u8_to_f32(q,f);
+    __m256 s0 = _mm256_set1_ps(scale0), m0 = _mm256_set1_ps(min0);
+    __m256 s1 = _mm256_set1_ps(scale1), m1 = _mm256_set1_ps(min1);
+    _mm256_storeu_ps(dst,_mm256_fmsub_ps(f[0],s0,m0));
+    _mm256_storeu_ps(dst+8,_mm256_fmsub_ps(f[1],s0,m0));
+    _mm256_storeu_ps(dst+16,_mm256_fmsub_ps(f[2],s1,m1));
+    _mm256_storeu_ps(dst+24,_mm256_fmsub_ps(f[3],s1,m1));
+}
+
+/* Convert 32 signed bytes into 32 floats, in four registers. */
+GGUF_AVX2 static inline void gguf_avx2_i8_to_f32(__m256i q, __m256 f[4]) {
+    __m128i lo = _mm256_castsi256_si128(q);
+    __m128i hi = _mm256_extracti128_si256(q,1);
+    f[0] = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(lo));
+    f[1] = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_srli_si128(lo,8)));
+    f[2] = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(hi));
+    f[3] = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_srli_si128(hi,8)));
+}
+
+/* Store 32 weights computed as (q-bias)*scale, where the first 16 weights
+ * use scale0 and the last 16 weights scale1. */
+GGUF_AVX2 static inline void gguf_avx2_store_submul(__m256i q, float bias,
+                float scale0, float scale1, float *dst)
+{
+    __m256 f[4];
+    gguf_avx2_u8_to_f32(q,f);
+    __m256 b = _mm256_set1_ps(bias);
+    __m256 s0 = _mm256_set1_ps(scale0), s1 = _mm256_set1_ps(scale1);
+    _mm256_storeu_ps(dst,_mm256_mul_ps(_mm256_sub_ps(f[0],b),s0));
+    _mm256_storeu_ps(dst+8,_mm256_mul_ps(_mm256_sub_ps(f[1],b),s0));
+    _mm256_storeu_ps(dst+16,_mm256_mul_ps(_mm256_sub_ps(f[2],b),s1));
+    _mm256_storeu_ps(dst+24,_mm256_mul_ps(_mm256_sub_ps(f[3],b),s1));
+}
+
+/* Expand the 32 bits of 'bits' into 32 bytes: the i-th byte is 0xff
+ * if the i-th bit is set, otherwise 0. */
+GGUF_AVX2 static inline __m256i gguf_avx2_bits_to_bytes(uint32_t bits) {
+    __m256i shuf = _mm256_setr_epi8(0,0,0,0,0,0,0,0,1,1,1,1,1,1,1,1,
+                                    2,2,2,2,2,2,2,2,3,3,3,3,3,3,3,3);
+    __m256i bitmask = _mm256_set1_epi64x(0x8040201008040201);
+    __m256i v = _mm256_shuffle_epi8(_mm256_set1_epi32(bits),shuf);
+    return _mm256_cmpeq_epi8(_mm256_and_si256(v,bitmask),bitmask);
+}
+
+/* Load the 16 bytes of 4 bit quants used by Q4_0-alike blocks, returning
+ * the 32 quants in order: the lower bits first, then the higher bits. */
+GGUF_AVX2 static inline __m256i gguf_avx2_load_q4(const uint8_t *q) {
+    __m128i q8 = _mm_loadu_si128((const __m128i*)q);
+    __m128i mask = _mm_set1_epi8(0xf);
+    return _mm256_set_m128i(_mm_and_si128(_mm_srli_epi16(q8,4),mask),
+                            _mm_and_si128(q8,mask));
+}
+
+GGUF_AVX2 static void gguf_q8_0_block_avx2(const uint8_t *block, float *dst) {
+    __m256 scale = _mm256_set1_ps(from_half(*((uint16_t*)block)));
+    const int8_t *q = (const int8_t*)(block+2);
+    for (int j = 0; j < 32; j += 8) {
+        __m128i q8 = _mm_loadl_epi64((const __m128i*)(q+j));
+        __m256 w = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(q8));
+        _mm256_storeu_ps(dst+j,_mm256_mul_ps(w,scale));
+    }
+}
+
+GGUF_AVX2 static void gguf_q4_0_block_avx2(const uint8_t *block, float *dst) {
+    __m256 scale = _mm256_set1_ps(from_half(*((uint16_t*)block)));
+    __m256 eight = _mm256_set1_ps(8);
+    __m128i q = _mm_loadu_si128((const __m128i*)(block+2));
+    __m128i mask = _mm_set1_epi8(0xf);
+    __m256i q4 = _mm256_set_m128i(_mm_and_si128(_mm_srli_epi16(q,4),mask),
+                                  _mm_and_si128(q,mask));
+    __m256 f[4];
+    gguf_avx2_u8_to_f32(q4,f);
+    for (int j = 0; j < 4; j++)
+        _mm256_storeu_ps(dst+j*8,_mm256_mul_ps(_mm256_sub_ps(f[j],eight),scale));
+}
+
+GGUF_AVX2 static void gguf_q4_1_block_avx2(const uint8_t *block, float *dst) {
+    __m256 scale = _mm256_set1_ps(from_half(*((uint16_t*)block)));
+    __m256 bias = _mm256_set1_ps(from_half(*((uint16_t*)block+1)));
+    __m128i q = _mm_loadu_si128((const __m128i*)(block+4));
+    __m128i mask = _mm_set1_epi8(0xf);
+    __m256i q4 = _mm256_set_m128i(_mm_and_si128(_mm_srli_epi16(q,4),mask),
+                                  _mm_and_si128(q,mask));
+    __m256 f[4];
+    gguf_avx2_u8_to_f32(q4,f);
+    for (int j = 0; j < 4; j++)
+        _mm256_storeu_ps(dst+j*8,_mm256_fmadd_ps(f[j],scale,bias));
+}
+
+GGUF_AVX2 static void gguf_q4_k_block_avx2(const uint8_t *block, float *dst) {
+    float scales_scale = from_half(*((uint16_t*)block));
+    float mins_scale  = from_half(*((uint16_t*)(block+2)));
+    float scales[8], mins[8];
+    gguf_k4_scales_mins(block+4,scales_scale,mins_scale,scales,mins);
+
+    const uint8_t *q = block+16;
+    __m256i mask = _mm256_set1_epi8(0xf);
+    for (int b = 0; b < 8; b += 2) {
+        __m256i q8 = _mm256_loadu_si256((const __m256i*)q);
+        __m256i lo = _mm256_and_si256(q8,mask);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(q8,4),mask);
+        gguf_avx2_store_fmsub(lo,scales[b],mins[b],scales[b],mins[b],dst);
+        gguf_avx2_store_fmsub(hi,scales[b+1],mins[b+1],scales[b+1],mins[b+1],dst+32);
+        q += 32;
+        dst += 64;
+    }
+}
+
+GGUF_AVX2 static void gguf_q6_k_block_avx2(const uint8_t *block, float *dst) {
+    float super_scale = from_half(*((uint16_t*)(block+128+64+16)));
+    const uint8_t *L = block;
+    const uint8_t *H = block+128;
+    const int8_t *scales = (const int8_t*)block+128+64;
+    __m256i m4 = _mm256_set1_epi8(0xf);
+    __m256i m2 = _mm256_set1_epi8(3);
+    __m256 bias = _mm256_set1_ps(32);
+    for (int cluster = 0; cluster < 2; cluster++) {
+        __m256i l0 = _mm256_loadu_si256((const __m256i*)L);
+        __m256i l1 = _mm256_loadu_si256((const __m256i*)(L+32));
+        __m256i h = _mm256_loadu_si256((const __m256i*)H);
+
+        /* The four groups of 32 weights of the cluster, see the
+         * scalar decoder for the layout. */
+        __m256i q[4];
+        q[0] = _mm256_or_si256(_mm256_and_si256(l0,m4),
+               _mm256_slli_epi16(_mm256_and_si256(h,m2),4));
+        q[1] = _mm256_or_si256(_mm256_and_si256(l1,m4),
+               _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(h,2),m2),4));
+        q[2] = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(l0,4),m4),
+               _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(h,4),m2),4));
+        q[3] = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(l1,4),m4),
+               _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(h,6),m2),4));
+
+        for (int g = 0; g < 4; g++) {
+            __m256 f[4];
+            gguf_avx2_u8_to_f32(q[g],f);
+            __m256 d0 = _mm256_set1_ps(super_scale * scales[g*2]);
+            __m256 d1 = _mm256_set1_ps(super_scale * scales[g*2+1]);
+            _mm256_storeu_ps(dst,_mm256_mul_ps(d0,_mm256_sub_ps(f[0],bias)));
+            _mm256_storeu_ps(dst+8,_mm256_mul_ps(d0,_mm256_sub_ps(f[1],bias)));
+            _mm256_storeu_ps(dst+16,_mm256_mul_ps(d1,_mm256_sub_ps(f[2],bias)));
+            _mm256_storeu_ps(dst+24,_mm256_mul_ps(d1,_mm256_sub_ps(f[3],bias)));
+            dst += 32;
         }
-        /* Last 16 weights are in the higher bits */
-        for (uint32_t j = 0; j < 16; j++) {
-            uint8_t value = block[j+4]; // j+2 to skip the scale and bias bytes.
-            value >>= 4;  // higher bits
-            float weight = value * scale + bias;
-            if (store_callback)
-                store_callback(dst,i,weight);
-            else
-                f[i] = weight;
-            if (++i == count) break;
+        L += 64;
+        H += 32;
+        scales += 8;
+    }
+}
+
+GGUF_AVX2 static void gguf_q2_k_block_avx2(const uint8_t *block, float *dst) {
+    float scale_of_scales = from_half(*((uint16_t*)(block+16+64)));
+    float scale_of_mins = from_half(*((uint16_t*)(block+16+64+2)));
+    const uint8_t *sm = block; // Scales and mins.
+    __m256i mask = _mm256_set1_epi8(3);
+    for (int cluster = 0; cluster < 2; cluster++) {
+        __m256i q8 = _mm256_loadu_si256((const __m256i*)(block+16+cluster*32));
+        for (int shift = 0; shift < 8; shift += 2) {
+            __m256i q = _mm256_and_si256(_mm256_srli_epi16(q8,shift),mask);
+            gguf_avx2_store_fmsub(q,
+                scale_of_scales * (sm[0] & 0xf), scale_of_mins * (sm[0] >> 4),
+                scale_of_scales * (sm[1] & 0xf), scale_of_mins * (sm[1] >> 4),
+                dst);
+            sm += 2;
+            dst += 32;
         }
-        block += tf->bytes_per_block; // Go to the next block.
     }
 }
 
-/* FP16 blocks dequantization to floats.
- * 'y' is supposed to have enough space for 'count' weights. */
-static void gguf_f16_to_float(void *weights_data, void *dst, uint64_t count,
-                              store_float_callback store_callback) {
-    float *f = dst;
-    uint64_t i = 0; // i-th weight to dequantize.
-    uint16_t *w16 = weights_data;
-    while(i < count) {
-        float weight = from_half(w16[i]);
-        if (store_callback)
-            store_callback(dst,i,weight);
-        else
-            f[i] = weight;
-        i++;
-    }
-}
-
-/* BF16 blocks dequantization to floats.
- * 'y' is supposed to have enough space for 'count' weights. */
-static void gguf_bf16_to_float(void *weights_data, void *dst, uint64_t count,
-                               store_float_callback store_callback) {
-    float *f = dst;
-    uint64_t i = 0; // i-th weight to dequantize.
-    uint16_t *w16 = weights_data;
-    while(i < count) {
-        float weight = from_brain(w16[i]);
-        if (store_callback)
-            store_callback(dst,i,weight);
+GGUF_AVX2 static void gguf_q5_0_block_avx2(const uint8_t *block, float *dst) {
+    float scale = from_half(*((uint16_t*)block));
+    uint32_t qh;
+    memcpy(&qh,block+2,sizeof(qh));
+    __m256i high = _mm256_and_si256(gguf_avx2_bits_to_bytes(qh),
+                                    _mm256_set1_epi8(0x10));
+    __m256i q = _mm256_or_si256(gguf_avx2_load_q4(block+6),high);
+    gguf_avx2_store_submul(q,16,scale,scale,dst);
+}
+
+GGUF_AVX2 static void gguf_q5_1_block_avx2(const uint8_t *block, float *dst) {
+    __m256 scale = _mm256_set1_ps(from_half(*((uint16_t*)block)));
+    __m256 bias = _mm256_set1_ps(from_half(*((uint16_t*)block+1)));
+    uint32_t qh;
+    memcpy(&qh,block+4,sizeof(qh));
+    __m256i high = _mm256_and_si256(gguf_avx2_bits_to_bytes(qh),
+                                    _mm256_set1_epi8(0x10));
+    __m256i q = _mm256_or_si256(gguf_avx2_load_q4(block+8),high);
+    __m256 f[4];
+    gguf_avx2_u8_to_f32(q,f);
+    for (int j = 0; j < 4; j++)
+        _mm256_storeu_ps(dst+j*8,_mm256_fmadd_ps(f[j],scale,bias));
+}
+
+GGUF_AVX2 static void gguf_q3_k_block_avx2(const uint8_t *block, float *dst) {
+    const uint8_t *s = block+32+64;
+    float d = from_half(*((uint16_t*)(block+32+64+12)));
+    float scales[16];
+    for (int j = 0; j < 16; j++) {
+        int sc = (j < 8 ? s[j] & 0xf : s[j-8] >> 4) |
+                 (((s[8+j%4] >> (j/4*2)) & 3) << 4);
+        scales[j] = d * (sc-32);
+    }
+
+    __m256i hmask = _mm256_loadu_si256((const __m256i*)block);
+    __m256i m2 = _mm256_set1_epi8(3);
+    __m256i m1 = _mm256_set1_epi8(1);
+    int g = 0; // Group of 32 weights, from 0 to 7.
+    for (int cluster = 0; cluster < 2; cluster++) {
+        __m256i q8 = _mm256_loadu_si256((const __m256i*)(block+32+cluster*32));
+        for (int shift = 0; shift < 8; shift += 2) {
+            __m256i low = _mm256_and_si256(_mm256_srli_epi16(q8,shift),m2);
+            __m256i high = _mm256_and_si256(_mm256_srli_epi16(hmask,g),m1);
+            __m256i q = _mm256_or_si256(low,_mm256_slli_epi16(high,2));
+            gguf_avx2_store_submul(q,4,scales[g*2],scales[g*2+1],dst);
+            dst += 32;
+            g++;
+        }
+    }
+}
+
+GGUF_AVX2 static void gguf_q5_k_block_avx2(const uint8_t *block, float *dst) {
+    float scales_scale = from_half(*((uint16_t*)block));
+    float mins_scale  = from_half(*((uint16_t*)(block+2)));
+    float scales[8], mins[8];
+    gguf_k4_scales_mins(block+4,scales_scale,mins_scale,scales,mins);
+
+    __m256i qh = _mm256_loadu_si256((const __m256i*)(block+16));
+    const uint8_t *q = block+48;
+    __m256i m4 = _mm256_set1_epi8(0xf);
+    __m256i m1 = _mm256_set1_epi8(1);
+    for (int b = 0; b < 8; b += 2) {
+        __m256i q8 = _mm256_loadu_si256((const __m256i*)q);
+        __m256i hlo = _mm256_and_si256(_mm256_srli_epi16(qh,b),m1);
+        __m256i hhi = _mm256_and_si256(_mm256_srli_epi16(qh,b+1),m1);
+        __m256i lo = _mm256_or_si256(_mm256_and_si256(q8,m4),
+                                     _mm256_slli_epi16(hlo,4));
+        __m256i hi = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(q8,4),m4),
+                                     _mm256_slli_epi16(hhi,4));
+        gguf_avx2_store_fmsub(lo,scales[b],mins[b],scales[b],mins[b],dst);
+        gguf_avx2_store_fmsub(hi,scales[b+1],mins[b+1],scales[b+1],mins[b+1],dst+32);
+        q += 32;
+        dst += 64;
+    }
+}
+
+GGUF_AVX2 static void gguf_q8_k_block_avx2(const uint8_t *block, float *dst) {
+    float s;
+    memcpy(&s,block,sizeof(s));
+    __m256 scale = _mm256_set1_ps(s);
+    const int8_t *q = (const int8_t*)(block+4);
+    for (int j = 0; j < 256; j += 8) {
+        __m128i q8 = _mm_loadl_epi64((const __m128i*)(q+j));
+        __m256 w = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(q8));
+        _mm256_storeu_ps(dst+j,_mm256_mul_ps(w,scale));
+    }
+}
+
+/* Decode 16 bytes of IQ4 quants into 32 weights: the quants are used
+ * as indexes of the values table with a byte shuffle. */
+GGUF_AVX2 static inline void gguf_avx2_iq4_store(const uint8_t *q, float scale, float *dst) {
+    __m256i values = _mm256_broadcastsi128_si256(
+                        _mm_loadu_si128((const __m128i*)gguf_iq4_values));
+    __m256i w = _mm256_shuffle_epi8(values,gguf_avx2_load_q4(q));
+    __m256 f[4];
+    gguf_avx2_i8_to_f32(w,f);
+    __m256 s = _mm256_set1_ps(scale);
+    for (int j = 0; j < 4; j++)
+        _mm256_storeu_ps(dst+j*8,_mm256_mul_ps(s,f[j]));
+}
+
+GGUF_AVX2 static void gguf_iq4_nl_block_avx2(const uint8_t *block, float *dst) {
+    gguf_avx2_iq4_store(block+2,from_half(*((uint16_t*)block)),dst);
+}
+
+GGUF_AVX2 static void gguf_iq4_xs_block_avx2(const uint8_t *block, float *dst) {
+    float d = from_half(*((uint16_t*)block));
+    uint16_t scales_h;
+    memcpy(&scales_h,block+2,sizeof(scales_h));
+    const uint8_t *scales_l = block+4;
+    for (int b = 0; b < 8; b++) {
+        int sc = ((scales_l[b/2] >> (b%2*4)) & 0xf) |
+                 (((scales_h >> (b*2)) & 3) << 4);
+        gguf_avx2_iq4_store(block+8+b*16,d * (sc-32),dst+b*32);
+    }
+}
+
+GGUF_AVX2 static void gguf_f16_block_avx2(const uint8_t *block, float *dst) {
+    for (int j = 0; j < 32; j += 8) {
+        __m128i h = _mm_loadu_si128((const __m128i*)(block+j*2));
+        _mm256_storeu_ps(dst+j,_mm256_cvtph_ps(h));
+    }
+}
+
+GGUF_AVX2 static void gguf_bf16_block_avx2(const uint8_t *block, float *dst) {
+    for (int j = 0; j < 32; j += 8) {
+        __m128i h = _mm_loadu_si128((const __m128i*)(block+j*2));
+        __m256i w = _mm256_slli_epi32(_mm256_cvtepu16_epi32(h),16);
+        _mm256_storeu_ps(dst+j,_mm256_castsi256_ps(w));
+    }
+}
+
+/* F16 store using the F16C conversion instruction, with the same
+ * round to nearest even of to_half(). */
+GGUF_AVX2 static void gguf_store_f16_f16c(uint16_t *dst, const float *src, uint64_t count) {
+    uint64_t j = 0, vcount = count & ~(uint64_t)7;
+    for (; j < vcount; j += 8) {
+        __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(src+j),_MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128((__m128i*)(dst+j),h);
+    }
+    for (; j < count; j++) dst[j] = to_half(src[j]);
+}
+
+/* BF16 store: the same rounding and NaN handling of to_brain(),
+ * performed on 8 floats at a time. */
+GGUF_AVX2 static void gguf_store_bf16_avx2(uint16_t *dst, const float *src, uint64_t count) {
+    __m256i one = _mm256_set1_epi32(1);
+    __m256i round = _mm256_set1_epi32(0x7fff);
+    __m256i abs_mask = _mm256_set1_epi32(0x7fffffff);
+    __m256i inf = _mm256_set1_epi32(0x7f800000);
+    __m256i quiet = _mm256_set1_epi32(64);
+    uint64_t j = 0, vcount = count & ~(uint64_t)7;
+    for (; j < vcount; j += 8) {
+        __m256i u = _mm256_castps_si256(_mm256_loadu_ps(src+j));
+        __m256i lsb = _mm256_and_si256(_mm256_srli_epi32(u,16),one);
+        __m256i rounded = _mm256_srli_epi32(
+            _mm256_add_epi32(u,_mm256_add_epi32(round,lsb)),16);
+        __m256i nan = _mm256_or_si256(_mm256_srli_epi32(u,16),quiet);
+        __m256i isnan = _mm256_cmpgt_epi32(_mm256_and_si256(u,abs_mask),inf);
+        __m256i b = _mm256_blendv_epi8(rounded,nan,isnan);
+        /* Pack the 8 x 32 bit values into 8 x 16 bit values. */
+        __m128i packed = _mm_packus_epi32(_mm256_castsi256_si128(b),
+                                          _mm256_extracti128_si256(b,1));
+        _mm_storeu_si128((__m128i*)(dst+j),packed);
+    }
+    for (; j < count; j++) dst[j] = to_brain(src[j]);
+}
+#endif
+
+/* Convert 'count' weights stored as blocks of 'items_per_block' weights /
+ * 'bytes_per_block' bytes, using the specified block decoder, into the
+ * 'dst_type' format (GGUF_TYPE_F32, F16 or BF16), with the output stores
+ * 'store_f16' and 'store_bf16'.
+ *
+ * This function is always inlined with constant arguments by the
+ * GGUF_CONVERT_FUNCS() macro, so that every format and kernel set gets
+ * a specialized version, where the decoder and the stores are direct
+ * calls the compiler can inline, and the loop on the full blocks has
+ * constant strides. For F32 output, full blocks are decoded straight
+ * into the destination array, otherwise blocks are decoded into a
+ * temporary buffer and stored in the target format one block at a time.
+ * The last partial block (if any) is handled apart, always using the
+ * temporary buffer. */
+static inline __attribute__((always_inline))
+void gguf_blocks_convert(block_decoder decode, output_store store_f16,
+    output_store store_bf16, uint32_t items_per_block,
+    uint32_t bytes_per_block, uint32_t dst_type, void *weights_data,
+    void *dst, uint64_t count)
+{
+    float buf[256]; // Enough for the biggest block we support.
+    const uint8_t *block = weights_data;
+    uint64_t nblocks = count / items_per_block;
+    uint64_t tail = count % items_per_block;
+
+    for (uint64_t b = 0; b < nblocks; b++) {
+        uint64_t i = b*items_per_block;
+        if (dst_type == GGUF_TYPE_F32) {
+            decode(block,(float*)dst+i);
+        } else {
+            decode(block,buf);
+            if (dst_type == GGUF_TYPE_F16)
+                store_f16((uint16_t*)dst+i,buf,items_per_block);
+            else
+                store_bf16((uint16_t*)dst+i,buf,items_per_block);
+        }
+        block += bytes_per_block;
+    }
+
+    if (tail) {
+        uint64_t i = nblocks*items_per_block;
+        if (bytes_per_block % items_per_block == 0) {
+            /* Formats with a whole number of bytes per weight (F32, F16
+             * and BF16) are plain arrays handled as 32 weights blocks:
+             * the data may end with the last requested weight (at the
+             * end of the tensor or of the file), so the partial block is
+             * copied into a zero padded block before decoding it. */
+            uint8_t partial[128];
+            uint64_t len = tail*(bytes_per_block/items_per_block);
+            memset(partial,0,sizeof(partial));
+            memcpy(partial,block,len);
+            decode(partial,buf);
+        } else {
+            decode(block,buf);
+        }
+        if (dst_type == GGUF_TYPE_F32)
+            memcpy((float*)dst+i,buf,tail*sizeof(float));
+        else if (dst_type == GGUF_TYPE_F16)
+            store_f16((uint16_t*)dst+i,buf,tail);
         else
-            f[i] = weight;
-        i++;
+            store_bf16((uint16_t*)dst+i,buf,tail);
+    }
+}
+
+/* Conversion functions of a format into F32, F16 and BF16 arrays. */
+typedef void (*dequant_func)(void *weights_data, void *dst, uint64_t count);
+struct gguf_converters {
+    dequant_func to_float, to_f16, to_bf16;
+};
+
+/* Define the converters of the format 'type' for the kernel set 'kernel',
+ * using the block 'decoder' and the output stores 'store_f16' and
+ * 'store_bf16': gguf_<type>_<kernel>_to_float() and so forth, compiled
+ * with the function attributes 'attr' (the target options of SIMD
+ * kernels). Adding a format just needs its block decoders, and a line
+ * for every kernel set below. */
+#define GGUF_CONVERT_FUNCS(type,kernel,attr,items_per_block,bytes_per_block,decoder,store_f16,store_bf16) \
+attr static void gguf_##type##_##kernel##_to_float(void *weights_data, void *dst, uint64_t count) { \
+    gguf_blocks_convert(decoder,store_f16,store_bf16,items_per_block, \
+                        bytes_per_block,GGUF_TYPE_F32,weights_data,dst,count); \
+} \
+attr static void gguf_##type##_##kernel##_to_f16(void *weights_data, void *dst, uint64_t count) { \
+    gguf_blocks_convert(decoder,store_f16,store_bf16,items_per_block, \
+                        bytes_per_block,GGUF_TYPE_F16,weights_data,dst,count); \
+} \
+attr static void gguf_##type##_##kernel##_to_bf16(void *weights_data, void *dst, uint64_t count) { \
+    gguf_blocks_convert(decoder,store_f16,store_bf16,items_per_block, \
+                        bytes_per_block,GGUF_TYPE_BF16,weights_data,dst,count); \
+}
+
+#define GGUF_SCALAR_FUNCS(type,items_per_block,bytes_per_block) \
+    GGUF_CONVERT_FUNCS(type,scalar,,items_per_block,bytes_per_block, \
+        gguf_##type##_block_scalar,gguf_store_f16_scalar, \
+        gguf_store_bf16_scalar)
+
+GGUF_SCALAR_FUNCS(f32,32,128)
+GGUF_SCALAR_FUNCS(f16,32,64)
+GGUF_SCALAR_FUNCS(bf16,32,64)
+GGUF_SCALAR_FUNCS(q8_0,32,34)
+GGUF_SCALAR_FUNCS(q4_0,32,18)
+GGUF_SCALAR_FUNCS(q4_1,32,20)
+GGUF_SCALAR_FUNCS(q5_0,32,22)
+GGUF_SCALAR_FUNCS(q5_1,32,24)
+GGUF_SCALAR_FUNCS(q8_k,256,292)
+GGUF_SCALAR_FUNCS(q2_k,256,84)
+GGUF_SCALAR_FUNCS(q3_k,256,110)
+GGUF_SCALAR_FUNCS(q4_k,256,144)
+GGUF_SCALAR_FUNCS(q5_k,256,176)
+GGUF_SCALAR_FUNCS(q6_k,256,210)
+GGUF_SCALAR_FUNCS(iq4_nl,32,18)
+GGUF_SCALAR_FUNCS(iq4_xs,256,136)
+
+#if defined(__x86_64__) && !defined(GGUF_NO_SIMD)
+#define GGUF_AVX2_FUNCS(type,items_per_block,bytes_per_block,decoder) \
+    GGUF_CONVERT_FUNCS(type,avx2,GGUF_AVX2,items_per_block,bytes_per_block, \
+        decoder,gguf_store_f16_f16c,gguf_store_bf16_avx2)
+
+GGUF_AVX2_FUNCS(f32,32,128,gguf_f32_block_scalar) // Just a memcpy().
+GGUF_AVX2_FUNCS(f16,32,64,gguf_f16_block_avx2)
+GGUF_AVX2_FUNCS(bf16,32,64,gguf_bf16_block_avx2)
+GGUF_AVX2_FUNCS(q8_0,32,34,gguf_q8_0_block_avx2)
+GGUF_AVX2_FUNCS(q4_0,32,18,gguf_q4_0_block_avx2)
+GGUF_AVX2_FUNCS(q4_1,32,20,gguf_q4_1_block_avx2)
+GGUF_AVX2_FUNCS(q5_0,32,22,gguf_q5_0_block_avx2)
+GGUF_AVX2_FUNCS(q5_1,32,24,gguf_q5_1_block_avx2)
+GGUF_AVX2_FUNCS(q8_k,256,292,gguf_q8_k_block_avx2)
+GGUF_AVX2_FUNCS(q2_k,256,84,gguf_q2_k_block_avx2)
+GGUF_AVX2_FUNCS(q3_k,256,110,gguf_q3_k_block_avx2)
+GGUF_AVX2_FUNCS(q4_k,256,144,gguf_q4_k_block_avx2)
+GGUF_AVX2_FUNCS(q5_k,256,176,gguf_q5_k_block_avx2)
+GGUF_AVX2_FUNCS(q6_k,256,210,gguf_q6_k_block_avx2)
+GGUF_AVX2_FUNCS(iq4_nl,32,18,gguf_iq4_nl_block_avx2)
+GGUF_AVX2_FUNCS(iq4_xs,256,136,gguf_iq4_xs_block_avx2)
+#endif
+
+/* Converters and output stores in use, set by gguf_select_kernels().
+ * The kernel set is selected once, so converting a range of weights
+ * costs a single indirect call, not one per block. */
+static struct {
+    struct gguf_converters f32, f16, bf16, q8_0, q4_0, q4_1, q5_0, q5_1,
+                           q8_k, q2_k, q3_k, q4_k, q5_k, q6_k, iq4_nl,
+                           iq4_xs;
+    output_store store_f16, store_bf16;
+    const char *name;
+} Kernels;
+
+static pthread_once_t gguf_kernels_once = PTHREAD_ONCE_INIT;
+
+#define GGUF_USE_KERNEL(type,kernel) \
+    Kernels.type = (struct gguf_converters){gguf_##type##_##kernel##_to_float, \
+        gguf_##type##_##kernel##_to_f16, gguf_##type##_##kernel##_to_bf16}
+
+/* Use the fastest kernels supported by this CPU. */
+static void gguf_select_kernels(void) {
+    GGUF_USE_KERNEL(f32,scalar);
+    GGUF_USE_KERNEL(f16,scalar);
+    GGUF_USE_KERNEL(bf16,scalar);
+    GGUF_USE_KERNEL(q8_0,scalar);
+    GGUF_USE_KERNEL(q4_0,scalar);
+    GGUF_USE_KERNEL(q4_1,scalar);
+    GGUF_USE_KERNEL(q5_0,scalar);
+    GGUF_USE_KERNEL(q5_1,scalar);
+    GGUF_USE_KERNEL(q8_k,scalar);
+    GGUF_USE_KERNEL(q2_k,scalar);
+    GGUF_USE_KERNEL(q3_k,scalar);
+    GGUF_USE_KERNEL(q4_k,scalar);
+    GGUF_USE_KERNEL(q5_k,scalar);
+    GGUF_USE_KERNEL(q6_k,scalar);
+    GGUF_USE_KERNEL(iq4_nl,scalar);
+    GGUF_USE_KERNEL(iq4_xs,scalar);
+    Kernels.store_f16 = gguf_store_f16_scalar;
+    Kernels.store_bf16 = gguf_store_bf16_scalar;
+    Kernels.name = "scalar";
+#if defined(__x86_64__) && !defined(GGUF_NO_SIMD)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") &&
+        __builtin_cpu_supports("f16c"))
+    {
+        GGUF_USE_KERNEL(f32,avx2);
+        GGUF_USE_KERNEL(f16,avx2);
+        GGUF_USE_KERNEL(bf16,avx2);
+        GGUF_USE_KERNEL(q8_0,avx2);
+        GGUF_USE_KERNEL(q4_0,avx2);
+        GGUF_USE_KERNEL(q4_1,avx2);
+        GGUF_USE_KERNEL(q5_0,avx2);
+        GGUF_USE_KERNEL(q5_1,avx2);
+        GGUF_USE_KERNEL(q8_k,avx2);
+        GGUF_USE_KERNEL(q2_k,avx2);
+        GGUF_USE_KERNEL(q3_k,avx2);
+        GGUF_USE_KERNEL(q4_k,avx2);
+        GGUF_USE_KERNEL(q5_k,avx2);
+        GGUF_USE_KERNEL(q6_k,avx2);
+        GGUF_USE_KERNEL(iq4_nl,avx2);
+        GGUF_USE_KERNEL(iq4_xs,avx2);
+        Kernels.store_f16 = gguf_store_f16_f16c;
+        Kernels.store_bf16 = gguf_store_bf16_avx2;
+        Kernels.name = "avx2";
+    }
+#endif
+}
+#undef GGUF_USE_KERNEL
+
+/* Return the name of the kernels used on this CPU: "scalar" or "avx2". */
+const char *gguf_kernels_name(void) {
+    pthread_once(&gguf_kernels_once,gguf_select_kernels);
+    return Kernels.name;
+}
+
+/* Define the functions converting 'count' weights of the specified
+ * format, starting from the block at 'weights_data', into F32, F16 and
+ * BF16 arrays: gguf_<type>_to_float(), gguf_<type>_to_f16() and
+ * gguf_<type>_to_bf16(), using the kernels selected for this CPU.
+ * 'dst' must have space for 'count' weights. */
+#define GGUF_DEQUANT_FUNCS(type) \
+void gguf_##type##_to_float(void *weights_data, void *dst, uint64_t count) { \
+    pthread_once(&gguf_kernels_once,gguf_select_kernels); \
+    Kernels.type.to_float(weights_data,dst,count); \
+} \
+void gguf_##type##_to_f16(void *weights_data, void *dst, uint64_t count) { \
+    pthread_once(&gguf_kernels_once,gguf_select_kernels); \
+    Kernels.type.to_f16(weights_data,dst,count); \
+} \
+void gguf_##type##_to_bf16(void *weights_data, void *dst, uint64_t count) { \
+    pthread_once(&gguf_kernels_once,gguf_select_kernels); \
+    Kernels.type.to_bf16(weights_data,dst,count); \
+}
+
+GGUF_DEQUANT_FUNCS(f32)
+GGUF_DEQUANT_FUNCS(f16)
+GGUF_DEQUANT_FUNCS(bf16)
+GGUF_DEQUANT_FUNCS(q8_0)
+GGUF_DEQUANT_FUNCS(q4_0)
+GGUF_DEQUANT_FUNCS(q4_1)
+GGUF_DEQUANT_FUNCS(q5_0)
+GGUF_DEQUANT_FUNCS(q5_1)
+GGUF_DEQUANT_FUNCS(q8_k)
+GGUF_DEQUANT_FUNCS(q2_k)
+GGUF_DEQUANT_FUNCS(q3_k)
+GGUF_DEQUANT_FUNCS(q4_k)
+GGUF_DEQUANT_FUNCS(q5_k)
+GGUF_DEQUANT_FUNCS(q6_k)
+GGUF_DEQUANT_FUNCS(iq4_nl)
+GGUF_DEQUANT_FUNCS(iq4_xs)
+
+/* =========================== Parallel execution =========================== */
+
+struct gguf_parallel_state {
+    void (*job)(void *privdata, uint64_t jobid);
+    void *privdata;
+    uint64_t numjobs;
+    uint64_t next;          // Next job to run, updated atomically.
+};
+
+/* Threads main loop: fetch the next job ID and run it, until there
+ * are jobs left. */
+static void *gguf_parallel_worker(void *arg) {
+    struct gguf_parallel_state *ps = arg;
+    while(1) {
+        uint64_t jobid = __atomic_fetch_add(&ps->next,1,__ATOMIC_RELAXED);
+        if (jobid >= ps->numjobs) break;
+        ps->job(ps->privdata,jobid);
+    }
+    return NULL;
+}
+
+/* Call job(privdata, jobid) for every jobid from 0 to numjobs-1, using
+ * up to 'nthreads' threads (the calling thread is one of them). Jobs are
+ * fetched dynamically by the threads, so jobs of different cost are
+ * balanced. The function returns only when all the jobs are done.
+ *
+ * If threads can't be created, the remaining work is performed by
+ * the calling thread, so the function never fails. */
+void gguf_parallel(int nthreads, uint64_t numjobs,
+                   void (*job)(void *privdata, uint64_t jobid), void *privdata)
+{
+    struct gguf_parallel_state ps = {job, privdata, numjobs, 0};
+    if ((uint64_t)nthreads > numjobs) nthreads = numjobs;
+
+    pthread_t *tids = NULL;
+    int started = 0;
+    if (nthreads > 1) tids = malloc(sizeof(pthread_t)*(nthreads-1));
+    if (tids) {
+        for (; started < nthreads-1; started++) {
+            if (pthread_create(tids+started,NULL,gguf_parallel_worker,&ps))
+                break;
+        }
+    }
+    gguf_parallel_worker(&ps);
+    for (int j = 0; j < started; j++) pthread_join(tids[j],NULL);
+    free(tids);
+}
+
+/* ============================== Scratch arena ============================= */
+
+/* A scratch arena is a set of memory mappings, the chunks, from which
+ * buffers are bump-allocated, and that are all released at once by
+ * gguf_arena_reset(). When a run of allocations needs more than one
+ * chunk, on reset the chunks are replaced by a single one as big as
+ * the high-water mark, so that after the first iterations every run
+ * (for instance converting a tensor) is served by the same mapping,
+ * without page faults, and without the mmap()/munmap() cycles (and TLB
+ * shootdowns) of malloc() with big sizes. */
+#define GGUF_ARENA_ALIGN 64                 // Alignment of the buffers.
+#define GGUF_HUGE_PAGE_SIZE (2*1024*1024)   // Alignment of big chunks.
+
+struct gguf_arena_chunk {
+    struct gguf_arena_chunk *next;  // Previous chunks, for the reset.
+    uint8_t *data;                  // Memory mapping.
+    uint64_t size, used;            // Usable and allocated bytes.
+    uint64_t map_size;              // Mapped bytes of 'data'.
+};
+
+struct gguf_arena {
+    struct gguf_arena_chunk *chunk; // Current chunk, or NULL.
+    uint64_t max_size;              // Max bytes mapped, 0 = no limit.
+    uint64_t mapped;                // Bytes currently mapped.
+    uint64_t used;                  // Bytes allocated since the reset.
+    uint64_t high_water;            // Max 'used' seen.
+    int flags;
+};
+
+/* Map a chunk of at least 'size' bytes. Big chunks are aligned to the
+ * huge page size: with GGUF_ARENA_HUGEPAGES explicit huge pages are
+ * tried first (they need to be reserved by the system administrator),
+ * then transparent huge pages are requested. */
+static struct gguf_arena_chunk *gguf_arena_map(gguf_arena *a, uint64_t size) {
+    int huge = size >= GGUF_HUGE_PAGE_SIZE;
+    uint64_t page = huge ? GGUF_HUGE_PAGE_SIZE : 4096;
+    size += gguf_get_alignment_padding(page,size);
+    if (a->max_size && a->mapped+size > a->max_size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    struct gguf_arena_chunk *c = calloc(1,sizeof(*c));
+    if (c == NULL) return NULL;
+    void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (huge && (a->flags & GGUF_ARENA_HUGEPAGES)) {
+        p = mmap(NULL,size,PROT_READ|PROT_WRITE,
+                 MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB,-1,0);
+        if (p != MAP_FAILED) c->map_size = size;
+    }
+#endif
+    if (p == MAP_FAILED) {
+        /* Map one more huge page, to trim the mapping at both sides so
+         * that it starts at a huge page boundary. */
+        uint64_t map_size = huge ? size+GGUF_HUGE_PAGE_SIZE : size;
+        uint8_t *m = mmap(NULL,map_size,PROT_READ|PROT_WRITE,
+                          MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+        if (m == MAP_FAILED) {
+            free(c);
+            return NULL;
+        }
+        p = m;
+        if (huge) {
+            uint64_t head = gguf_get_alignment_padding(GGUF_HUGE_PAGE_SIZE,
+                                                       (uintptr_t)m);
+            if (head) munmap(m,head);
+            munmap(m+head+size,map_size-head-size);
+            p = m+head;
+#ifdef MADV_HUGEPAGE
+            if (a->flags & GGUF_ARENA_HUGEPAGES)
+                madvise(p,size,MADV_HUGEPAGE);
+#endif
+        }
+        c->map_size = size;
+    }
+    c->data = p;
+    c->size = size;
+    a->mapped += size;
+    return c;
+}
+
+static void gguf_arena_unmap(gguf_arena *a, struct gguf_arena_chunk *c) {
+    munmap(c->data,c->map_size);
+    a->mapped -= c->map_size;
+    free(c);
+}
+
+/* Create a scratch arena. If 'max_size' is not zero, the arena will
+ * never map more than 'max_size' bytes: allocations that would need
+ * more fail with ENOMEM. The only flag is GGUF_ARENA_HUGEPAGES, to back
+ * big buffers with huge pages (explicit ones if available, otherwise
+ * transparent huge pages).
+ *
+ * The arena is not thread safe: use an arena per thread.
+ * Return NULL on out of memory. */
+gguf_arena *gguf_arena_new(uint64_t max_size, int flags) {
+    gguf_arena *a = calloc(1,sizeof(*a));
+    if (a == NULL) return NULL;
+    a->max_size = max_size;
+    a->flags = flags;
+    return a;
+}
+
+/* Allocate 'size' bytes from the arena, aligned to GGUF_ARENA_ALIGN bytes.
+ * The memory is not initialized, and stays valid until the next
+ * gguf_arena_reset() or gguf_arena_free(). Return NULL on error. */
+void *gguf_arena_alloc(gguf_arena *a, uint64_t size) {
+    struct gguf_arena_chunk *c = a->chunk;
+    size += gguf_get_alignment_padding(GGUF_ARENA_ALIGN,size);
+    if (size == 0) size = GGUF_ARENA_ALIGN;
+    if (c == NULL || c->size-c->used < size) {
+        /* Grow geometrically, so that runs needing many buffers settle
+         * on a single chunk after a few resets. */
+        uint64_t want = c ? c->size*2 : 0;
+        if (want < size) want = size;
+        struct gguf_arena_chunk *nc = gguf_arena_map(a,want);
+        if (nc == NULL && want > size) nc = gguf_arena_map(a,size);
+        if (nc == NULL) return NULL;
+        nc->next = c;
+        a->chunk = c = nc;
+    }
+    void *p = c->data+c->used;
+    c->used += size;
+    a->used += size;
+    if (a->used > a->high_water) a->high_water = a->used;
+    return p;
+}
+
+/* Release all the buffers allocated from the arena, that can be reused
+ * by the next allocations. If the last run used more than one chunk,
+ * they are replaced by a single chunk of the high-water mark size. */
+void gguf_arena_reset(gguf_arena *a) {
+    struct gguf_arena_chunk *c = a->chunk;
+    if (c == NULL) return;
+    if (c->next) {
+        while (c) {
+            struct gguf_arena_chunk *next = c->next;
+            gguf_arena_unmap(a,c);
+            c = next;
+        }
+        a->chunk = gguf_arena_map(a,a->high_water); // NULL is fine.
+    } else {
+        c->used = 0;
+    }
+    a->used = 0;
+}
+
+/* Unmap all the chunks and free the arena. */
+void gguf_arena_free(gguf_arena *a) {
+    if (a == NULL) return;
+    struct gguf_arena_chunk *c = a->chunk;
+    while (c) {
+        struct gguf_arena_chunk *next = c->next;
+        gguf_arena_unmap(a,c);
+        c = next;
+    }
+    free(a);
+}
+
+/* Return the bytes currently mapped by the arena. */
+uint64_t gguf_arena_size(gguf_arena *a) {
+    return a->mapped;
+}
+
+/* ========================= Tensors conversion API ========================= */
+
+/* Conversion functions of every supported tensor type, indexed by
+ * type ID. Unsupported types have NULL entries. */
+#define GGUF_DEQUANT_ENTRY(type_id,type) \
+    [type_id] = {gguf_##type##_to_float, gguf_##type##_to_f16, \
+                 gguf_##type##_to_bf16}
+static const struct {
+    dequant_func to_float, to_f16, to_bf16;
+} DequantFuncs[GGUF_TYPE_COUNT] = {
+    GGUF_DEQUANT_ENTRY(GGUF_TYPE_F32,f32),
+    GGUF_DEQUANT_ENTRY(GGUF_TYPE_F16,f16),
+    GGUF_DEQUANT_ENTRY(GGUF_TYPE_BF16,bf16),
+    GGUF_DEQUANT_ENTRY(GGUF_TYPE_Q8_0,q8_0),
+    GGUF_DEQUANT_ENTRY(GGUF_TYPE_Q4_0,q4_0),
+    GGUF_DEQUANT_ENTRY(GGUF_TYPE_Q4_1,q4_1),
+    GGUF_DEQUANT_ENTRY(GGUF_TYPE_Q5_0,q5_0),
+    GGUF_DEQUANT_ENTRY(GGUF_TYPE_Q5_1,q5_1),
+    GGUF_DEQUANT_ENTRY(GGUF_TYPE_Q8_K,q8_k),
+    GGUF_DEQUANT_ENTRY(GGUF_TYPE_Q2_K,q2_k),
+    GGUF_DEQUANT_ENTRY(GGUF_TYPE_Q3_K,q3_k),
+    GGUF_DEQUANT_ENTRY(GGUF_TYPE_Q4_K,q4_k),
+    GGUF_DEQUANT_ENTRY(GGUF_TYPE_Q5_K,q5_k),
+    GGUF_DEQUANT_ENTRY(GGUF_TYPE_Q6_K,q6_k),
+    GGUF_DEQUANT_ENTRY(GGUF_TYPE_IQ4_NL,iq4_nl),
+    GGUF_DEQUANT_ENTRY(GGUF_TYPE_IQ4_XS,iq4_xs),
+};
+#undef GGUF_DEQUANT_ENTRY
+
+/* Return the function converting tensors of the specified type into the
+ * 'dst_type' format (GGUF_TYPE_F32, F16 or BF16), or NULL if the type is
+ * not supported. */
+static dequant_func gguf_get_dequant_func(uint32_t type, uint32_t dst_type) {
+    if (type >= GGUF_TYPE_COUNT) return NULL;
+    if (dst_type == GGUF_TYPE_F32) return DequantFuncs[type].to_float;
+    if (dst_type == GGUF_TYPE_F16) return DequantFuncs[type].to_f16;
+    return DequantFuncs[type].to_bf16;
+}
+
+/* Return 1 if tensors of the specified type can be converted to floats
+ * with gguf_tensor_convert_range() and the other conversion functions. */
+int gguf_can_dequantize(uint32_t type) {
+    return gguf_get_dequant_func(type,GGUF_TYPE_F32) != NULL;
+}
+
+/* Return the size of a single weight stored in the output format
+ * 'dst_type', that is GGUF_TYPE_F32, GGUF_TYPE_F16 or GGUF_TYPE_BF16. */
+static size_t gguf_output_weight_size(uint32_t dst_type) {
+    return dst_type == GGUF_TYPE_F32 ? sizeof(float) : sizeof(uint16_t);
+}
+
+/* Convert 'count' weights of the tensor, starting from the weight
+ * 'first', that must be at the start of a block, into 'dst' using
+ * the output format 'dst_type' (GGUF_TYPE_F32, F16 or BF16).
+ * The converted weights are written starting from dst[0].
+ *
+ * Return 1 on success, 0 if the tensor type is not supported. */
+static int gguf_tensor_convert(gguf_tensor *tensor, uint32_t dst_type, uint64_t first, uint64_t count, void *dst) {
+    struct gguf_tensor_type_features *tf =
+        gguf_get_tensor_type_features(tensor->type);
+    uint8_t *weights = tensor->weights_data +
+                       first/tf->items_per_block*tf->bytes_per_block;
+    uint64_t start = gguf_stats_now();
+
+    if (tensor->type == dst_type) {
+        memcpy(dst,weights,count*gguf_output_weight_size(dst_type));
+    } else {
+        dequant_func dequant = gguf_get_dequant_func(tensor->type,dst_type);
+        if (dequant == NULL) return 0;
+        dequant(weights,dst,count);
+    }
+
+    if (StatsEnabled) {
+        gguf_dequant_stats *ds = DequantStats+tensor->type;
+        uint64_t blocks = (count+tf->items_per_block-1)/tf->items_per_block;
+        __atomic_fetch_add(&ds->calls,1,__ATOMIC_RELAXED);
+        __atomic_fetch_add(&ds->weights,count,__ATOMIC_RELAXED);
+        __atomic_fetch_add(&ds->bytes,blocks*tf->bytes_per_block,__ATOMIC_RELAXED);
+        __atomic_fetch_add(&ds->ns,gguf_stats_now()-start,__ATOMIC_RELAXED);
+    }
+    return 1;
+}
+
+/* Convert 'count' weights of the tensor, starting from the weight 'first',
+ * into the caller provided array 'dst', that must have space for 'count'
+ * weights in the 'dst_type' format (GGUF_TYPE_F32, GGUF_TYPE_F16 or
+ * GGUF_TYPE_BF16). Only the blocks covering the range are decoded, so
+ * big tensors can be processed in chunks using a small, fixed size buffer.
+ *
+ * 'first' must be a multiple of the type items_per_block (see
+ * gguf_get_tensor_type_features()), while 'count' can be any value:
+ * the last block may be decoded only partially.
+ *
+ * Return 1 on success. On error 0 is returned and errno is set to EINVAL:
+ * the tensor type is not supported, 'first' is not at the start of a
+ * block or the range is outside the tensor. */
+int gguf_tensor_convert_range(gguf_tensor *tensor, uint32_t dst_type, uint64_t first, uint64_t count, void *dst) {
+    struct gguf_tensor_type_features *tf =
+        gguf_get_tensor_type_features(tensor->type);
+    if (tf == NULL || tf->items_per_block == 0 ||
+        (dst_type != GGUF_TYPE_F32 && dst_type != GGUF_TYPE_F16 &&
+         dst_type != GGUF_TYPE_BF16) ||
+        first % tf->items_per_block != 0 ||
+        first > tensor->num_weights || count > tensor->num_weights-first ||
+        gguf_tensor_convert(tensor,dst_type,first,count,dst) == 0)
+    {
+        errno = EINVAL;
+        return 0;
+    }
+    return 1;
+}
+
+/* Like gguf_tensor_convert_range() with F32 output. */
+int gguf_dequant_range(gguf_tensor *tensor, uint64_t first, uint64_t count, float *dst) {
+    return gguf_tensor_convert_range(tensor,GGUF_TYPE_F32,first,count,dst);
+}
+
+/* Job of gguf_tensor_convert_mt(): every job converts a chunk of
+ * GGUF_CONVERT_CHUNK weights (the last one may be shorter). */
+#define GGUF_CONVERT_CHUNK (1<<16)  // Multiple of every block size.
+struct gguf_convert_job {
+    gguf_tensor *tensor;
+    uint32_t dst_type;
+    uint8_t *dst;
+};
+
+static void gguf_convert_job(void *privdata, uint64_t jobid) {
+    struct gguf_convert_job *cj = privdata;
+    uint64_t first = jobid*GGUF_CONVERT_CHUNK;
+    uint64_t count = cj->tensor->num_weights - first;
+    if (count > GGUF_CONVERT_CHUNK) count = GGUF_CONVERT_CHUNK;
+    gguf_tensor_convert(cj->tensor,cj->dst_type,first,count,
+        cj->dst+first*gguf_output_weight_size(cj->dst_type));
+}
+
+/* Convert the whole tensor to the 'dst_type' format, splitting the work
+ * on blocks boundaries across 'nthreads' threads. Blocks are independent,
+ * so the result is the same as converting the tensor with a single
+ * thread. The array is allocated with malloc(), or from 'arena' if not
+ * NULL (see gguf_arena_new()).
+ *
+ * On OOM, NULL is returned. If the tensor format is not yet supported,
+ * NULL is returned as well, but errno is set to EINVAL. */
+static void *gguf_tensor_convert_mt(gguf_tensor *tensor, uint32_t dst_type, int nthreads, gguf_arena *arena) {
+    if (gguf_get_dequant_func(tensor->type,dst_type) == NULL)
+    {
+        errno = EINVAL;
+        return NULL;
     }
+    uint64_t size = tensor->num_weights*gguf_output_weight_size(dst_type);
+    void *dst = arena ? gguf_arena_alloc(arena,size) : malloc(size);
+    if (!dst) return NULL;
+
+    struct gguf_convert_job cj = {tensor, dst_type, dst};
+    uint64_t numjobs = (tensor->num_weights+GGUF_CONVERT_CHUNK-1) /
+                       GGUF_CONVERT_CHUNK;
+    gguf_parallel(nthreads,numjobs,gguf_convert_job,&cj);
+    return dst;
 }
 
 /* Convert the specified tensor (quantized or not) into an array of
@@ -922,96 +4372,293 @@ static void gguf_bf16_to_float(void *weights_data, void *dst, uint64_t count,
  * On OOM, NULL is returned. If the tensor format is not yet supported,
  * NULL is returned as well, but errno is set to EINVAL. */
 float *gguf_tensor_to_float(gguf_tensor *tensor) {
-    float *f = malloc(tensor->num_weights*sizeof(float));
-    if (!f) return NULL;
-    if (tensor->type == GGUF_TYPE_F32) {
-        memcpy(f, tensor->weights_data, tensor->num_weights*sizeof(float));
-    } else if (tensor->type == GGUF_TYPE_F16) {
-        gguf_f16_to_float(tensor->weights_data, f, tensor->num_weights, NULL);
-    } else if (tensor->type == GGUF_TYPE_BF16) {
-        gguf_bf16_to_float(tensor->weights_data, f, tensor->num_weights, NULL);
-    } else if (tensor->type == GGUF_TYPE_Q8_0) {
-        gguf_q8_0_to_float(tensor->weights_data, f, tensor->num_weights, NULL);
-    } else if (tensor->type == GGUF_TYPE_Q4_K) {
-        gguf_q4_k_to_float(tensor->weights_data, f, tensor->num_weights, NULL);
-    } else if (tensor->type == GGUF_TYPE_Q6_K) {
-        gguf_q6_k_to_float(tensor->weights_data, f, tensor->num_weights, NULL);
-    } else if (tensor->type == GGUF_TYPE_Q2_K) {
-        gguf_q2_k_to_float(tensor->weights_data, f, tensor->num_weights, NULL);
-    } else if (tensor->type == GGUF_TYPE_Q4_0) {
-        gguf_q4_0_to_float(tensor->weights_data, f, tensor->num_weights, NULL);
-    } else if (tensor->type == GGUF_TYPE_Q4_1) {
-        gguf_q4_1_to_float(tensor->weights_data, f, tensor->num_weights, NULL);
-    } else {
-        free(f);
-        errno = EINVAL;
-        return NULL;
-    }
-    return f;
+    return gguf_tensor_convert_mt(tensor,GGUF_TYPE_F32,1,NULL);
 }
 
 /* Same as gguf_tensor_to_float() but the result will be an f16 tensor, that is
  * an array of int16_t values. */
 int16_t *gguf_tensor_to_f16(gguf_tensor *tensor) {
-    int16_t *f16 = malloc(tensor->num_weights*sizeof(int16_t));
-    if (!f16) return NULL;
-    if (tensor->type == GGUF_TYPE_F32) {
-        float *f = (float*)tensor->weights_data;
-        for (uint64_t j = 0; j < tensor->num_weights; j++)
-            f16[j] = to_half(f[j]);
-    } else if (tensor->type == GGUF_TYPE_F16) {
-        memcpy(f16, tensor->weights_data, tensor->num_weights*sizeof(int16_t));
-    } else if (tensor->type == GGUF_TYPE_BF16) {
-        gguf_bf16_to_float(tensor->weights_data, f16, tensor->num_weights, gguf_store_f16_callback);
-    } else if (tensor->type == GGUF_TYPE_Q8_0) {
-        gguf_q8_0_to_float(tensor->weights_data, f16, tensor->num_weights, gguf_store_f16_callback);
-    } else if (tensor->type == GGUF_TYPE_Q4_K) {
-        gguf_q4_k_to_float(tensor->weights_data, f16, tensor->num_weights, gguf_store_f16_callback);
-    } else if (tensor->type == GGUF_TYPE_Q6_K) {
-        gguf_q6_k_to_float(tensor->weights_data, f16, tensor->num_weights, gguf_store_f16_callback);
-    } else if (tensor->type == GGUF_TYPE_Q2_K) {
-        gguf_q2_k_to_float(tensor->weights_data, f16, tensor->num_weights, gguf_store_f16_callback);
-    } else if (tensor->type == GGUF_TYPE_Q4_0) {
-        gguf_q4_0_to_float(tensor->weights_data, f16, tensor->num_weights, gguf_store_f16_callback);
-    } else if (tensor->type == GGUF_TYPE_Q4_1) {
-        gguf_q4_1_to_float(tensor->weights_data, f16, tensor->num_weights, gguf_store_f16_callback);
-    } else {
-        free(f16);
-        errno = EINVAL;
-        return NULL;
-    }
-    return f16;
+    return gguf_tensor_convert_mt(tensor,GGUF_TYPE_F16,1,NULL);
 }
 
 /* Same as gguf_tensor_to_float() but the result will be an bf16 tensor, that is
  * an array of int16_t values. */
 int16_t *gguf_tensor_to_bf16(gguf_tensor *tensor) {
-    int16_t *f16 = malloc(tensor->num_weights*sizeof(int16_t));
-    if (!f16) return NULL;
-    if (tensor->type == GGUF_TYPE_F32) {
-        float *f = (float*)tensor->weights_data;
-        for (uint64_t j = 0; j < tensor->num_weights; j++)
-            f16[j] = to_half(f[j]);
-    } else if (tensor->type == GGUF_TYPE_F16) {
-        gguf_f16_to_float(tensor->weights_data, f16, tensor->num_weights, gguf_store_bf16_callback);
-    } else if (tensor->type == GGUF_TYPE_BF16) {
-        memcpy(f16, tensor->weights_data, tensor->num_weights*sizeof(int16_t));
-    } else if (tensor->type == GGUF_TYPE_Q8_0) {
-        gguf_q8_0_to_float(tensor->weights_data, f16, tensor->num_weights, gguf_store_bf16_callback);
-    } else if (tensor->type == GGUF_TYPE_Q4_K) {
-        gguf_q4_k_to_float(tensor->weights_data, f16, tensor->num_weights, gguf_store_bf16_callback);
-    } else if (tensor->type == GGUF_TYPE_Q6_K) {
-        gguf_q6_k_to_float(tensor->weights_data, f16, tensor->num_weights, gguf_store_bf16_callback);
-    } else if (tensor->type == GGUF_TYPE_Q2_K) {
-        gguf_q2_k_to_float(tensor->weights_data, f16, tensor->num_weights, gguf_store_bf16_callback);
-    } else if (tensor->type == GGUF_TYPE_Q4_0) {
-        gguf_q4_0_to_float(tensor->weights_data, f16, tensor->num_weights, gguf_store_bf16_callback);
-    } else if (tensor->type == GGUF_TYPE_Q4_1) {
-        gguf_q4_1_to_float(tensor->weights_data, f16, tensor->num_weights, gguf_store_bf16_callback);
-    } else {
-        free(f16);
+    return gguf_tensor_convert_mt(tensor,GGUF_TYPE_BF16,1,NULL);
+}
+
+/* Multi threaded versions of the above functions: the tensor blocks are
+ * dequantized by 'nthreads' threads. */
+float *gguf_tensor_to_float_mt(gguf_tensor *tensor, int nthreads) {
+    return gguf_tensor_convert_mt(tensor,GGUF_TYPE_F32,nthreads,NULL);
+}
+
+int16_t *gguf_tensor_to_f16_mt(gguf_tensor *tensor, int nthreads) {
+    return gguf_tensor_convert_mt(tensor,GGUF_TYPE_F16,nthreads,NULL);
+}
+
+int16_t *gguf_tensor_to_bf16_mt(gguf_tensor *tensor, int nthreads) {
+    return gguf_tensor_convert_mt(tensor,GGUF_TYPE_BF16,nthreads,NULL);
+}
+
+/* Like the _mt functions above, but the array is allocated from the
+ * scratch arena 'arena', so it must not be freed: it stays valid until
+ * the arena is reset. Tools converting many tensors, one after the
+ * other, can reset the arena after every tensor to reuse the same
+ * memory for the whole run. */
+float *gguf_tensor_to_float_into(gguf_tensor *tensor, gguf_arena *arena, int nthreads) {
+    return gguf_tensor_convert_mt(tensor,GGUF_TYPE_F32,nthreads,arena);
+}
+
+int16_t *gguf_tensor_to_f16_into(gguf_tensor *tensor, gguf_arena *arena, int nthreads) {
+    return gguf_tensor_convert_mt(tensor,GGUF_TYPE_F16,nthreads,arena);
+}
+
+int16_t *gguf_tensor_to_bf16_into(gguf_tensor *tensor, gguf_arena *arena, int nthreads) {
+    return gguf_tensor_convert_mt(tensor,GGUF_TYPE_BF16,nthreads,arena);
+}
+
+/* ============================ GGUF quantization =========================== */
+
+/* Block encoders are the inverse of the block decoders: they get
+ * items_per_block floats and emit a block in the target format. These are
+ * simple reference quantizers: each scale is derived from the range of
+ * the weights it covers, with no iterative search for the scale
+ * minimizing the error, so the quality is a bit lower than the
+ * llama.cpp importance-aware quantizers, but the blocks layout is
+ * exactly the one the decoders (and llama.cpp) expect. */
+typedef void (*block_encoder)(const float *src, uint8_t *block);
+
+/* Q8_0 block encoder, see gguf_q8_0_block_scalar() for the layout. */
+static void gguf_q8_0_block_encode(const float *src, uint8_t *block) {
+    float amax = 0;
+    for (uint32_t j = 0; j < 32; j++)
+        if (fabsf(src[j]) > amax) amax = fabsf(src[j]);
+
+    float scale = amax / 127;
+    float iscale = scale ? 1/scale : 0;
+    *((uint16_t*)block) = to_half(scale);
+    int8_t *q = (int8_t*)(block+2);
+    for (uint32_t j = 0; j < 32; j++)
+        q[j] = lrintf(src[j]*iscale);
+}
+
+/* Q4_0 block encoder, see gguf_q4_0_block_scalar() for the layout.
+ * Quants are in the -8..7 range: the weight with the greatest absolute
+ * value is mapped to -8, so that its sign uses the widest side. */
+static void gguf_q4_0_block_encode(const float *src, uint8_t *block) {
+    float amax = 0, max = 0;
+    for (uint32_t j = 0; j < 32; j++) {
+        if (fabsf(src[j]) > amax) {
+            amax = fabsf(src[j]);
+            max = src[j];
+        }
+    }
+
+    float scale = max / -8;
+    float iscale = scale ? 1/scale : 0;
+    *((uint16_t*)block) = to_half(scale);
+    uint8_t *q = block+2;
+    for (uint32_t j = 0; j < 16; j++) {
+        int q0 = lrintf(src[j]*iscale) + 8;
+        int q1 = lrintf(src[j+16]*iscale) + 8;
+        if (q0 < 0) q0 = 0; else if (q0 > 15) q0 = 15;
+        if (q1 < 0) q1 = 0; else if (q1 > 15) q1 = 15;
+        q[j] = q0 | (q1 << 4);
+    }
+}
+
+/* Q4_K block encoder, see gguf_q4_k_block_scalar() for the layout. */
+static void gguf_q4_k_block_encode(const float *src, uint8_t *block) {
+    /* Compute the scale and min of each sub-block of 32 weights. The min
+     * is stored as a positive value that is subtracted, so it is zero
+     * if all the weights are positive. */
+    float scales[8], mins[8], max_scale = 0, max_min = 0;
+    for (int b = 0; b < 8; b++) {
+        const float *x = src+b*32;
+        float min = x[0], max = x[0];
+        for (int j = 1; j < 32; j++) {
+            if (x[j] < min) min = x[j];
+            if (x[j] > max) max = x[j];
+        }
+        if (min > 0) min = 0;
+        scales[b] = (max-min)/15;
+        mins[b] = -min;
+        if (scales[b] > max_scale) max_scale = scales[b];
+        if (mins[b] > max_min) max_min = mins[b];
+    }
+
+    /* Quantize the scales and mins to 6 bits. */
+    float scales_scale = max_scale/63, mins_scale = max_min/63;
+    float iscales_scale = scales_scale ? 1/scales_scale : 0;
+    float imins_scale = mins_scale ? 1/mins_scale : 0;
+    uint8_t d[8], m[8];
+    for (int b = 0; b < 8; b++) {
+        int ld = lrintf(scales[b]*iscales_scale);
+        int lm = lrintf(mins[b]*imins_scale);
+        d[b] = ld > 63 ? 63 : ld;
+        m[b] = lm > 63 ? 63 : lm;
+    }
+    *((uint16_t*)block) = to_half(scales_scale);
+    *((uint16_t*)(block+2)) = to_half(mins_scale);
+
+    /* Use the actual FP16 super scales to compute the quants, so that
+     * the rounding errors of the scales are taken into account. */
+    scales_scale = from_half(*((uint16_t*)block));
+    mins_scale = from_half(*((uint16_t*)(block+2)));
+    block += 4;
+
+    uint8_t *sm = block; // The 12 bytes of packed scales/mins.
+    memset(sm,0,12);
+    for (int j = 0; j < 8; j++) {
+        if (j < 4) {
+            sm[j] = d[j];
+            sm[j+4] = m[j];
+        } else {
+            sm[j+4] = (d[j] & 0xF) | ((m[j] & 0xF) << 4);
+            sm[j-4] |= (d[j] >> 4) << 6;
+            sm[j] |= (m[j] >> 4) << 6;
+        }
+    }
+    block += 12;
+
+    /* Two sub-blocks per 32 bytes: the first in the lower 4 bits,
+     * the second in the higher 4 bits. */
+    uint8_t q[256];
+    for (int b = 0; b < 8; b++) {
+        float scale = d[b]*scales_scale;
+        float min = m[b]*mins_scale;
+        float iscale = scale ? 1/scale : 0;
+        for (int j = 0; j < 32; j++) {
+            int l = lrintf((src[b*32+j]+min)*iscale);
+            q[b*32+j] = l < 0 ? 0 : (l > 15 ? 15 : l);
+        }
+    }
+    for (int b = 0; b < 8; b += 2) {
+        for (int j = 0; j < 32; j++)
+            block[j] = q[b*32+j] | (q[(b+1)*32+j] << 4);
+        block += 32;
+    }
+}
+
+/* Q6_K block encoder, see gguf_q6_k_block_scalar() for the layout. */
+static void gguf_q6_k_block_encode(const float *src, uint8_t *block) {
+    /* Compute the scale of each sub-block of 16 weights, keeping the
+     * sign of the weight with the greatest absolute value, that is mapped
+     * to -32 (the widest side of the -32..31 range), like in Q4_0. */
+    float scales[16], max_scale = 0, amax_scale = 0;
+    for (int b = 0; b < 16; b++) {
+        float amax = 0, max = 0;
+        for (int j = 0; j < 16; j++) {
+            float v = src[b*16+j];
+            if (fabsf(v) > amax) {
+                amax = fabsf(v);
+                max = v;
+            }
+        }
+        scales[b] = max / -32;
+        if (fabsf(scales[b]) > amax_scale) {
+            amax_scale = fabsf(scales[b]);
+            max_scale = scales[b];
+        }
+    }
+
+    /* Quantize the scales to 8 bits, again mapping the greatest one
+     * to -128. */
+    float super_scale = max_scale / -128;
+    float isuper_scale = super_scale ? 1/super_scale : 0;
+    uint16_t *sscale = (uint16_t*)(block+128+64+16);
+    *sscale = to_half(super_scale);
+    super_scale = from_half(*sscale);
+
+    int8_t *qscales = (int8_t*)block+128+64;
+    for (int b = 0; b < 16; b++) {
+        int l = lrintf(scales[b]*isuper_scale);
+        qscales[b] = l < -128 ? -128 : (l > 127 ? 127 : l);
+    }
+
+    /* Compute the quants, stored as unsigned 6 bit values adding 32. */
+    uint8_t q[256];
+    for (int b = 0; b < 16; b++) {
+        float scale = super_scale*qscales[b];
+        float iscale = scale ? 1/scale : 0;
+        for (int j = 0; j < 16; j++) {
+            int l = lrintf(src[b*16+j]*iscale);
+            l = l < -32 ? -32 : (l > 31 ? 31 : l);
+            q[b*16+j] = l+32;
+        }
+    }
+
+    /* Split the quants in the lower 4 bits array L and the higher 2 bits
+     * array H, two clusters of 128 weights. */
+    uint8_t *L = block, *H = block+128;
+    memset(block,0,128+64);
+    for (int cluster = 0; cluster < 2; cluster++) {
+        const uint8_t *cq = q+cluster*128;
+        for (int j = 0; j < 128; j++) {
+            L[j%64] |= (cq[j] & 0xF) << (j/64*4);
+            H[j%32] |= (cq[j] >> 4) << (j/32*2);
+        }
+        L += 64;
+        H += 32;
+    }
+}
+
+/* Define gguf_float_to_<type>(), that quantizes 'count' floats from
+ * 'src' into blocks of the specified format stored at 'dst'. 'count'
+ * must be a multiple of the format items per block. */
+#define GGUF_QUANT_FUNC(type,items_per_block,bytes_per_block) \
+void gguf_float_to_##type(const float *src, void *dst, uint64_t count) { \
+    uint8_t *block = dst; \
+    for (uint64_t i = 0; i < count; i += items_per_block) { \
+        gguf_##type##_block_encode(src+i,block); \
+        block += bytes_per_block; \
+    } \
+}
+
+GGUF_QUANT_FUNC(q8_0,32,34)
+GGUF_QUANT_FUNC(q4_0,32,18)
+GGUF_QUANT_FUNC(q4_k,256,144)
+GGUF_QUANT_FUNC(q6_k,256,210)
+
+/* Return 1 if gguf_float_to_type() can produce the specified type. */
+int gguf_can_quantize(uint32_t type) {
+    switch(type) {
+    case GGUF_TYPE_F32: case GGUF_TYPE_F16: case GGUF_TYPE_BF16:
+    case GGUF_TYPE_Q8_0: case GGUF_TYPE_Q4_0:
+    case GGUF_TYPE_Q4_K: case GGUF_TYPE_Q6_K:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/* Convert 'count' floats from 'src' into the tensor format 'type',
+ * writing the result at 'dst', that must have space for
+ * count/items_per_block*bytes_per_block bytes.
+ *
+ * Large tensors can be quantized in parallel by splitting them in
+ * ranges starting at block boundaries, since blocks are independent.
+ *
+ * Return 1 on success. On error 0 is returned and errno is set to EINVAL:
+ * the type is not supported (see gguf_can_quantize()) or 'count' is not
+ * a multiple of the type items per block. */
+int gguf_float_to_type(uint32_t type, const float *src, void *dst, uint64_t count) {
+    struct gguf_tensor_type_features *tf = gguf_get_tensor_type_features(type);
+    if (!gguf_can_quantize(type) || count % tf->items_per_block != 0) {
         errno = EINVAL;
-        return NULL;
+        return 0;
     }
-    return f16;
+
+    pthread_once(&gguf_kernels_once,gguf_select_kernels);
+    switch(type) {
+    case GGUF_TYPE_F32: memcpy(dst,src,count*sizeof(float)); break;
+    case GGUF_TYPE_F16: Kernels.store_f16(dst,src,count); break;
+    case GGUF_TYPE_BF16: Kernels.store_bf16(dst,src,count); break;
+    case GGUF_TYPE_Q8_0: gguf_float_to_q8_0(src,dst,count); break;
+    case GGUF_TYPE_Q4_0: gguf_float_to_q4_0(src,dst,count); break;
+    case GGUF_TYPE_Q4_K: gguf_float_to_q4_k(src,dst,count); break;
+    case GGUF_TYPE_Q6_K: gguf_float_to_q6_k(src,dst,count); break;
+    }
+    return 1;
 }
@@ -15,6 +15,18 @@
 /* Flags that can be used in different functions with the same meaning. */
 #define GGUF_NONE           0           // No flags.
 #define GGUF_OVERWRITE      (1<<0)      // Overwrite the destination object.
+#define GGUF_RDONLY         (1<<1)      // Open the file in read-only mode.
+#define GGUF_BUFFERED       (1<<2)      // Stage writes in memory.
+
+/* Access hints, see gguf_advise() and gguf_advise_tensor(). */
+#define GGUF_ADVICE_NORMAL      0   // No special treatment.
+#define GGUF_ADVICE_SEQUENTIAL  1   // Data will be accessed in order.
+#define GGUF_ADVICE_RANDOM      2   // Data will be accessed randomly.
+#define GGUF_ADVICE_WILLNEED    3   // Data will be accessed soon.
+#define GGUF_ADVICE_DONTNEED    4   // Data will not be accessed again.
+
+/* Sidecar index file name extension, see gguf_write_sidecar(). */
+#define GGUF_SIDECAR_EXT ".ggufidx"
 
 enum gguf_tensor_type {
     GGUF_TYPE_F32  = 0,
@@ -135,6 +147,14 @@ struct gguf_header {
     uint64_t metadata_kv_count;
 };
 
+/* Tensor type features, see gguf_get_tensor_type_features(). Quantized
+ * types store weights in blocks of N weights using M bytes. */
+struct gguf_tensor_type_features {
+    char *name;
+    uint32_t items_per_block;
+    uint32_t bytes_per_block;
+};
+
 /* Key representation in this library API. */
 typedef struct {
     const char *name;
@@ -157,9 +177,52 @@ typedef struct {
     uint8_t *weights_data;              // Pointer to the mmaped file.
 } gguf_tensor;
 
+/* Header information decoded in a single pass and cached in the context,
+ * see gguf_load_header(). The tensors info is stored as a struct of
+ * arrays, indexed by tensor number. Offsets are from the start of the file. */
+typedef struct {
+    uint64_t *kv_off;               // Offset of each key-value pair.
+    uint64_t tensors_info_off;      // Offset of the tensors info section.
+    uint64_t *tensor_info_off;      // Offset of each tensor info.
+    uint32_t *tensor_type;          // Type of each tensor.
+    uint64_t *tensor_offset;        // Offset of each tensor data.
+    uint64_t *tensor_weights;       // Number of weights of each tensor.
+    uint64_t *tensor_bsize;         // Bytes used by each tensor.
+    uint64_t *tensor_hash;          // Content hash of each tensor, NULL if
+                                    // not computed. See gguf_hash_tensors().
+    void *map;                      // Sidecar file mapping the arrays point
+    uint64_t map_size;              // to, or NULL. See gguf_load_sidecar().
+} gguf_header_cache;
+
+/* Counters and times (in nanoseconds) of a context, updated only after
+ * gguf_stats_enable() is called. See also gguf_get_stats(), returning
+ * the totals of all the contexts. */
+typedef struct {
+    uint64_t remaps;                // Number of file (re)mappings.
+    uint64_t bytes_mapped;          // Bytes mapped, summed over the remaps.
+    uint64_t remap_ns;              // Time spent mapping the file.
+    uint64_t header_loads;          // Headers decoded or sidecars loaded.
+    uint64_t header_ns;             // Time spent loading the header.
+    uint64_t writes;                // Write calls to the file.
+    uint64_t bytes_written;         // Bytes written, padding included.
+    uint64_t write_ns;              // Time spent writing.
+    uint64_t reads;                 // Read calls of the streaming reader.
+    uint64_t bytes_read;            // Bytes read by the streaming reader.
+    uint64_t read_ns;               // Time spent reading.
+} gguf_stats;
+
+/* Global per tensor type conversion counters, see gguf_get_dequant_stats(). */
+typedef struct {
+    uint64_t calls;                 // Conversion calls (chunks).
+    uint64_t weights;               // Weights converted.
+    uint64_t bytes;                 // Bytes of input tensor data.
+    uint64_t ns;                    // Time spent converting.
+} gguf_dequant_stats;
+
 /* The context you get after opening a GGUF file with gguf_init(). */
 typedef struct {
     int fd;
+    int flags;      // Flags used to open the file, see gguf_open_flags().
     uint8_t *data;  // Memory mapped data.
     uint64_t size;  // Total file size.
     struct gguf_header *header;     // GUFF file header info.
@@ -170,19 +233,93 @@ typedef struct {
                                     // is only set when all the kv/tensor header
                                     // entries are processed. Initially 0.
     uint64_t alignment;             // File data alignment. Default: 32 bytes.
+    gguf_tensor *tensors;           // Tensors info array, NULL if the index
+                                    // was not built. See gguf_build_index().
+    uint32_t *index;                // Open addressing hash table of tensors:
+                                    // each slot is tensor number+1, 0 = empty.
+    uint64_t index_size;            // Number of slots, always a power of two.
+    uint8_t *wbuf;                  // GGUF_BUFFERED writers staging buffer.
+    uint64_t wbuf_len;              // Bytes used in the staging buffer.
+    uint64_t wbuf_alloc;            // Bytes allocated for the staging buffer.
+    int staged_written;             // True if the staged data is written.
+    gguf_header_cache *hcache;      // Decoded header, NULL if not loaded.
+    gguf_stats stats;               // See gguf_stats_enable().
 } gguf_ctx;
 
+#define GGUF_MAX_BLOCK_SCALES 16 // See gguf_block_scales().
+
+/* Scratch memory for temporary buffers, see gguf_arena_new(). */
+typedef struct gguf_arena gguf_arena;
+
+#define GGUF_ARENA_HUGEPAGES 1  // Back big buffers with huge pages.
+
+/* A model split in many GGUF files, see gguf_shards_open(). */
+#define GGUF_SHARD_FORMAT "%.*s-%05u-of-%05u.gguf" // Prefix, number, count.
+typedef struct {
+    uint32_t count;                 // Number of shards.
+    int flags;                      // Flags used to open the shards.
+    char **filenames;               // File name of every shard.
+    gguf_ctx **ctx;                 // Shard contexts, NULL if not opened.
+    uint64_t tensor_count;          // Total number of tensors.
+    uint32_t *tensor_shard;         // Shard and tensor number inside the
+    uint64_t *tensor_idx;           // shard of every tensor, NULL if the
+                                    // index was not built.
+    uint32_t *index;                // Tensors hash table: each slot is the
+                                    // global tensor number+1, 0 = empty.
+    uint64_t index_size;            // Number of slots, a power of two.
+} gguf_shards;
+
+/* Stream of tensors data chunks, see gguf_stream_open(). */
+typedef struct gguf_stream gguf_stream;
+
+#define GGUF_STREAM_MMAP    0   // Chunks point inside the file mapping.
+#define GGUF_STREAM_PREAD   1   // Chunks are read with pread().
+#define GGUF_STREAM_DIRECT  2   // Chunks are read with pread() + O_DIRECT.
+
+/* A tensor to write with gguf_pipeline_run(). */
+typedef struct {
+    gguf_tensor src;        // Source tensor, from the input context.
+    uint64_t dst_offset;    // Output offset, relative to the data section.
+    uint64_t dst_size;      // Output data size in bytes.
+    int copy;               // Copy the source data as it is.
+} gguf_pipeline_tensor;
+
+/* Transform callback of gguf_pipeline_run(). */
+typedef int (*gguf_transform_func)(void *privdata, uint64_t idx, gguf_tensor *src, void *dst);
+
 /* =============================== Prototypes =============================== */
 
 gguf_ctx *gguf_open(const char *filename);
+gguf_ctx *gguf_open_flags(const char *filename, int flags);
 gguf_ctx *gguf_create(const char *filename, int flags);
 int gguf_remap(gguf_ctx *ctx);
+int gguf_flush(gguf_ctx *ctx);
 void gguf_rewind(gguf_ctx *ctx);
 void gguf_close(gguf_ctx *ctx);
 int gguf_get_key(gguf_ctx *ctx, gguf_key *key);
 int gguf_get_tensor(gguf_ctx *ctx, gguf_tensor *tensor);
+int gguf_load_header(gguf_ctx *ctx);
+int gguf_build_index(gguf_ctx *ctx);
+int gguf_find_tensor(gguf_ctx *ctx, const char *name, size_t namelen, gguf_tensor *tensor);
+uint64_t gguf_tensor_hash(gguf_ctx *ctx, gguf_tensor *tensor, int nthreads);
+int gguf_cached_tensor_hash(gguf_ctx *ctx, gguf_tensor *tensor, uint64_t *hash);
+int gguf_hash_tensors(gguf_ctx *ctx, int nthreads);
+int gguf_write_sidecar(gguf_ctx *ctx, const char *filename);
+int gguf_load_sidecar(gguf_ctx *ctx, const char *filename);
+gguf_shards *gguf_shards_open(const char *filename, int flags);
+void gguf_shards_close(gguf_shards *s);
+gguf_ctx *gguf_shards_get_ctx(gguf_shards *s, uint32_t shard);
+int gguf_shards_get_tensor(gguf_shards *s, uint64_t idx, gguf_tensor *tensor, uint32_t *shard);
+int gguf_shards_build_index(gguf_shards *s);
+int gguf_shards_find_tensor(gguf_shards *s, const char *name, size_t namelen, gguf_tensor *tensor, uint32_t *shard);
+int gguf_advise(gguf_ctx *ctx, int advice);
+int gguf_advise_tensor(gguf_ctx *ctx, gguf_tensor *tensor, int advice);
+gguf_stream *gguf_stream_open(gguf_ctx *ctx, gguf_tensor *tensors, uint64_t count, uint64_t chunk_weights, int backend);
+int gguf_stream_next(gguf_stream *s, gguf_tensor *chunk, uint64_t *tensor_idx, uint64_t *first);
+void gguf_stream_close(gguf_stream *s);
 const char *gguf_get_value_type_name(uint32_t type);
 const char *gguf_get_tensor_type_name(uint32_t type);
+struct gguf_tensor_type_features *gguf_get_tensor_type_features(uint32_t type);
 void gguf_do_with_value(gguf_ctx *ctx, uint32_t type, union gguf_value *val,
                         void *privdata, uint64_t in_array, uint64_t array_len,
                         void(*callback)(void *privdata, uint32_t type,
@@ -192,10 +329,40 @@ void gguf_print_value(gguf_ctx *ctx, uint32_t type, union gguf_value *val, int f
 int gguf_append_kv(gguf_ctx *ctx, const char *keyname, uint64_t keylen, uint32_t type, void *val, uint64_t len);
 int gguf_append_tensor_info(gguf_ctx *ctx, const char *tensorname, uint64_t namelen, uint32_t num_dim, uint64_t *dim, uint32_t type, uint64_t offset);
 int gguf_append_tensor_data(gguf_ctx *ctx, void *tensor, uint64_t tensor_size);
+int gguf_append_tensor_from(gguf_ctx *ctx, gguf_ctx *src, gguf_tensor *tensor);
+int gguf_pipeline_run(gguf_ctx *out, gguf_ctx *in, gguf_pipeline_tensor *tensors, uint64_t count, gguf_transform_func transform, void *privdata, uint64_t budget, int backend, int flags);
+int gguf_set_kv(gguf_ctx *ctx, const char *keyname, uint64_t keylen, uint32_t type, void *val, uint64_t len);
+int gguf_del_kv(gguf_ctx *ctx, const char *keyname, uint64_t keylen);
 uint64_t gguf_get_alignment_padding(uint64_t alignment, uint64_t offset);
 void gguf_skip_key_values_section(gguf_ctx *ctx);
 float *gguf_tensor_to_float(gguf_tensor *tensor);
 int16_t *gguf_tensor_to_f16(gguf_tensor *tensor);
 int16_t *gguf_tensor_to_bf16(gguf_tensor *tensor);
+float *gguf_tensor_to_float_mt(gguf_tensor *tensor, int nthreads);
+int16_t *gguf_tensor_to_f16_mt(gguf_tensor *tensor, int nthreads);
+int16_t *gguf_tensor_to_bf16_mt(gguf_tensor *tensor, int nthreads);
+float *gguf_tensor_to_float_into(gguf_tensor *tensor, gguf_arena *arena, int nthreads);
+int16_t *gguf_tensor_to_f16_into(gguf_tensor *tensor, gguf_arena *arena, int nthreads);
+int16_t *gguf_tensor_to_bf16_into(gguf_tensor *tensor, gguf_arena *arena, int nthreads);
+gguf_arena *gguf_arena_new(uint64_t max_size, int flags);
+void *gguf_arena_alloc(gguf_arena *a, uint64_t size);
+void gguf_arena_reset(gguf_arena *a);
+void gguf_arena_free(gguf_arena *a);
+uint64_t gguf_arena_size(gguf_arena *a);
+int gguf_can_dequantize(uint32_t type);
+int gguf_block_scales(uint32_t type, const uint8_t *block, float *scales);
+const char *gguf_kernels_name(void);
+int gguf_tensor_convert_range(gguf_tensor *tensor, uint32_t dst_type, uint64_t first, uint64_t count, void *dst);
+int gguf_dequant_range(gguf_tensor *tensor, uint64_t first, uint64_t count, float *dst);
+void gguf_float_to_q8_0(const float *src, void *dst, uint64_t count);
+void gguf_float_to_q4_0(const float *src, void *dst, uint64_t count);
+void gguf_float_to_q4_k(const float *src, void *dst, uint64_t count);
+void gguf_float_to_q6_k(const float *src, void *dst, uint64_t count);
+int gguf_can_quantize(uint32_t type);
+int gguf_float_to_type(uint32_t type, const float *src, void *dst, uint64_t count);
+void gguf_stats_enable(int enable);
+void gguf_get_stats(gguf_stats *stats);
+int gguf_get_dequant_stats(uint32_t type, gguf_dequant_stats *stats);
+void gguf_parallel(int nthreads, uint64_t numjobs, void (*job)(void *privdata, uint64_t jobid), void *privdata);
 
 #endif
@@ -0,0 +1,51 @@
+/* Write tests/stats.gguf, a file with NaN and Inf weights and scales,
+ * for 'make check' to compare the output of 'gguf-tools stats' with
+ * tests/stats.expected. The tool is built with -ffast-math, that lets
+ * the compiler assume there are no such values: the non finite weights
+ * must be counted apart without affecting the other statistics. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include "gguflib.h"
+#include "fp16.h"
+
+#define CHECK_WEIGHTS 64
+
+int main(void) {
+    const char *filename = "tests/stats.gguf";
+
+    /* F32 weights 0..63, with NaN at 10, +Inf at 20 and -Inf at 30. */
+    float w32[CHECK_WEIGHTS];
+    for (int j = 0; j < CHECK_WEIGHTS; j++) w32[j] = j;
+    w32[10] = NAN;
+    w32[20] = INFINITY;
+    w32[30] = -INFINITY;
+
+    /* Two Q8_0 blocks: the scale of the second one is NaN. */
+    uint8_t q8[2][34];
+    for (int b = 0; b < 2; b++) {
+        uint16_t d = b == 0 ? to_half(0.5f) : 0x7e00;
+        memcpy(q8[b],&d,sizeof(d));
+        for (int j = 0; j < 32; j++) q8[b][2+j] = (uint8_t)(j-16);
+    }
+
+    unlink(filename);
+    gguf_ctx *ctx = gguf_create(filename,GGUF_BUFFERED);
+    uint64_t dim = CHECK_WEIGHTS;
+    if (ctx == NULL ||
+        gguf_append_tensor_info(ctx,"f32",3,1,&dim,GGUF_TYPE_F32,0) == 0 ||
+        gguf_append_tensor_info(ctx,"q8_0",4,1,&dim,GGUF_TYPE_Q8_0,
+                                sizeof(w32)) == 0 ||
+        gguf_append_tensor_data(ctx,w32,sizeof(w32)) == 0 ||
+        gguf_append_tensor_data(ctx,q8,sizeof(q8)) == 0 ||
+        gguf_flush(ctx) == 0)
+    {
+        perror(filename);
+        exit(1);
+    }
+    gguf_close(ctx);
+    return 0;
+}
@@ -0,0 +1,138 @@
+/* Check that converting F32, F16 and BF16 tensors whose length is not a
+ * multiple of 32 weights never reads past the tensor data: every tensor
+ * is the last of its file, and the file ends at a page boundary, so an
+ * over-read of the mapping crashes. The conversions are also performed
+ * on an exact size heap copy of the data, that AddressSanitizer checks.
+ *
+ * Built and run by 'make check', with both the AVX2 and the scalar
+ * kernels. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include "gguflib.h"
+#include "fp16.h"
+#include "bf16.h"
+
+#define CHECK_WEIGHTS 48
+#define CHECK_PAGE 4096
+
+static int failed = 0;
+
+static void check(int cond, const char *what, const char *type) {
+    if (!cond) {
+        fprintf(stderr,"FAILED: %s (%s)\n", what, type);
+        failed = 1;
+    }
+}
+
+/* The weights have exact F16 and BF16 representations. */
+static float check_weight(uint64_t j) {
+    return (float)j*0.25f - 6;
+}
+
+/* Write a file with a padding F32 tensor and the test tensor 'w' of
+ * CHECK_WEIGHTS weights of the given type, so that the data of 'w' ends
+ * exactly at the end of the file, at a page boundary. */
+static void check_create(const char *filename, uint32_t type) {
+    uint64_t wsize = type == GGUF_TYPE_F32 ? 4 : 2;
+    uint64_t wbytes = CHECK_WEIGHTS*wsize;
+
+    /* Header, then the info of the two tensors (1-D, names of 3 and
+     * 1 bytes), then the data section aligned to 32 bytes. */
+    uint64_t header = sizeof(struct gguf_header) + (8+3+4+8+4+8) +
+                      (8+1+4+8+4+8);
+    uint64_t data_off = header + gguf_get_alignment_padding(32,header);
+    /* Both are multiples of 32, so 'w' stays aligned. */
+    uint64_t pad_bytes = CHECK_PAGE - (data_off+wbytes) % CHECK_PAGE;
+
+    unlink(filename);
+    gguf_ctx *ctx = gguf_create(filename,GGUF_BUFFERED);
+    if (ctx == NULL) {
+        perror(filename);
+        exit(1);
+    }
+    uint64_t pad_dim = pad_bytes/4, w_dim = CHECK_WEIGHTS;
+    uint8_t *pad = calloc(1,pad_bytes);
+    uint16_t w16[CHECK_WEIGHTS];
+    float w32[CHECK_WEIGHTS];
+    for (uint64_t j = 0; j < CHECK_WEIGHTS; j++) {
+        w32[j] = check_weight(j);
+        w16[j] = type == GGUF_TYPE_F16 ? to_half(w32[j]) : to_brain(w32[j]);
+    }
+    if (gguf_append_tensor_info(ctx,"pad",3,1,&pad_dim,GGUF_TYPE_F32,0) == 0 ||
+        gguf_append_tensor_info(ctx,"w",1,1,&w_dim,type,pad_bytes) == 0 ||
+        gguf_append_tensor_data(ctx,pad,pad_bytes) == 0 ||
+        gguf_append_tensor_data(ctx,type == GGUF_TYPE_F32 ?
+            (void*)w32 : (void*)w16,wbytes) == 0 ||
+        gguf_flush(ctx) == 0)
+    {
+        perror(filename);
+        exit(1);
+    }
+    free(pad);
+    check(ctx->size % CHECK_PAGE == 0,"file ends at a page boundary",
+          gguf_get_tensor_type_name(type));
+    gguf_close(ctx);
+}
+
+/* Convert the tensor with all the APIs, checking the results. */
+static void check_convert(gguf_tensor *t) {
+    const char *type = gguf_get_tensor_type_name(t->type);
+    float *f = gguf_tensor_to_float(t);
+    int16_t *h = gguf_tensor_to_f16(t);
+    int16_t *b = gguf_tensor_to_bf16(t);
+    check(f && h && b,"conversion",type);
+    if (!f || !h || !b) return;
+    for (uint64_t j = 0; j < CHECK_WEIGHTS; j++) {
+        check(f[j] == check_weight(j),"to float",type);
+        check(from_half(h[j]) == check_weight(j),"to f16",type);
+        check(from_brain(b[j]) == check_weight(j),"to bf16",type);
+    }
+    free(f);
+    free(h);
+    free(b);
+
+    /* Ranges with a partial block at the start and at the end. */
+    float r[CHECK_WEIGHTS];
+    check(gguf_dequant_range(t,0,CHECK_WEIGHTS-3,r) == 1,"range",type);
+    check(gguf_dequant_range(t,32,CHECK_WEIGHTS-32,r+32) == 1,"range",type);
+    for (uint64_t j = 0; j < CHECK_WEIGHTS; j++)
+        if (j < CHECK_WEIGHTS-3 || j >= 32)
+            check(r[j] == check_weight(j),"range",type);
+}
+
+int main(void) {
+    uint32_t types[] = {GGUF_TYPE_F32, GGUF_TYPE_F16, GGUF_TYPE_BF16};
+    printf("Kernels: %s\n", gguf_kernels_name());
+    for (int j = 0; j < 3; j++) {
+        char filename[64];
+        snprintf(filename,sizeof(filename),"tests/tail-%s.gguf",
+                 gguf_get_tensor_type_name(types[j]));
+        check_create(filename,types[j]);
+
+        gguf_ctx *ctx = gguf_open_flags(filename,GGUF_RDONLY);
+        gguf_tensor t;
+        if (ctx == NULL || gguf_find_tensor(ctx,"w",1,&t) == 0) {
+            perror(filename);
+            exit(1);
+        }
+        check(t.offset+t.bsize == ctx->size,"tensor ends the file",
+              gguf_get_tensor_type_name(types[j]));
+
+        /* From the mapping, then from an exact size heap copy. */
+        check_convert(&t);
+        uint8_t *copy = malloc(t.bsize);
+        memcpy(copy,t.weights_data,t.bsize);
+        t.weights_data = copy;
+        check_convert(&t);
+        free(copy);
+
+        gguf_close(ctx);
+        unlink(filename);
+    }
+    printf("%s\n", failed ? "Tail check FAILED" : "Tail check passed");
+    return failed;
+}